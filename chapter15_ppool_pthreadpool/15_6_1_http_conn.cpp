@@ -1,3 +1,4 @@
+#include <sys/sendfile.h>
 #include "15_6_1_http_conn.h"
 
 /*定义HTTP响应的一些状态信息*/
@@ -50,6 +51,8 @@ void modfd( int epollfd, int fd, int ev )
 
 int http_conn::m_user_count = 0;
 int http_conn::m_epollfd = -1;
+file_cache http_conn::m_file_cache( file_cache::DEFAULT_CAPACITY, http_conn::SENDFILE_THRESHOLD );
+bool http_conn::m_print_lines = true;
 
 void http_conn::close_conn( bool real_close )
 {
@@ -58,6 +61,8 @@ void http_conn::close_conn( bool real_close )
         //modfd( m_epollfd, m_sockfd, EPOLLIN );
         removefd( m_epollfd, m_sockfd );
         m_sockfd = -1;
+        /*应答没有发送完连接就关闭了，也要交还文件映射*/
+        unmap();
         m_user_count--; /*关闭一个连接时，将客户总量减1*/
     }
 }
@@ -82,6 +87,32 @@ void http_conn::init( int sockfd, const sockaddr_in& addr )
 }
 
 void http_conn::init()
+{
+    /*上一个连接把读缓冲区扩大了的话，恢复到初始大小*/
+    if ( m_read_size != READ_BUFFER_SIZE )
+    {
+        delete [] m_read_buf;
+        m_read_buf = new char[ READ_BUFFER_SIZE ];
+        m_read_size = READ_BUFFER_SIZE;
+    }
+    m_start_line = 0;
+    m_checked_idx = 0;
+    m_read_idx = 0;
+    m_request_start = 0;
+    m_write_idx = 0;
+    m_response_count = 0;
+    m_keep_alive = false;
+    m_pending = false;
+    m_file = 0;
+    m_file_address = 0;
+    m_file_count = 0;
+    m_iv_count = 0;
+    m_sendfile = 0;
+    m_file_offset = 0;
+    init_request();
+}
+
+void http_conn::init_request()
 {
     m_check_state = CHECK_STATE_REQUESTLINE;
     m_linger = false;
@@ -91,64 +122,104 @@ void http_conn::init()
     m_version = 0;
     m_content_length = 0;
     m_host = 0;
-    m_start_line = 0;
-    m_checked_idx = 0;
-    m_read_idx = 0;
-    m_write_idx = 0;
-    memset( m_read_buf, '\0', READ_BUFFER_SIZE );
-    memset( m_write_buf, '\0', WRITE_BUFFER_SIZE );
     memset( m_real_file, '\0', FILENAME_LEN );
 }
 
-/*从状态机，其分析请参考8.6节，这里不再赘述*/
-http_conn::LINE_STATUS http_conn::parse_line()
+void http_conn::compact_read_buf()
+{
+    int len = m_read_idx - m_request_start;
+    memmove( m_read_buf, m_read_buf + m_request_start, len );
+    rebase( m_read_buf + m_request_start, m_read_buf );
+    m_checked_idx -= m_request_start;
+    m_start_line -= m_request_start;
+    m_read_idx = len;
+    m_request_start = 0;
+}
+
+void http_conn::grow_read_buf()
+{
+    char* buf = new char[ m_read_size * 2 ];
+    memcpy( buf, m_read_buf, m_read_idx );
+    rebase( m_read_buf, buf );
+    delete [] m_read_buf;
+    m_read_buf = buf;
+    m_read_size *= 2;
+}
+
+void http_conn::rebase( const char* from, char* to )
 {
-    char temp;
-    for ( ; m_checked_idx < m_read_idx; ++m_checked_idx )
+    /*解析到一半的请求中，这些指针已经指向读缓冲区内部*/
+    char** ptrs[] = { &m_url, &m_version, &m_host };
+    for ( int i = 0; i < ( int )( sizeof( ptrs ) / sizeof( ptrs[0] ) ); ++i )
     {
-        temp = m_read_buf[ m_checked_idx ];
-        if ( temp == '\r' )
+        if ( *ptrs[i] )
         {
-            if ( ( m_checked_idx + 1 ) == m_read_idx )
-            {
-                return LINE_OPEN;
-            }
-            else if ( m_read_buf[ m_checked_idx + 1 ] == '\n' )
-            {
-                m_read_buf[ m_checked_idx++ ] = '\0';
-                m_read_buf[ m_checked_idx++ ] = '\0';
-                return LINE_OK;
-            }
+            *ptrs[i] = to + ( *ptrs[i] - from );
+        }
+    }
+}
 
-            return LINE_BAD;
+/*从状态机，其分析请参考8.6节，这里不再赘述。
+书中逐字节地查找行结束符，这里用scan_any一次比较16或32个字节，找到第一个'\r'或'\n'之后的判断和书中相同*/
+http_conn::LINE_STATUS http_conn::parse_line()
+{
+    m_checked_idx = scan_any( m_read_buf + m_checked_idx, m_read_buf + m_read_idx, '\r', '\n' ) - m_read_buf;
+    if ( m_checked_idx == m_read_idx )
+    {
+        return LINE_OPEN;
+    }
+
+    if ( m_read_buf[ m_checked_idx ] == '\r' )
+    {
+        if ( ( m_checked_idx + 1 ) == m_read_idx )
+        {
+            return LINE_OPEN;
         }
-        else if( temp == '\n' )
+        else if ( m_read_buf[ m_checked_idx + 1 ] == '\n' )
         {
-            if( ( m_checked_idx > 1 ) && ( m_read_buf[ m_checked_idx - 1 ] == '\r' ) )
-            {
-                m_read_buf[ m_checked_idx-1 ] = '\0';
-                m_read_buf[ m_checked_idx++ ] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
+            m_read_buf[ m_checked_idx++ ] = '\0';
+            m_read_buf[ m_checked_idx++ ] = '\0';
+            return LINE_OK;
         }
-    }
 
-    return LINE_OPEN;
+        return LINE_BAD;
+    }
+    else
+    {
+        if( ( m_checked_idx > 1 ) && ( m_read_buf[ m_checked_idx - 1 ] == '\r' ) )
+        {
+            m_read_buf[ m_checked_idx-1 ] = '\0';
+            m_read_buf[ m_checked_idx++ ] = '\0';
+            return LINE_OK;
+        }
+        return LINE_BAD;
+    }
 }
 
 /*循环读取客户数据，直到无数据可读或者对方关闭连接*/
 bool http_conn::read()
 {
-    if( m_read_idx >= READ_BUFFER_SIZE )
-    {
-        return false;
-    }
-
     int bytes_read = 0;
     while( true )
     {
-        bytes_read = recv( m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0 );
+        if( m_read_idx == m_read_size )
+        {
+            /*缓冲区满了：先移走已经处理完的请求，不够再扩大缓冲区。已经到了上限就先不读了，
+            缓冲区中的请求处理完之后重新注册EPOLLIN，剩下的数据会再触发一次读事件*/
+            if( m_request_start > 0 )
+            {
+                compact_read_buf();
+            }
+            else if( m_read_size < MAX_READ_BUFFER_SIZE )
+            {
+                grow_read_buf();
+            }
+            else
+            {
+                break;
+            }
+        }
+        bytes_read = recv( m_sockfd, m_read_buf + m_read_idx, m_read_size - m_read_idx, 0 );
         if ( bytes_read == -1 )
         {
             if( errno == EAGAIN || errno == EWOULDBLOCK )
@@ -167,11 +238,12 @@ bool http_conn::read()
     return true;
 }
 
-/*解析HTTP请求行，获得请求方法、目标URL，以及HTTP版本号*/
-http_conn::HTTP_CODE http_conn::parse_request_line( char* text )
+/*解析HTTP请求行，获得请求方法、目标URL，以及HTTP版本号。len是请求行的长度*/
+http_conn::HTTP_CODE http_conn::parse_request_line( char* text, int len )
 {
-    m_url = strpbrk( text, " \t" );
-    if ( ! m_url )
+    char* end = text + len;
+    m_url = ( char* )scan_any( text, end, ' ', '\t' );
+    if ( m_url == end )
     {
         return BAD_REQUEST;
     }
@@ -188,8 +260,8 @@ http_conn::HTTP_CODE http_conn::parse_request_line( char* text )
     }
 
     m_url += strspn( m_url, " \t" );
-    m_version = strpbrk( m_url, " \t" );
-    if ( ! m_version )
+    m_version = ( char* )scan_any( m_url, end, ' ', '\t' );
+    if ( m_version == end )
     {
         return BAD_REQUEST;
     }
@@ -199,6 +271,8 @@ http_conn::HTTP_CODE http_conn::parse_request_line( char* text )
     {
         return BAD_REQUEST;
     }
+    /*HTTP/1.1默认保持连接，除非请求中有Connection: close*/
+    m_linger = true;
 
     if ( strncasecmp( m_url, "http://", 7 ) == 0 )
     {
@@ -215,11 +289,11 @@ http_conn::HTTP_CODE http_conn::parse_request_line( char* text )
     return NO_REQUEST;
 }
 
-/*解析HTTP请求的一个头部信息*/
-http_conn::HTTP_CODE http_conn::parse_headers( char* text )
+/*解析HTTP请求的一个头部信息。len是这一行的长度*/
+http_conn::HTTP_CODE http_conn::parse_headers( char* text, int len )
 {
     /*遇到空行，表示头部字段解析完毕*/
-    if( text[ 0 ] == '\0' )
+    if( len == 0 )
     {
         // 以下条件书上没有
         if ( m_method == HEAD )
@@ -229,6 +303,10 @@ http_conn::HTTP_CODE http_conn::parse_headers( char* text )
 
         /*如果HTTP请求有消息体，则还需要读取m_content_length字节的消息体，
         状态机转移到CHECK_STATE_CONTENT状态*/
+        if ( m_content_length < 0 || m_content_length > MAX_READ_BUFFER_SIZE / 2 )
+        {
+            return BAD_REQUEST;
+        }
         if ( m_content_length != 0 )
         {
             m_check_state = CHECK_STATE_CONTENT;
@@ -238,45 +316,66 @@ http_conn::HTTP_CODE http_conn::parse_headers( char* text )
         /*否则说明我们已经得到了一个完整的HTTP请求*/
         return GET_REQUEST;
     }
-    /*处理Connection头部字段*/
-    else if ( strncasecmp( text, "Connection:", 11 ) == 0 )
+
+    /*找到冒号，用字段名查完美哈希表，代替逐个字段的strncasecmp*/
+    char* end = text + len;
+    char* colon = ( char* )scan_any( text, end, ':', ':' );
+    HEADER header = ( colon == end ) ? HEADER_UNKNOWN : lookup_header( text, colon - text );
+    char* value = colon + 1;
+    switch ( header )
     {
-        text += 11;
-        text += strspn( text, " \t" );
-        if ( strcasecmp( text, "keep-alive" ) == 0 )
+        /*处理Connection头部字段*/
+        case HEADER_CONNECTION:
         {
-            m_linger = true;
+            value += strspn( value, " \t" );
+            if ( strcasecmp( value, "keep-alive" ) == 0 )
+            {
+                m_linger = true;
+            }
+            else if ( strcasecmp( value, "close" ) == 0 )
+            {
+                m_linger = false;
+            }
+            break;
+        }
+        /*处理Content-Length头部字段*/
+        case HEADER_CONTENT_LENGTH:
+        {
+            value += strspn( value, " \t" );
+            m_content_length = atol( value );
+            break;
+        }
+        /*处理Host头部字段*/
+        case HEADER_HOST:
+        {
+            value += strspn( value, " \t" );
+            m_host = value;
+            break;
+        }
+        /*常见的、我们不需要处理的字段*/
+        case HEADER_OTHER:
+        {
+            break;
+        }
+        default:
+        {
+            printf( "oop! unknow header %s\n", text );
+            break;
         }
-    }
-    /*处理Content-Length头部字段*/
-    else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 )
-    {
-        text += 15;
-        text += strspn( text, " \t" );
-        m_content_length = atol( text );
-    }
-    /*处理Host头部字段*/
-    else if ( strncasecmp( text, "Host:", 5 ) == 0 )
-    {
-        text += 5;
-        text += strspn( text, " \t" );
-        m_host = text;
-    }
-    else
-    {
-        printf( "oop! unknow header %s\n", text );
     }
 
     return NO_REQUEST;
 
 }
 
-/*我们没有真正解析HTTP请求的消息体，只是判断它是否被完整地读入了*/
-http_conn::HTTP_CODE http_conn::parse_content( char* text )
+/*我们没有真正解析HTTP请求的消息体，只是判断它是否被完整地读入了。
+消息体之后可能紧跟着下一个请求，所以不能像书中那样在消息体末尾写'\0'，而是跳过消息体。
+消息体可能分几次读入，进入CHECK_STATE_CONTENT状态后m_start_line一直指向消息体的开头，以它为准计算*/
+http_conn::HTTP_CODE http_conn::parse_content()
 {
-    if ( m_read_idx >= ( m_content_length + m_checked_idx ) )
+    if ( m_read_idx >= ( m_content_length + m_start_line ) )
     {
-        text[ m_content_length ] = '\0';
+        m_checked_idx = m_start_line + m_content_length;
         return GET_REQUEST;
     }
 
@@ -284,24 +383,31 @@ http_conn::HTTP_CODE http_conn::parse_content( char* text )
 }
 
 /*主状态机。其分析请参考8.6节，这里不再赘述*/
-http_conn::HTTP_CODE http_conn::process_read()
+http_conn::HTTP_CODE http_conn::parse_request()
 {
     LINE_STATUS line_status = LINE_OK;
     HTTP_CODE ret = NO_REQUEST;
     char* text = 0;
 
-    while ( ( ( m_check_state == CHECK_STATE_CONTENT ) && ( line_status == LINE_OK  ) )
-                || ( ( line_status = parse_line() ) == LINE_OK ) )
+    /*消息体不按行解析，CHECK_STATE_CONTENT状态下不能调用parse_line，否则它会把m_checked_idx移到消息体中间*/
+    while ( ( m_check_state == CHECK_STATE_CONTENT ) ? ( line_status == LINE_OK )
+                : ( ( line_status = parse_line() ) == LINE_OK ) )
     {
         text = get_line();
+        /*parse_line把行尾的"\r\n"换成了两个'\0'，消息体没有行的长度*/
+        int len = m_checked_idx - m_start_line - 2;
         m_start_line = m_checked_idx;
-        printf( "got 1 http line: %s\n", text );
+        /*消息体没有以'\0'结尾，不能当作一行打印*/
+        if ( m_print_lines && m_check_state != CHECK_STATE_CONTENT )
+        {
+            printf( "got 1 http line: %s\n", text );
+        }
 
         switch ( m_check_state )
         {
             case CHECK_STATE_REQUESTLINE:
             {
-                ret = parse_request_line( text );
+                ret = parse_request_line( text, len );
                 if ( ret == BAD_REQUEST )
                 {
                     return BAD_REQUEST;
@@ -310,23 +416,23 @@ http_conn::HTTP_CODE http_conn::process_read()
             }
             case CHECK_STATE_HEADER:
             {
-                ret = parse_headers( text );
+                ret = parse_headers( text, len );
                 if ( ret == BAD_REQUEST )
                 {
                     return BAD_REQUEST;
                 }
                 else if ( ret == GET_REQUEST )
                 {
-                    return do_request();
+                    return GET_REQUEST;
                 }
                 break;
             }
             case CHECK_STATE_CONTENT:
             {
-                ret = parse_content( text );
+                ret = parse_content();
                 if ( ret == GET_REQUEST )
                 {
-                    return do_request();
+                    return GET_REQUEST;
                 }
                 line_status = LINE_OPEN;
                 break;
@@ -338,68 +444,132 @@ http_conn::HTTP_CODE http_conn::process_read()
         }
     }
 
+    if ( line_status == LINE_BAD )
+    {
+        return BAD_REQUEST;
+    }
     return NO_REQUEST;
 }
 
+/*解析HTTP请求，得到完整的请求时分析目标文件*/
+http_conn::HTTP_CODE http_conn::process_read()
+{
+    HTTP_CODE ret = parse_request();
+    if ( ret == GET_REQUEST )
+    {
+        return do_request();
+    }
+    return ret;
+}
+
+int http_conn::parse_requests( const char* data, int len )
+{
+    init();
+    int count = 0;
+    while ( len > 0 )
+    {
+        /*与read相同：缓冲区满了先移走已经处理完的请求，不够再扩大缓冲区*/
+        if ( m_read_idx == m_read_size )
+        {
+            if ( m_request_start > 0 )
+            {
+                compact_read_buf();
+            }
+            else if ( m_read_size < MAX_READ_BUFFER_SIZE )
+            {
+                grow_read_buf();
+            }
+            else
+            {
+                return -1;
+            }
+        }
+        int bytes = m_read_size - m_read_idx < len ? m_read_size - m_read_idx : len;
+        memcpy( m_read_buf + m_read_idx, data, bytes );
+        m_read_idx += bytes;
+        data += bytes;
+        len -= bytes;
+
+        /*与process相同：每得到一个完整的请求，就从它的下一个字节开始解析下一个请求*/
+        HTTP_CODE ret;
+        while ( ( ret = parse_request() ) == GET_REQUEST )
+        {
+            ++count;
+            m_request_start = m_checked_idx;
+            m_start_line = m_checked_idx;
+            init_request();
+        }
+        if ( ret != NO_REQUEST )
+        {
+            return -1;
+        }
+    }
+    return count;
+}
+
 /*当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性。
 如果目标文件存在、对所有用户可读，且不是目录，
-则使用mmap将其映射到内存地址m_file_address处，并告诉调用者获取文件成功*/
+则从文件缓存中取得它被mmap到内存中的地址m_file_address，并告诉调用者获取文件成功。
+只有缓存未命中时才需要stat、open和mmap，其他连接请求同一文件时共享这段映射*/
 http_conn::HTTP_CODE http_conn::do_request()
 {
     strcpy( m_real_file, doc_root );
     int len = strlen( doc_root );
     strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
-    if ( stat( m_real_file, &m_file_stat ) < 0 )
+    m_file = m_file_cache.acquire( m_real_file );
+    if ( ! m_file )
     {
+        if ( errno == EACCES )
+        {
+            return FORBIDDEN_REQUEST;
+        }
+        if ( errno == EISDIR )
+        {
+            return BAD_REQUEST;
+        }
         return NO_RESOURCE;
     }
 
-    if ( ! ( m_file_stat.st_mode & S_IROTH ) )
-    {
-        return FORBIDDEN_REQUEST;
-    }
-
-    if ( S_ISDIR( m_file_stat.st_mode ) )
-    {
-        return BAD_REQUEST;
-    }
-
-    int fd = open( m_real_file, O_RDONLY );
-    // 下面的mmap是共享内存操作，避免了核心态到用户态的拷贝，是零拷贝操作
-    // PROT_READ表示内存段可读
-    // MAP_PRIVATE表示内存段为调用进程私有，对该内存段的修改不会反映到被映射的文件中
-    // 最后一个参数是offset，设置从文件的何处开始映射
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-    close( fd );
+    m_file_stat = m_file->m_stat;
+    m_file_address = m_file->m_address;
     return FILE_REQUEST;
 }
 
-/*对内存映射区执行munmap操作*/
+/*交还目标文件的映射，是否munmap由文件缓存决定*/
 void http_conn::unmap()
 {
-    if( m_file_address )
+    if( m_file )
     {
-        munmap( m_file_address, m_file_stat.st_size );
+        m_file_cache.release( m_file );
+        m_file = 0;
         m_file_address = 0;
     }
+    for( int i = 0; i < m_file_count; ++i )
+    {
+        m_file_cache.release( m_files[i] );
+    }
+    m_file_count = 0;
+    m_sendfile = 0;
 }
 
-/*写HTTP响应*/
+/*写HTTP响应。m_iv中是这一批所有应答的头部和mmap的文件，最后一个应答的文件可能要用sendfile发送*/
 bool http_conn::write()
 {
-    int temp = 0;
-    int bytes_have_send = 0;
-    int bytes_to_send = m_write_idx;
-    if ( bytes_to_send == 0 )
+    ssize_t temp = 0;
+    if ( m_iv_count == 0 && ! m_sendfile )
     {
         modfd( m_epollfd, m_sockfd, EPOLLIN );
-        init();
         return true;
     }
 
-    while( 1 )
+    while( m_iv_count > 0 )
     {
-        temp = writev( m_sockfd, m_iv, m_iv_count );
+        /*后面还有sendfile时用MSG_MORE，内核会把最后一个头部和文件的第一段数据合并到同一个TCP报文段中*/
+        struct msghdr msg;
+        memset( &msg, 0, sizeof( msg ) );
+        msg.msg_iov = m_iv;
+        msg.msg_iovlen = m_iv_count;
+        temp = sendmsg( m_sockfd, &msg, m_sendfile ? MSG_MORE : 0 );
         if ( temp <= -1 )
         {
             /*如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件。
@@ -409,29 +579,89 @@ bool http_conn::write()
                 modfd( m_epollfd, m_sockfd, EPOLLOUT );
                 return true;
             }
+            if( errno == EINTR )
+            {
+                continue;
+            }
             unmap();
             return false;
         }
 
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if ( bytes_to_send <= bytes_have_send )
+        /*writev可能只写出了一部分。跳过已经完整写出的内存块，并把写了一半的内存块的起点后移，
+        m_iv中剩下的就是还没有发送的数据，下一次writev（可能在下一轮EPOLLOUT事件中）从这里继续*/
+        int done = 0;
+        while ( done < m_iv_count && temp >= ( ssize_t )m_iv[ done ].iov_len )
         {
-            /*发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接*/
-            unmap();
-            if( m_linger )
+            temp -= m_iv[ done ].iov_len;
+            done++;
+        }
+        if ( done < m_iv_count )
+        {
+            m_iv[ done ].iov_base = ( char* )m_iv[ done ].iov_base + temp;
+            m_iv[ done ].iov_len -= temp;
+        }
+        for ( int i = done; i < m_iv_count; ++i )
+        {
+            m_iv[ i - done ] = m_iv[ i ];
+        }
+        m_iv_count -= done;
+    }
+
+    /*用sendfile发送大文件，文件内容从页缓存直接进入socket，不会被映射到我们的地址空间。
+    socket的发送缓冲区满时m_file_offset记下已经发送到的位置，等下一次EPOLLOUT事件再从那里继续*/
+    while ( m_sendfile && m_file_offset < m_sendfile->m_stat.st_size )
+    {
+        ssize_t ret = sendfile( m_sockfd, m_sendfile->m_fd, &m_file_offset, m_sendfile->m_stat.st_size - m_file_offset );
+        if ( ret < 0 )
+        {
+            if ( errno == EAGAIN )
             {
-                init();
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
+                modfd( m_epollfd, m_sockfd, EPOLLOUT );
                 return true;
             }
-            else
+            if ( errno == EINTR )
             {
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return false;
-            } 
+                continue;
+            }
+            unmap();
+            return false;
+        }
+        /*文件在发送过程中被截短了，已经发出的Content-Length无法兑现，只能关闭连接*/
+        if ( ret == 0 )
+        {
+            unmap();
+            return false;
         }
     }
+
+    return write_done();
+}
+
+bool http_conn::write_done()
+{
+    /*发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接*/
+    unmap();
+    m_write_idx = 0;
+    m_iv_count = 0;
+    m_response_count = 0;
+    m_file_offset = 0;
+    if( m_keep_alive )
+    {
+        /*读缓冲区中还有没处理的请求（或者请求的一部分），由主线程交给工作线程继续处理。
+        这时不能重新注册EPOLLIN，否则主线程可能在工作线程处理这个连接的同时又去读它*/
+        if( m_read_idx > m_request_start )
+        {
+            m_pending = true;
+            return true;
+        }
+        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        return true;
+    }
+    else
+    {
+        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        return false;
+    }
 }
 
 /*往写缓冲中写入待发送的数据*/
@@ -459,16 +689,14 @@ bool http_conn::add_status_line( int status, const char* title )
     return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
 }
 
-bool http_conn::add_headers( int content_len )
+bool http_conn::add_headers( off_t content_len )
 {
-    add_content_length( content_len );
-    add_linger();
-    add_blank_line();
+    return add_content_length( content_len ) && add_linger() && add_blank_line();
 }
 
-bool http_conn::add_content_length( int content_len )
+bool http_conn::add_content_length( off_t content_len )
 {
-    return add_response( "Content-Length: %d\r\n", content_len );
+    return add_response( "Content-Length: %lld\r\n", ( long long )content_len );
 }
 
 bool http_conn::add_linger()
@@ -487,8 +715,23 @@ bool http_conn::add_content( const char* content )
     return add_response( "%s", content );
 }
 
+void http_conn::add_iovec( char* base, size_t len )
+{
+    /*连续的几个应答都没有文件时，它们在写缓冲区中是相邻的，合并成一块*/
+    if ( m_iv_count > 0 && ( char* )m_iv[ m_iv_count - 1 ].iov_base + m_iv[ m_iv_count - 1 ].iov_len == base )
+    {
+        m_iv[ m_iv_count - 1 ].iov_len += len;
+        return;
+    }
+    m_iv[ m_iv_count ].iov_base = base;
+    m_iv[ m_iv_count ].iov_len = len;
+    m_iv_count++;
+}
+
+/*把一个应答追加到这一批应答中*/
 bool http_conn::process_write( HTTP_CODE ret )
 {
+    int header_start = m_write_idx;
     switch ( ret )
     {
         case INTERNAL_ERROR:
@@ -537,11 +780,17 @@ bool http_conn::process_write( HTTP_CODE ret )
             if ( m_file_stat.st_size != 0 )
             {
                 add_headers( m_file_stat.st_size );
-                m_iv[ 0 ].iov_base = m_write_buf;
-                m_iv[ 0 ].iov_len = m_write_idx;
-                m_iv[ 1 ].iov_base = m_file_address;
-                m_iv[ 1 ].iov_len = m_file_stat.st_size;
-                m_iv_count = 2;
+                add_iovec( m_write_buf + header_start, m_write_idx - header_start );
+                m_files[ m_file_count++ ] = m_file;
+                m_file = 0;
+                /*大文件由write用sendfile发送，m_iv中只有它的应答头部*/
+                if ( m_files[ m_file_count - 1 ]->m_fd >= 0 )
+                {
+                    m_sendfile = m_files[ m_file_count - 1 ];
+                    m_file_offset = 0;
+                    return true;
+                }
+                add_iovec( m_file_address, m_file_stat.st_size );
                 return true;
             }
             else
@@ -553,6 +802,7 @@ bool http_conn::process_write( HTTP_CODE ret )
                     return false;
                 }
             }
+            break;
         }
         default:
         {
@@ -560,26 +810,81 @@ bool http_conn::process_write( HTTP_CODE ret )
         }
     }
 
-    m_iv[ 0 ].iov_base = m_write_buf;
-    m_iv[ 0 ].iov_len = m_write_idx;
-    m_iv_count = 1;
+    /*文件请求的目标是空文件时m_file也要交还*/
+    if ( m_file )
+    {
+        m_files[ m_file_count++ ] = m_file;
+        m_file = 0;
+    }
+    add_iovec( m_write_buf + header_start, m_write_idx - header_start );
     return true;
 }
 
 /*由线程池中的工作线程调用，这是处理HTTP请求的入口函数*/
 void http_conn::process()
 {
-    HTTP_CODE read_ret = process_read();
-    if ( read_ret == NO_REQUEST )
+    m_pending = false;
+    /*一次处理读缓冲区中所有完整的请求（HTTP/1.1流水线），它们的应答合并起来用一次writev发送。
+    写缓冲区快满了、遇到要用sendfile发送的应答、或者客户要求关闭连接时停下来，
+    剩下的请求等这一批应答发送完之后再处理*/
+    while ( m_response_count < MAX_PIPELINE && WRITE_BUFFER_SIZE - m_write_idx >= RESPONSE_RESERVE )
     {
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
-        return;
+        HTTP_CODE read_ret = process_read();
+        if ( read_ret == NO_REQUEST )
+        {
+            break;
+        }
+        /*请求有语法错误时找不到下一个请求从哪里开始，应答之后关闭连接*/
+        if ( read_ret == BAD_REQUEST )
+        {
+            m_linger = false;
+        }
+
+        bool write_ret = process_write( read_ret );
+        if ( ! write_ret )
+        {
+            close_conn();
+            return;
+        }
+        m_response_count++;
+        m_keep_alive = m_linger;
+        m_request_start = m_checked_idx;
+        m_start_line = m_checked_idx;
+        init_request();
+        if ( ! m_keep_alive || m_sendfile )
+        {
+            break;
+        }
+    }
+
+    /*读缓冲区中的数据都处理完了，下一次从缓冲区开头读入，不需要移动数据*/
+    if ( m_request_start == m_read_idx )
+    {
+        m_read_idx = 0;
+        m_checked_idx = 0;
+        m_start_line = 0;
+        m_request_start = 0;
     }
 
-    bool write_ret = process_write( read_ret );
-    if ( ! write_ret )
+    if ( m_response_count == 0 )
     {
-        close_conn();
+        /*读缓冲区已经扩大到上限，还装不下一个完整的请求*/
+        if ( m_request_start == 0 && m_read_idx >= MAX_READ_BUFFER_SIZE )
+        {
+            m_linger = false;
+            m_keep_alive = false;
+            if ( ! process_write( BAD_REQUEST ) )
+            {
+                close_conn();
+                return;
+            }
+            m_response_count++;
+        }
+        else
+        {
+            modfd( m_epollfd, m_sockfd, EPOLLIN );
+            return;
+        }
     }
 
     modfd( m_epollfd, m_sockfd, EPOLLOUT );
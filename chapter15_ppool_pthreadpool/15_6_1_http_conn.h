@@ -20,6 +20,8 @@
 #include <errno.h>
 #include <sys/uio.h>    // readv和writv需要的头文件
 #include "14_7_1_locker.h"
+#include "15_6_3_file_cache.h"
+#include "15_6_5_http_scan.h"
 
 // 线程池的模板参数类，用以封装对逻辑任务的处理。http_conn
 class http_conn
@@ -27,10 +29,18 @@ class http_conn
 public:
     /*文件名的最大长度*/
     static const int FILENAME_LEN = 200;
-    /*读缓冲区的大小*/
+    /*读缓冲区的初始大小*/
     static const int READ_BUFFER_SIZE = 2048;
+    /*读缓冲区最多扩大到这么大，一个请求的头部超过它就被拒绝*/
+    static const int MAX_READ_BUFFER_SIZE = 64 * 1024;
     /*写缓冲区的大小*/
-    static const int WRITE_BUFFER_SIZE = 1024;
+    static const int WRITE_BUFFER_SIZE = 4096;
+    /*一批最多合并发送的应答数*/
+    static const int MAX_PIPELINE = 16;
+    /*写缓冲区剩余的空间不够一个应答的头部（和错误页面）时，这一批就不再加入新的应答*/
+    static const int RESPONSE_RESERVE = 256;
+    /*超过这个大小的文件不mmap，用sendfile发送*/
+    static const int SENDFILE_THRESHOLD = 256 * 1024;
     /*HTTP请求方法，但我们仅支持GET*/
     enum METHOD { GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT, PATCH };
     /*解析客户请求时，主状态机所处的状态（回忆第8章）*/
@@ -41,8 +51,8 @@ public:
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
 
 public:
-    http_conn(){}
-    ~http_conn(){}
+    http_conn() : m_read_buf( 0 ), m_read_size( 0 ){}
+    ~http_conn(){ delete [] m_read_buf; }
 
 public:
     /*初始化新接受的连接*/
@@ -55,48 +65,76 @@ public:
     bool read();
     /*非阻塞写操作*/
     bool write();
+    /*一批应答发送完之后，读缓冲区中还有没处理的请求，需要再交给工作线程处理*/
+    bool has_pending_request() const { return m_pending; }
+    /*把data当作从socket上陆续读入的数据，用process_read同样的状态机解析其中所有完整的请求，
+    但不查找目标文件也不生成应答。返回解析出的请求数，请求有错误时返回-1。供15_6_6_parser_bench.cpp使用*/
+    int parse_requests( const char* data, int len );
 
 private:
     /*初始化连接*/
     void init();
+    /*开始解析下一个请求*/
+    void init_request();
+    /*把读缓冲区中已经处理完的请求移走*/
+    void compact_read_buf();
+    /*把读缓冲区扩大一倍*/
+    void grow_read_buf();
+    /*读缓冲区中的数据从from移到了to，调整指向其中的指针*/
+    void rebase( const char* from, char* to );
     /*解析HTTP请求*/
     HTTP_CODE process_read();
+    /*主状态机，得到一个完整的请求时返回GET_REQUEST*/
+    HTTP_CODE parse_request();
     /*填充HTTP应答*/
     bool process_write( HTTP_CODE ret );
 
     /*下面这一组函数被process_read调用以分析HTTP请求*/
-    HTTP_CODE parse_request_line( char* text );
-    HTTP_CODE parse_headers( char* text );
-    HTTP_CODE parse_content( char* text );
+    HTTP_CODE parse_request_line( char* text, int len );
+    HTTP_CODE parse_headers( char* text, int len );
+    HTTP_CODE parse_content();
     HTTP_CODE do_request();
     char* get_line() { return m_read_buf + m_start_line; }
     LINE_STATUS parse_line();
 
     /*下面这一组函数被process_write调用以填充HTTP应答*/
+    /*释放目标文件的映射（交还给文件缓存）*/
     void unmap();
     bool add_response( const char* format, ... );
     bool add_content( const char* content );
     bool add_status_line( int status, const char* title );
-    bool add_headers( int content_length );
-    bool add_content_length( int content_length );
+    bool add_headers( off_t content_length );
+    bool add_content_length( off_t content_length );
     bool add_linger();
     bool add_blank_line();
+    /*把一块待发送的内存加入m_iv*/
+    void add_iovec( char* base, size_t len );
+
+    /*一批应答发送完毕，根据m_keep_alive决定是否保持连接*/
+    bool write_done();
 
 public:
     /*所有socket上的事件都被注册到同一个epoll内核事件表中，所以将epoll文件描述符设置为静态的*/
     static int m_epollfd;
     /*统计用户数量*/
     static int m_user_count;
+    /*所有连接共享的目标文件缓存*/
+    static file_cache m_file_cache;
+    /*是否像书中那样打印解析的每一行，默认打开*/
+    static bool m_print_lines;
 
 private:
     /*该HTTP连接的socket和对方的socket地址*/
     int m_sockfd;
     sockaddr_in m_address;
 
-    /*读缓冲区*/
-    char m_read_buf[ READ_BUFFER_SIZE ];
+    /*读缓冲区，可以扩大，所有请求都处理完或者缓冲区满时被压缩*/
+    char* m_read_buf;
+    int m_read_size;
     /*标识读缓冲中已经读入的客户数据的最后一个字节的下一个位置*/
     int m_read_idx;
+    /*当前正在解析的请求的起始位置，之前的数据都已经处理完了*/
+    int m_request_start;
     /*当前正在分析的字符在读缓冲区中的位置*/
     int m_checked_idx;
     /*当前正在解析的行的起始位置*/
@@ -105,6 +143,12 @@ private:
     char m_write_buf[ WRITE_BUFFER_SIZE ];
     /*写缓冲区中待发送的字节数*/
     int m_write_idx;
+    /*这一批中已经生成的应答数*/
+    int m_response_count;
+    /*这一批应答发送完之后是否保持连接，由最后一个请求决定*/
+    bool m_keep_alive;
+    /*见has_pending_request*/
+    bool m_pending;
 
     /*主状态机当前所处的状态*/
     CHECK_STATE m_check_state;
@@ -124,13 +168,23 @@ private:
     /*HTTP请求是否要求保持连接*/
     bool m_linger;
 
+    /*客户请求的目标文件在文件缓存中的映射*/
+    file_entry* m_file;
     /*客户请求的目标文件被mmap到内存中的起始位置*/
     char* m_file_address;
     /*目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息*/
     struct stat m_file_stat;
-    /*我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量*/
-    struct iovec m_iv[2];
+    /*这一批应答用到的文件，全部发送完之后才交还给文件缓存*/
+    file_entry* m_files[ MAX_PIPELINE ];
+    int m_file_count;
+    /*我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
+    每个应答最多占用两块：头部和mmap的文件*/
+    struct iovec m_iv[ 2 * MAX_PIPELINE ];
     int m_iv_count;
+    /*这一批的最后一个应答要用sendfile发送的文件，没有则为NULL*/
+    file_entry* m_sendfile;
+    /*用sendfile发送应答时，目标文件下一个要发送的字节的位置*/
+    off_t m_file_offset;
 };
 
 #endif
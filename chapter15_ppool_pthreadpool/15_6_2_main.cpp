@@ -14,7 +14,7 @@
 #include "15_5_1_thread_pool.h"
 #include "15_6_1_http_conn.h"
 
-// 注意要这样编译g++ -g -pthread 15_6_2_main.cpp 15_6_1_http_conn.cpp -o test
+// 注意要这样编译g++ -g -pthread 15_6_2_main.cpp 15_6_1_http_conn.cpp 15_6_3_file_cache.cpp 15_6_5_http_scan.cpp -o test
 // 否则会提示undefined reference to `http_conn::****'
 #define MAX_FD 65536
 #define MAX_EVENT_NUMBER 10000
@@ -74,8 +74,8 @@ int main( int argc, char* argv[] )
 
     int listenfd = socket( PF_INET, SOCK_STREAM, 0 );
     assert( listenfd >= 0 );
-    struct linger tmp = { 1, 0 };
-    setsockopt( listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof( tmp ) );
+    /*不能设置SO_LINGER为{ 1, 0 }：连接socket会继承它，close时发送RST并丢弃发送缓冲区中的数据，
+    大文件的应答在非keep-alive连接上会被截断*/
 
     int ret = 0;
     struct sockaddr_in address;
@@ -95,6 +95,12 @@ int main( int argc, char* argv[] )
     assert( epollfd != -1 );
     addfd( epollfd, listenfd, false );
     http_conn::m_epollfd = epollfd;
+    /*文件缓存的inotify描述符，目标文件被修改时让缓存失效*/
+    int cachefd = http_conn::m_file_cache.get_fd();
+    if( cachefd >= 0 )
+    {
+        addfd( epollfd, cachefd, false );
+    }
 
     while( true )
     {
@@ -110,22 +116,34 @@ int main( int argc, char* argv[] )
             int sockfd = events[i].data.fd;
             if( sockfd == listenfd )
             {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof( client_address );
-                int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
-                if ( connfd < 0 )
+                /*监听socket是ET模式的，一次事件可能对应多个新连接，要一直accept到EAGAIN为止，
+                否则剩下的连接要等到下一个新连接到来时才会被接受*/
+                while( true )
                 {
-                    printf( "errno is: %d\n", errno );
-                    continue;
+                    struct sockaddr_in client_address;
+                    socklen_t client_addrlength = sizeof( client_address );
+                    int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
+                    if ( connfd < 0 )
+                    {
+                        if( errno != EAGAIN && errno != EWOULDBLOCK )
+                        {
+                            printf( "errno is: %d\n", errno );
+                        }
+                        break;
+                    }
+                    if( http_conn::m_user_count >= MAX_FD )
+                    {
+                        show_error( connfd, "Internal server busy" );
+                        continue;
+                    }
+
+                    /*初始化客户连接*/
+                    users[connfd].init( connfd, client_address );
                 }
-                if( http_conn::m_user_count >= MAX_FD )
-                {
-                    show_error( connfd, "Internal server busy" );
-                    continue;
-                }
-                
-                /*初始化客户连接*/
-                users[connfd].init( connfd, client_address );
+            }
+            else if( sockfd == cachefd )
+            {
+                http_conn::m_file_cache.handle_events();
             }
             else if( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
             {
@@ -151,6 +169,11 @@ int main( int argc, char* argv[] )
                 {
                     users[sockfd].close_conn();
                 }
+                /*读缓冲区中还有流水线发来的请求，继续交给线程池处理*/
+                else if( users[sockfd].has_pending_request() )
+                {
+                    pool->append( users + sockfd );
+                }
             }
             else
             {}
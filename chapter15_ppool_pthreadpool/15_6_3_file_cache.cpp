@@ -0,0 +1,298 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include "15_6_3_file_cache.h"
+
+/*文件内容或属性改变、文件被删除或者被移走时，缓存的映射都不能再用了*/
+static const uint32_t WATCH_MASK = IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+
+file_cache::file_cache( size_t capacity, size_t map_limit )
+    : m_capacity( capacity ), m_map_limit( map_limit ), m_size( 0 ), m_lru_head( NULL ), m_lru_tail( NULL )
+{
+    m_inotify_fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+}
+
+file_cache::~file_cache()
+{
+    for( std::map< std::string, file_entry* >::iterator it = m_files.begin(); it != m_files.end(); ++it )
+    {
+        /*还在被连接使用的文件由最后一个release释放*/
+        it->second->m_cached = false;
+        if( it->second->m_refs == 0 )
+        {
+            destroy( it->second );
+        }
+    }
+    if( m_inotify_fd >= 0 )
+    {
+        close( m_inotify_fd );
+    }
+}
+
+/*这就是原来do_request中的stat、open和mmap，现在只在缓存未命中时执行*/
+file_entry* file_cache::load( const char* path )
+{
+    struct stat st;
+    if( stat( path, &st ) < 0 )
+    {
+        return NULL;
+    }
+    if( ! ( st.st_mode & S_IROTH ) )
+    {
+        errno = EACCES;
+        return NULL;
+    }
+    if( S_ISDIR( st.st_mode ) )
+    {
+        errno = EISDIR;
+        return NULL;
+    }
+
+    int fd = open( path, O_RDONLY );
+    if( fd < 0 )
+    {
+        return NULL;
+    }
+    char* address = NULL;
+    /*大文件不mmap，保留描述符给sendfile*/
+    bool keep_fd = ( size_t )st.st_size > m_map_limit;
+    /*长度为0的文件不能mmap*/
+    if( ! keep_fd && st.st_size > 0 )
+    {
+        address = ( char* )mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if( address == MAP_FAILED )
+        {
+            int error = errno;
+            close( fd );
+            errno = error;
+            return NULL;
+        }
+    }
+    if( ! keep_fd )
+    {
+        close( fd );
+        fd = -1;
+    }
+
+    file_entry* entry = new file_entry;
+    entry->m_path = path;
+    entry->m_stat = st;
+    entry->m_address = address;
+    entry->m_fd = fd;
+    entry->m_refs = 1;
+    entry->m_cached = false;
+    entry->m_wd = -1;
+    entry->m_prev = NULL;
+    entry->m_next = NULL;
+    return entry;
+}
+
+file_entry* file_cache::acquire( const char* path )
+{
+    m_lock.lock();
+    std::map< std::string, file_entry* >::iterator it = m_files.find( path );
+    if( it != m_files.end() )
+    {
+        file_entry* entry = it->second;
+        entry->m_refs++;
+        unlink_lru( entry );
+        push_lru( entry );
+        m_lock.unlock();
+        return entry;
+    }
+    m_lock.unlock();
+
+    /*不持有锁做文件系统调用，别的线程的命中不需要等待这次未命中*/
+    file_entry* entry = load( path );
+    if( ! entry )
+    {
+        return NULL;
+    }
+    /*没有inotify就无法知道文件何时被修改，只能每次都重新映射；超过上限的大文件和sendfile发送的文件也不缓存*/
+    if( m_inotify_fd < 0 || ( size_t )entry->m_stat.st_size > m_capacity || entry->m_fd >= 0 )
+    {
+        return entry;
+    }
+
+    m_lock.lock();
+    it = m_files.find( path );
+    if( it != m_files.end() )
+    {
+        /*另一个线程同时加载了同一个文件，使用已经在缓存中的那一份*/
+        file_entry* cached = it->second;
+        cached->m_refs++;
+        m_lock.unlock();
+        destroy( entry );
+        return cached;
+    }
+
+    /*先建立watch再检查一次文件。如果文件在stat之后、watch建立之前被修改，缓存它就会一直是旧内容*/
+    int wd = inotify_add_watch( m_inotify_fd, path, WATCH_MASK );
+    struct stat st;
+    if( wd < 0 || stat( path, &st ) < 0 || st.st_ino != entry->m_stat.st_ino || st.st_size != entry->m_stat.st_size
+            || st.st_mtim.tv_sec != entry->m_stat.st_mtim.tv_sec || st.st_mtim.tv_nsec != entry->m_stat.st_mtim.tv_nsec )
+    {
+        if( wd >= 0 && m_watches.count( wd ) == 0 )
+        {
+            inotify_rm_watch( m_inotify_fd, wd );
+        }
+        m_lock.unlock();
+        return entry;
+    }
+
+    entry->m_cached = true;
+    entry->m_wd = wd;
+    m_files[ entry->m_path ] = entry;
+    m_watches.insert( std::make_pair( wd, entry ) );
+    push_lru( entry );
+    m_size += entry->m_stat.st_size;
+    shrink();
+    m_lock.unlock();
+    return entry;
+}
+
+void file_cache::release( file_entry* entry )
+{
+    m_lock.lock();
+    bool dead = ( --entry->m_refs == 0 ) && ! entry->m_cached;
+    if( entry->m_refs == 0 && m_size > m_capacity )
+    {
+        /*缓存超过上限时文件都在被使用，现在可以淘汰了*/
+        shrink();
+    }
+    m_lock.unlock();
+    if( dead )
+    {
+        destroy( entry );
+    }
+}
+
+void file_cache::handle_events()
+{
+    char buf[ 4096 ] __attribute__( ( aligned( __alignof__( struct inotify_event ) ) ) );
+    while( true )
+    {
+        ssize_t len = read( m_inotify_fd, buf, sizeof( buf ) );
+        if( len <= 0 )
+        {
+            /*ET模式，必须读到EAGAIN为止*/
+            if( len < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            break;
+        }
+
+        m_lock.lock();
+        for( char* ptr = buf; ptr < buf + len; )
+        {
+            struct inotify_event* event = ( struct inotify_event* )ptr;
+            ptr += sizeof( struct inotify_event ) + event->len;
+            /*IN_IGNORED表示watch已经被删除，对应的缓存项在删除watch时就已经失效了*/
+            std::pair< std::multimap< int, file_entry* >::iterator, std::multimap< int, file_entry* >::iterator > range
+                = m_watches.equal_range( event->wd );
+            while( range.first != range.second )
+            {
+                file_entry* entry = ( range.first++ )->second;
+                remove( entry );
+            }
+        }
+        m_lock.unlock();
+    }
+}
+
+void file_cache::unlink_lru( file_entry* entry )
+{
+    if( entry->m_prev )
+    {
+        entry->m_prev->m_next = entry->m_next;
+    }
+    else
+    {
+        m_lru_head = entry->m_next;
+    }
+    if( entry->m_next )
+    {
+        entry->m_next->m_prev = entry->m_prev;
+    }
+    else
+    {
+        m_lru_tail = entry->m_prev;
+    }
+    entry->m_prev = NULL;
+    entry->m_next = NULL;
+}
+
+void file_cache::push_lru( file_entry* entry )
+{
+    entry->m_prev = NULL;
+    entry->m_next = m_lru_head;
+    if( m_lru_head )
+    {
+        m_lru_head->m_prev = entry;
+    }
+    else
+    {
+        m_lru_tail = entry;
+    }
+    m_lru_head = entry;
+}
+
+void file_cache::remove( file_entry* entry )
+{
+    m_files.erase( entry->m_path );
+    unlink_lru( entry );
+    m_size -= entry->m_stat.st_size;
+    entry->m_cached = false;
+
+    std::pair< std::multimap< int, file_entry* >::iterator, std::multimap< int, file_entry* >::iterator > range
+        = m_watches.equal_range( entry->m_wd );
+    for( std::multimap< int, file_entry* >::iterator it = range.first; it != range.second; ++it )
+    {
+        if( it->second == entry )
+        {
+            m_watches.erase( it );
+            break;
+        }
+    }
+    /*同一个inode上没有别的缓存项了才删除watch*/
+    if( m_watches.count( entry->m_wd ) == 0 )
+    {
+        inotify_rm_watch( m_inotify_fd, entry->m_wd );
+    }
+    entry->m_wd = -1;
+
+    if( entry->m_refs == 0 )
+    {
+        destroy( entry );
+    }
+}
+
+void file_cache::shrink()
+{
+    file_entry* entry = m_lru_tail;
+    while( entry && m_size > m_capacity )
+    {
+        file_entry* prev = entry->m_prev;
+        if( entry->m_refs == 0 )
+        {
+            remove( entry );
+        }
+        entry = prev;
+    }
+}
+
+void file_cache::destroy( file_entry* entry )
+{
+    if( entry->m_address )
+    {
+        munmap( entry->m_address, entry->m_stat.st_size );
+    }
+    if( entry->m_fd >= 0 )
+    {
+        close( entry->m_fd );
+    }
+    delete entry;
+}
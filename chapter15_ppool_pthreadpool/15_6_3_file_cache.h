@@ -0,0 +1,82 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <map>
+#include <string>
+#include "14_7_1_locker.h"
+
+/*被缓存的一个文件：整个文件只mmap一次，所有请求同一文件的连接共享这段映射*/
+struct file_entry
+{
+    std::string m_path;
+    struct stat m_stat;
+    /*文件被mmap到内存中的起始位置，空文件和不做映射的大文件为NULL*/
+    char* m_address;
+    /*不做映射的大文件保持打开的描述符，供sendfile使用，其他文件为-1*/
+    int m_fd;
+    /*正在使用这个映射的连接数*/
+    int m_refs;
+    /*是否还在缓存表中。文件被修改或者被LRU淘汰之后为false，最后一个使用者释放时才munmap*/
+    bool m_cached;
+    /*监视该文件的inotify描述符，-1表示没有监视*/
+    int m_wd;
+    /*LRU链表，表头是最近使用的文件*/
+    file_entry* m_prev;
+    file_entry* m_next;
+};
+
+/*进程内所有连接共享的文件缓存，以文件的完整路径为键。
+命中时不需要stat、open和mmap，应答发送完也不需要munmap；文件变化由inotify通知，
+主线程的epoll监听get_fd()返回的描述符，可读时调用handle_events()让对应的缓存项失效。
+缓存的总字节数超过上限时，按LRU淘汰当前没有连接使用的文件。
+大于map_limit的文件不mmap也不缓存，每次只打开描述符，由调用者用sendfile发送*/
+class file_cache
+{
+public:
+    /*所有缓存文件的总大小上限*/
+    static const size_t DEFAULT_CAPACITY = 64 * 1024 * 1024;
+
+public:
+    file_cache( size_t capacity = DEFAULT_CAPACITY, size_t map_limit = DEFAULT_CAPACITY );
+    ~file_cache();
+
+    /*获取path对应的文件映射并增加引用计数。失败时返回NULL并设置errno：
+    ENOENT表示文件不存在，EACCES表示文件对其他用户不可读，EISDIR表示目标是目录*/
+    file_entry* acquire( const char* path );
+    /*释放acquire得到的文件映射*/
+    void release( file_entry* entry );
+
+    /*inotify描述符。没有inotify时返回-1，此时不缓存任何文件，每次acquire都重新映射*/
+    int get_fd() const { return m_inotify_fd; }
+    /*读出所有inotify事件，让被修改、删除或者移走的文件失效*/
+    void handle_events();
+
+private:
+    file_entry* load( const char* path );
+    void unlink_lru( file_entry* entry );
+    void push_lru( file_entry* entry );
+    /*把entry移出缓存表，必须持有m_lock*/
+    void remove( file_entry* entry );
+    /*淘汰没有被使用的文件，直到总大小不超过上限，必须持有m_lock*/
+    void shrink();
+    static void destroy( file_entry* entry );
+
+private:
+    size_t m_capacity;
+    /*超过这个大小的文件不mmap*/
+    size_t m_map_limit;
+    /*缓存表中所有文件的总大小*/
+    size_t m_size;
+    int m_inotify_fd;
+    std::map< std::string, file_entry* > m_files;
+    /*一个inode上只有一个watch，硬链接或者符号链接可能让多个路径共享同一个watch*/
+    std::multimap< int, file_entry* > m_watches;
+    file_entry* m_lru_head;
+    file_entry* m_lru_tail;
+    /*工作线程和主线程都会访问缓存*/
+    locker m_lock;
+};
+
+#endif
@@ -0,0 +1,233 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+// 大应答的回归测试和吞吐量测试：在网站根目录下生成64KB到1GB的文件，
+// 通过一个keep-alive连接依次下载，逐字节校验内容并统计每种大小的吞吐量。
+// 小于http_conn::SENDFILE_THRESHOLD的文件走mmap+writev，更大的文件走sendfile。
+// 用-r把客户端的接收缓冲区设小，可以让服务器的每次写操作都只写出一部分，检验断点续写。
+// 编译：g++ -O2 15_6_4_download_bench.cpp -o download_bench
+// 用法：./download_bench ip_address port_number [-d doc_root] [-m max_mb] [-n rounds] [-r rcvbuf]
+
+/*生成的文件的内容：第i个字节是i % 251，接收端据此校验*/
+static const int PATTERN = 251;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*生成大小为size的测试文件*/
+static bool make_file( const char* path, long long size )
+{
+    int fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 )
+    {
+        printf( "open %s failed: %s\n", path, strerror( errno ) );
+        return false;
+    }
+    /*缓冲区大小是PATTERN的整数倍，每一块的内容都相同*/
+    static char buf[ PATTERN * 4096 ];
+    for( int i = 0; i < ( int )sizeof( buf ); ++i )
+    {
+        buf[i] = i % PATTERN;
+    }
+    for( long long written = 0; written < size; )
+    {
+        long long len = size - written < ( long long )sizeof( buf ) ? size - written : sizeof( buf );
+        ssize_t ret = write( fd, buf, len );
+        if( ret <= 0 )
+        {
+            printf( "write %s failed: %s\n", path, strerror( errno ) );
+            close( fd );
+            return false;
+        }
+        written += ret;
+    }
+    close( fd );
+    return true;
+}
+
+/*下载一个文件，返回下载的字节数，出错返回-1*/
+static long long download( int sockfd, const char* url )
+{
+    char request[ 256 ];
+    int len = snprintf( request, sizeof( request ), "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n", url );
+    if( send( sockfd, request, len, 0 ) != len )
+    {
+        printf( "send request failed: %s\n", strerror( errno ) );
+        return -1;
+    }
+
+    /*读入应答头部。服务器在头部之后紧接着发送文件，所以头部之后多读到的字节属于正文*/
+    static char buf[ 1 << 20 ];
+    int header_len = 0;
+    char* end = NULL;
+    while( ! end )
+    {
+        ssize_t ret = recv( sockfd, buf + header_len, sizeof( buf ) - 1 - header_len, 0 );
+        if( ret <= 0 )
+        {
+            printf( "connection closed while reading headers of %s\n", url );
+            return -1;
+        }
+        header_len += ret;
+        buf[ header_len ] = '\0';
+        end = strstr( buf, "\r\n\r\n" );
+    }
+    if( strncmp( buf, "HTTP/1.1 200", 12 ) != 0 )
+    {
+        printf( "%s: %.*s\n", url, ( int )( strchr( buf, '\r' ) - buf ), buf );
+        return -1;
+    }
+    char* length = strstr( buf, "Content-Length:" );
+    if( ! length || length > end )
+    {
+        printf( "%s: no Content-Length\n", url );
+        return -1;
+    }
+    long long content_length = atoll( length + 15 );
+
+    long long got = 0;
+    int body_len = header_len - ( end + 4 - buf );
+    const char* body = end + 4;
+    while( true )
+    {
+        /*逐字节校验，避免对每个字节做取模*/
+        int expect = got % PATTERN;
+        for( int i = 0; i < body_len; ++i )
+        {
+            if( ( unsigned char )body[i] != expect )
+            {
+                printf( "%s: wrong byte at offset %lld\n", url, got + i );
+                return -1;
+            }
+            if( ++expect == PATTERN )
+            {
+                expect = 0;
+            }
+        }
+        got += body_len;
+        if( got >= content_length )
+        {
+            break;
+        }
+        ssize_t ret = recv( sockfd, buf, ( long long )sizeof( buf ) < content_length - got ? sizeof( buf ) : content_length - got, 0 );
+        if( ret <= 0 )
+        {
+            printf( "%s: connection closed after %lld of %lld bytes\n", url, got, content_length );
+            return -1;
+        }
+        body = buf;
+        body_len = ret;
+    }
+    if( got != content_length )
+    {
+        printf( "%s: got %lld bytes, expected %lld\n", url, got, content_length );
+        return -1;
+    }
+    return got;
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc <= 2 )
+    {
+        printf( "usage: %s ip_address port_number [-d doc_root] [-m max_mb] [-n rounds] [-r rcvbuf]\n", basename( argv[0] ) );
+        return 1;
+    }
+    const char* ip = argv[1];
+    int port = atoi( argv[2] );
+    const char* doc_root = "/var/www/html";
+    long long max_size = 1024LL << 20;
+    int rounds = 3;
+    int rcvbuf = 0;
+    int option;
+    optind = 3;
+    while( ( option = getopt( argc, argv, "d:m:n:r:" ) ) != -1 )
+    {
+        switch( option )
+        {
+            case 'd':
+                doc_root = optarg;
+                break;
+            case 'm':
+                max_size = atoll( optarg ) << 20;
+                break;
+            case 'n':
+                rounds = atoi( optarg );
+                break;
+            case 'r':
+                rcvbuf = atoi( optarg );
+                break;
+            default:
+                return 1;
+        }
+    }
+
+    int sockfd = socket( PF_INET, SOCK_STREAM, 0 );
+    if( rcvbuf > 0 )
+    {
+        /*必须在connect之前设置，才能影响TCP窗口*/
+        setsockopt( sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof( rcvbuf ) );
+    }
+    struct sockaddr_in address;
+    bzero( &address, sizeof( address ) );
+    address.sin_family = AF_INET;
+    inet_pton( AF_INET, ip, &address.sin_addr );
+    address.sin_port = htons( port );
+    if( connect( sockfd, ( struct sockaddr* )&address, sizeof( address ) ) < 0 )
+    {
+        printf( "connect failed: %s\n", strerror( errno ) );
+        return 1;
+    }
+
+    /*64KB和200KB的文件走mmap+writev，其余走sendfile*/
+    const long long sizes[] = { 64LL << 10, 200LL << 10, 1LL << 20, 4LL << 20, 16LL << 20, 64LL << 20, 256LL << 20, 1024LL << 20 };
+    int failed = 0;
+    for( int i = 0; i < ( int )( sizeof( sizes ) / sizeof( sizes[0] ) ) && sizes[i] <= max_size; ++i )
+    {
+        char url[ 64 ];
+        char path[ 256 ];
+        snprintf( url, sizeof( url ), "/bench_%lld", sizes[i] );
+        snprintf( path, sizeof( path ), "%s%s", doc_root, url );
+        if( ! make_file( path, sizes[i] ) )
+        {
+            return 1;
+        }
+
+        double start = now();
+        long long total = 0;
+        int r = 0;
+        for( ; r < rounds; ++r )
+        {
+            long long ret = download( sockfd, url );
+            if( ret < 0 )
+            {
+                break;
+            }
+            total += ret;
+        }
+        double elapsed = now() - start;
+        unlink( path );
+        if( r < rounds )
+        {
+            /*出错之后连接上的数据已经不可信了*/
+            failed = 1;
+            break;
+        }
+        printf( "%10lld bytes x %d  %8.1f MB/s\n", sizes[i], rounds, total / elapsed / ( 1 << 20 ) );
+    }
+    close( sockfd );
+    printf( failed ? "FAILED\n" : "OK\n" );
+    return failed;
+}
@@ -0,0 +1,236 @@
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <stdint.h>
+#include "15_6_5_http_scan.h"
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+static const char* scan_bytes( const char* p, const char* end, char c1, char c2 )
+{
+    for ( ; p < end; ++p )
+    {
+        if ( *p == c1 || *p == c2 )
+        {
+            break;
+        }
+    }
+    return p;
+}
+
+/*不支持SSE4.2时使用的实现。只找一个字符时交给memchr（C库自己有优化的实现），
+否则一次检查8个字节（SWAR）：x中某个字节为0时，( x - 0x01...01 ) & ~x & 0x80...80不为0*/
+static const char* scan_scalar( const char* p, const char* end, char c1, char c2 )
+{
+    if ( c1 == c2 )
+    {
+        const char* hit = ( const char* )memchr( p, c1, end - p );
+        return hit ? hit : end;
+    }
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    const uint64_t v1 = ones * ( unsigned char )c1;
+    const uint64_t v2 = ones * ( unsigned char )c2;
+    for ( ; p + 8 <= end; p += 8 )
+    {
+        uint64_t data;
+        memcpy( &data, p, 8 );
+        uint64_t x1 = data ^ v1;
+        uint64_t x2 = data ^ v2;
+        if ( ( ( ( x1 - ones ) & ~x1 ) | ( ( x2 - ones ) & ~x2 ) ) & highs )
+        {
+            /*这8个字节中有要找的字节，逐字节找出第一个*/
+            break;
+        }
+    }
+    return scan_bytes( p, end, c1, c2 );
+}
+
+#ifdef HAVE_X86_SIMD
+/*用target属性只让这两个函数使用SSE4.2和AVX2指令，整个程序不需要-mavx2之类的编译选项，
+在不支持的CPU上也不会调用它们*/
+__attribute__( ( target( "sse4.2" ) ) )
+static const char* scan_sse42( const char* p, const char* end, char c1, char c2 )
+{
+    /*pcmpestri一条指令就能在16个字节中找出第一个属于字符集合{ c1, c2 }的字节*/
+    const __m128i set = _mm_setr_epi8( c1, c2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 );
+    for ( ; p + 16 <= end; p += 16 )
+    {
+        __m128i data = _mm_loadu_si128( ( const __m128i* )p );
+        int idx = _mm_cmpestri( set, 2, data, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT );
+        if ( idx < 16 )
+        {
+            return p + idx;
+        }
+    }
+    /*不足16个字节的尾部逐字节比较，避免读到缓冲区之外*/
+    return scan_bytes( p, end, c1, c2 );
+}
+
+__attribute__( ( target( "avx2" ) ) )
+static const char* scan_avx2( const char* p, const char* end, char c1, char c2 )
+{
+    const __m256i v1 = _mm256_set1_epi8( c1 );
+    const __m256i v2 = _mm256_set1_epi8( c2 );
+    for ( ; p + 32 <= end; p += 32 )
+    {
+        __m256i data = _mm256_loadu_si256( ( const __m256i* )p );
+        __m256i hit = _mm256_or_si256( _mm256_cmpeq_epi8( data, v1 ), _mm256_cmpeq_epi8( data, v2 ) );
+        unsigned int mask = _mm256_movemask_epi8( hit );
+        if ( mask )
+        {
+            return p + __builtin_ctz( mask );
+        }
+    }
+    return scan_bytes( p, end, c1, c2 );
+}
+#endif
+
+/*程序启动时选择CPU支持的最快的实现*/
+static scan_func choose_scan()
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports( "avx2" ) )
+    {
+        return scan_avx2;
+    }
+    if ( __builtin_cpu_supports( "sse4.2" ) )
+    {
+        return scan_sse42;
+    }
+#endif
+    return scan_scalar;
+}
+
+scan_func scan_any_impl = choose_scan();
+
+bool set_scan_impl( SCAN_IMPL impl )
+{
+    switch ( impl )
+    {
+        case SCAN_SCALAR:
+        {
+            scan_any_impl = scan_scalar;
+            return true;
+        }
+#ifdef HAVE_X86_SIMD
+        case SCAN_SSE42:
+        {
+            if ( ! __builtin_cpu_supports( "sse4.2" ) )
+            {
+                return false;
+            }
+            scan_any_impl = scan_sse42;
+            return true;
+        }
+        case SCAN_AVX2:
+        {
+            if ( ! __builtin_cpu_supports( "avx2" ) )
+            {
+                return false;
+            }
+            scan_any_impl = scan_avx2;
+            return true;
+        }
+#endif
+        default:
+        {
+            return false;
+        }
+    }
+}
+
+const char* scan_impl_name()
+{
+#ifdef HAVE_X86_SIMD
+    if ( scan_any_impl == scan_avx2 )
+    {
+        return "avx2";
+    }
+    if ( scan_any_impl == scan_sse42 )
+    {
+        return "sse4.2";
+    }
+#endif
+    return "scalar";
+}
+
+/*头部字段的完美哈希表。哈希值只取决于字段名的长度和首尾两个字符（转成小写），
+下面这组字段在64个槽中没有冲突；增加字段时如果冲突，build_header_table中的assert会失败，需要重新选择系数*/
+static const int HEADER_TABLE_SIZE = 64;
+
+struct header_slot
+{
+    const char* m_name;
+    int m_len;
+    HEADER m_header;
+};
+
+static header_slot header_table[ HEADER_TABLE_SIZE ];
+
+static inline unsigned int header_hash( const char* name, int len )
+{
+    /*字母或上0x20就是小写，'-'和数字不受影响*/
+    return ( len + ( name[0] | 0x20 ) * 7 + ( name[ len - 1 ] | 0x20 ) ) & ( HEADER_TABLE_SIZE - 1 );
+}
+
+static bool build_header_table()
+{
+    static const header_slot headers[] =
+    {
+        { "connection", 0, HEADER_CONNECTION },
+        { "content-length", 0, HEADER_CONTENT_LENGTH },
+        { "host", 0, HEADER_HOST },
+        { "user-agent", 0, HEADER_OTHER },
+        { "accept", 0, HEADER_OTHER },
+        { "accept-encoding", 0, HEADER_OTHER },
+        { "accept-language", 0, HEADER_OTHER },
+        { "accept-charset", 0, HEADER_OTHER },
+        { "cache-control", 0, HEADER_OTHER },
+        { "cookie", 0, HEADER_OTHER },
+        { "referer", 0, HEADER_OTHER },
+        { "if-modified-since", 0, HEADER_OTHER },
+        { "if-none-match", 0, HEADER_OTHER },
+        { "if-range", 0, HEADER_OTHER },
+        { "upgrade-insecure-requests", 0, HEADER_OTHER },
+        { "pragma", 0, HEADER_OTHER },
+        { "range", 0, HEADER_OTHER },
+        { "origin", 0, HEADER_OTHER },
+        { "dnt", 0, HEADER_OTHER },
+        { "authorization", 0, HEADER_OTHER },
+        { "content-type", 0, HEADER_OTHER },
+        { "x-forwarded-for", 0, HEADER_OTHER },
+        { "x-real-ip", 0, HEADER_OTHER },
+    };
+    for ( int i = 0; i < ( int )( sizeof( headers ) / sizeof( headers[0] ) ); ++i )
+    {
+        int len = strlen( headers[i].m_name );
+        header_slot& slot = header_table[ header_hash( headers[i].m_name, len ) ];
+        assert( slot.m_name == NULL );
+        slot.m_name = headers[i].m_name;
+        slot.m_len = len;
+        slot.m_header = headers[i].m_header;
+    }
+    return true;
+}
+
+static bool header_table_ready __attribute__( ( unused ) ) = build_header_table();
+
+HEADER lookup_header( const char* name, int len )
+{
+    if ( len <= 0 )
+    {
+        return HEADER_UNKNOWN;
+    }
+    const header_slot& slot = header_table[ header_hash( name, len ) ];
+    /*哈希值相同的只可能是这一个字段，比较一次就够了*/
+    if ( slot.m_len == len && strncasecmp( slot.m_name, name, len ) == 0 )
+    {
+        return slot.m_header;
+    }
+    return HEADER_UNKNOWN;
+}
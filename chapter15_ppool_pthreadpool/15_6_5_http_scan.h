@@ -0,0 +1,33 @@
+#ifndef HTTPSCAN_H
+#define HTTPSCAN_H
+
+// http_conn解析请求时用到的两个基本操作：
+// 在一段数据中查找行结束符或者分隔符，以及根据头部字段名找到字段。
+// 查找用SIMD指令一次比较16（SSE4.2）或32（AVX2）个字节，程序启动时根据CPU支持的指令集选择实现，
+// 不支持时每次比较8个字节（SWAR）；字段名通过一张完美哈希表查找，不用逐个strncasecmp
+
+/*可以使用的查找实现，按速度从慢到快排列*/
+enum SCAN_IMPL { SCAN_SCALAR = 0, SCAN_SSE42, SCAN_AVX2 };
+
+/*在[p, end)中查找第一个等于c1或c2的字节，返回它的位置，找不到时返回end。
+只读取[p, end)范围内的内存*/
+typedef const char* ( *scan_func )( const char* p, const char* end, char c1, char c2 );
+extern scan_func scan_any_impl;
+
+inline const char* scan_any( const char* p, const char* end, char c1, char c2 )
+{
+    return scan_any_impl( p, end, c1, c2 );
+}
+
+/*切换查找实现，CPU不支持时返回false。默认已经选择了最快的实现，这个函数主要给基准测试使用*/
+bool set_scan_impl( SCAN_IMPL impl );
+/*当前使用的实现的名字*/
+const char* scan_impl_name();
+
+/*http_conn关心的头部字段。HEADER_OTHER是常见但我们不处理的字段，HEADER_UNKNOWN是不认识的字段*/
+enum HEADER { HEADER_UNKNOWN = 0, HEADER_OTHER, HEADER_CONNECTION, HEADER_CONTENT_LENGTH, HEADER_HOST };
+
+/*根据字段名（不含冒号，长度为len，不区分大小写）查找字段*/
+HEADER lookup_header( const char* name, int len );
+
+#endif
@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "15_6_1_http_conn.h"
+
+// 请求解析的基准测试：把同一个浏览器风格的请求重复很多份放进一个缓冲区（相当于流水线请求），
+// 分别用书中的逐字节扫描+strpbrk+strncasecmp的写法，以及http_conn::parse_requests（即process_read使用的状态机，
+// 逐一使用scalar、sse4.2、avx2三种查找实现）解析，统计单核每秒解析的请求数。
+// 只测量解析本身：关掉了http_conn逐行的printf，也不查找目标文件、不生成应答。
+// 编译：g++ -O2 -pthread 15_6_6_parser_bench.cpp 15_6_1_http_conn.cpp 15_6_3_file_cache.cpp 15_6_5_http_scan.cpp -o parser_bench
+// 用法：./parser_bench [-s seconds]
+
+static const char REQUEST[] =
+    "GET /static/js/app.3f2a9c1b.js HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Referer: http://www.example.com/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+    "If-None-Match: \"5f8d3a2c-1b3e\"\r\n"
+    "If-Modified-Since: Mon, 12 Oct 2020 08:15:40 GMT\r\n"
+    "\r\n";
+
+/*一轮解析的请求数*/
+static const int COPIES = 1000;
+
+/*书中的写法在读缓冲区中原地解析，每一轮先把数据复制到这里，相当于recv*/
+static char* work = NULL;
+/*书中的写法累加字段值的结果，防止编译器把解析过程优化掉*/
+static long book_sink = 0;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*书中的写法：逐字节查找行结束符，行内用strpbrk找分隔符，字段名依次strncasecmp。
+http_conn中已经没有这种写法了，保留在这里作为比较的基准。返回解析出的请求数，出错返回-1*/
+static int parse_book( const char* data, int len )
+{
+    memcpy( work, data, len );
+    char* p = work;
+    char* end = work + len;
+    bool request_line = true;
+    int requests = 0;
+    while ( p < end )
+    {
+        char* text = p;
+        for ( ; p < end; ++p )
+        {
+            if ( *p == '\r' || *p == '\n' )
+            {
+                break;
+            }
+        }
+        if ( p + 1 >= end || p[0] != '\r' || p[1] != '\n' )
+        {
+            return -1;
+        }
+        *p++ = '\0';
+        *p++ = '\0';
+
+        if ( request_line )
+        {
+            char* url = strpbrk( text, " \t" );
+            if ( ! url )
+            {
+                return -1;
+            }
+            *url++ = '\0';
+            if ( strcasecmp( text, "GET" ) != 0 )
+            {
+                return -1;
+            }
+            url += strspn( url, " \t" );
+            char* version = strpbrk( url, " \t" );
+            if ( ! version )
+            {
+                return -1;
+            }
+            *version++ = '\0';
+            version += strspn( version, " \t" );
+            if ( strcasecmp( version, "HTTP/1.1" ) != 0 )
+            {
+                return -1;
+            }
+            book_sink += strlen( url );
+            request_line = false;
+        }
+        else if ( text[ 0 ] == '\0' )
+        {
+            ++requests;
+            request_line = true;
+        }
+        else if ( strncasecmp( text, "Connection:", 11 ) == 0 )
+        {
+            text += 11;
+            text += strspn( text, " \t" );
+            book_sink += ( strcasecmp( text, "keep-alive" ) == 0 );
+        }
+        else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 )
+        {
+            text += 15;
+            text += strspn( text, " \t" );
+            book_sink += atol( text );
+        }
+        else if ( strncasecmp( text, "Host:", 5 ) == 0 )
+        {
+            text += 5;
+            text += strspn( text, " \t" );
+            book_sink += strlen( text );
+        }
+        else
+        {
+            /*书中在这里printf，基准测试只计数*/
+            ++book_sink;
+        }
+    }
+    return requests;
+}
+
+static http_conn conn;
+
+/*http_conn现在的写法：scan_any查找行结束符和分隔符，字段名查完美哈希表。
+parse_requests自己把数据分段复制到读缓冲区中，和从socket上读入时一样*/
+static int parse_http_conn( const char* data, int len )
+{
+    return conn.parse_requests( data, len );
+}
+
+typedef int ( *parse_func )( const char* data, int len );
+
+/*反复解析seconds秒，每一轮都应该解析出COPIES个请求*/
+static bool run( const char* name, parse_func parse, const char* data, int len, double seconds )
+{
+    long long rounds = 0;
+    long long requests = 0;
+    double start = now();
+    double elapsed = 0;
+    do
+    {
+        for ( int i = 0; i < 16; ++i, ++rounds )
+        {
+            int ret = parse( data, len );
+            if ( ret != COPIES )
+            {
+                printf( "%s: parsed %d requests, expected %d\n", name, ret, COPIES );
+                return false;
+            }
+            requests += ret;
+        }
+        elapsed = now() - start;
+    } while ( elapsed < seconds );
+
+    printf( "%-8s %12.0f req/s %8.2f GB/s\n", name,
+            requests / elapsed, rounds * len / elapsed / ( 1 << 30 ) );
+    return true;
+}
+
+int main( int argc, char* argv[] )
+{
+    double seconds = 1.0;
+    int option;
+    while ( ( option = getopt( argc, argv, "s:" ) ) != -1 )
+    {
+        switch ( option )
+        {
+            case 's':
+                seconds = atof( optarg );
+                break;
+            default:
+                printf( "usage: %s [-s seconds]\n", basename( argv[0] ) );
+                return 1;
+        }
+    }
+
+    http_conn::m_print_lines = false;
+    int request_len = sizeof( REQUEST ) - 1;
+    int len = request_len * COPIES;
+    char* data = new char[ len ];
+    work = new char[ len ];
+    for ( int i = 0; i < COPIES; ++i )
+    {
+        memcpy( data + i * request_len, REQUEST, request_len );
+    }
+    printf( "%d requests of %d bytes, %d headers each, default scanner: %s\n",
+            COPIES, request_len, 10, scan_impl_name() );
+
+    int failed = 0;
+    if ( ! run( "book", parse_book, data, len, seconds ) )
+    {
+        failed = 1;
+    }
+
+    const SCAN_IMPL impls[] = { SCAN_SCALAR, SCAN_SSE42, SCAN_AVX2 };
+    for ( int i = 0; i < ( int )( sizeof( impls ) / sizeof( impls[0] ) ); ++i )
+    {
+        if ( ! set_scan_impl( impls[i] ) )
+        {
+            printf( "scanner %d not supported by this CPU\n", impls[i] );
+            continue;
+        }
+        if ( ! run( scan_impl_name(), parse_http_conn, data, len, seconds ) )
+        {
+            failed = 1;
+        }
+    }
+
+    delete [] data;
+    delete [] work;
+    printf( failed ? "FAILED\n" : "OK\n" );
+    return failed;
+}
@@ -0,0 +1,59 @@
+#!/bin/bash
+# 在一台机器上对比直连逻辑主机和经过springsnail时的吞吐量和延迟：
+# 启动bench_backend作为逻辑主机，按参数生成配置并启动springsnail，再分别用loadgen测量两种情况，最后清理所有进程。
+# 用法：./bench.sh [echo|http] [loadgen的其他参数]，例如
+#   ./bench.sh echo -c 128 -s 512
+#   ./bench.sh http -c 64 -z 4096 -r 20000
+# 环境变量：WORKERS（springsnail的子进程数，默认2），LB_MODE（http模式下springsnail使用http（L7，默认）或tcp（L4））
+set -e
+cd "$( dirname "$0" )"
+
+MODE=${1:-echo}
+[ $# -gt 0 ] && shift
+WORKERS=${WORKERS:-2}
+LB_MODE=${LB_MODE:-http}
+BACKEND_PORT=${BACKEND_PORT:-19100}
+LB_PORT=${LB_PORT:-19180}
+ADMIN_PORT=${ADMIN_PORT:-19190}
+
+make -s springsnail loadgen bench_backend
+
+TMP=$( mktemp -d )
+PIDS=""
+cleanup()
+{
+    [ -n "$PIDS" ] && kill $PIDS 2>/dev/null || true
+    # 等进程退出、释放端口，连续运行两次时后一次才不会连到前一次残留的springsnail
+    wait 2>/dev/null || true
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+# 每个客户在L4模式下独占一个服务端连接，最大连接数要覆盖loadgen的并发连接数
+cat > "$TMP/bench.xml" <<CFG
+Listen 127.0.0.1:$LB_PORT
+Workers $WORKERS
+AdminListen 127.0.0.1:$ADMIN_PORT
+$( [ "$MODE" = http ] && [ "$LB_MODE" = http ] && echo "Mode http" )
+
+<logical_host>
+  <name>127.0.0.1</name>
+  <port>$BACKEND_PORT</port>
+  <conns>16</conns>
+  <max_conns>1024</max_conns>
+  <buffer>16384</buffer>
+</logical_host>
+CFG
+
+./bench_backend -p $BACKEND_PORT -m $MODE -t 2 &
+PIDS="$PIDS $!"
+./springsnail -f "$TMP/bench.xml" > "$TMP/springsnail.log" 2>&1 &
+PIDS="$PIDS $!"
+sleep 1
+
+echo "== direct to backend"
+./loadgen -p $BACKEND_PORT -m $MODE "$@"
+echo "== through springsnail"
+./loadgen -p $LB_PORT -m $MODE "$@"
+echo "== springsnail stats"
+exec 3<>/dev/tcp/127.0.0.1/$ADMIN_PORT && printf 'GET / HTTP/1.0\r\n\r\n' >&3 && sed '1,/^\r$/d' <&3 || true
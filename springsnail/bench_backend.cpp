@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string>
+
+using std::string;
+
+// 基准测试用的本地逻辑主机，配合loadgen在一台机器上测量springsnail的吞吐量和延迟：
+// echo模式把收到的数据原样写回；http模式对"GET /n"应答n字节的正文，支持keep-alive和流水线。
+// 每个线程有自己的SO_REUSEPORT监听socket和epoll，线程之间不共享任何状态
+// 编译：make bench_backend    用法：bench_backend -p port [-a ip] [-m echo|http] [-t threads]
+
+static const int MAX_EVENTS = 1024;
+static const int READ_SIZE = 65536;
+
+static char listen_ip[ 64 ] = "127.0.0.1";
+static int listen_port = 0;
+static bool http_mode = false;
+
+// 一个客户连接：m_in是还没有组成完整请求的数据（http模式），m_out中从m_out_pos开始是还没有写出的应答
+struct client
+{
+    int m_fd;
+    string m_in;
+    string m_out;
+    size_t m_out_pos;
+    bool m_close;   //应答写完后关闭连接（请求带有Connection: close）
+};
+
+static void set_events( int epollfd, client* clt, int ev )
+{
+    epoll_event event;
+    event.data.ptr = clt;
+    event.events = ev | EPOLLET;
+    epoll_ctl( epollfd, EPOLL_CTL_MOD, clt->m_fd, &event );
+}
+
+static void close_client( int epollfd, client* clt )
+{
+    epoll_ctl( epollfd, EPOLL_CTL_DEL, clt->m_fd, NULL );
+    close( clt->m_fd );
+    delete clt;
+}
+
+// 处理m_in中所有完整的请求，应答追加到m_out
+static void handle_requests( client* clt )
+{
+    size_t pos = 0;
+    size_t end = 0;
+    while( ( end = clt->m_in.find( "\r\n\r\n", pos ) ) != string::npos )
+    {
+        const char* req = clt->m_in.c_str() + pos;
+        long long size = 0;
+        if( strncmp( req, "GET /", 5 ) == 0 || strncmp( req, "HEAD /", 6 ) == 0 )
+        {
+            size = atoll( strchr( req, '/' ) + 1 );
+        }
+        string headers = clt->m_in.substr( pos, end - pos );
+        if( headers.find( "Connection: close" ) != string::npos || headers.find( "HTTP/1.0" ) != string::npos )
+        {
+            clt->m_close = true;
+        }
+        char header[ 128 ];
+        int len = snprintf( header, sizeof( header ), "HTTP/1.1 200 OK\r\nContent-Length: %lld\r\n\r\n", size );
+        clt->m_out.append( header, len );
+        if( req[0] == 'G' )
+        {
+            clt->m_out.append( size, 'x' );
+        }
+        pos = end + 4;
+        if( clt->m_close )
+        {
+            break;
+        }
+    }
+    clt->m_in.erase( 0, pos );
+}
+
+// 写出m_out中的数据，返回false表示连接出错
+static bool flush_out( int epollfd, client* clt )
+{
+    while( clt->m_out_pos < clt->m_out.size() )
+    {
+        ssize_t ret = send( clt->m_fd, clt->m_out.data() + clt->m_out_pos, clt->m_out.size() - clt->m_out_pos, MSG_NOSIGNAL );
+        if( ret < 0 )
+        {
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+                //写不完时暂停读，等待可写事件
+                set_events( epollfd, clt, EPOLLOUT );
+                return true;
+            }
+            if( errno == EINTR )
+            {
+                continue;
+            }
+            return false;
+        }
+        clt->m_out_pos += ret;
+    }
+    clt->m_out.clear();
+    clt->m_out_pos = 0;
+    return !clt->m_close;
+}
+
+// 读出socket中的所有数据并应答，返回false表示连接需要关闭
+static bool handle_read( int epollfd, client* clt )
+{
+    static __thread char buf[ READ_SIZE ];
+    while( true )
+    {
+        ssize_t ret = recv( clt->m_fd, buf, sizeof( buf ), 0 );
+        if( ret < 0 )
+        {
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+                return true;
+            }
+            if( errno == EINTR )
+            {
+                continue;
+            }
+            return false;
+        }
+        if( ret == 0 )
+        {
+            return false;
+        }
+        if( http_mode )
+        {
+            clt->m_in.append( buf, ret );
+            handle_requests( clt );
+        }
+        else
+        {
+            clt->m_out.append( buf, ret );
+        }
+        if( !flush_out( epollfd, clt ) )
+        {
+            return false;
+        }
+        if( !clt->m_out.empty() )
+        {
+            return true;    //等可写之后再继续读
+        }
+    }
+}
+
+static void* worker( void* arg __attribute__( ( unused ) ) )
+{
+    int listenfd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+    int reuse = 1;
+    setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+    setsockopt( listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof( reuse ) );
+    struct sockaddr_in address;
+    memset( &address, 0, sizeof( address ) );
+    address.sin_family = AF_INET;
+    inet_pton( AF_INET, listen_ip, &address.sin_addr );
+    address.sin_port = htons( listen_port );
+    if( bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) ) < 0 || listen( listenfd, 1024 ) < 0 )
+    {
+        fprintf( stderr, "listen on %s:%d failed: %s\n", listen_ip, listen_port, strerror( errno ) );
+        exit( 1 );
+    }
+
+    int epollfd = epoll_create( 5 );
+    epoll_event event;
+    event.data.ptr = NULL;  //data.ptr为NULL表示监听socket
+    event.events = EPOLLIN | EPOLLET;
+    epoll_ctl( epollfd, EPOLL_CTL_ADD, listenfd, &event );
+
+    epoll_event events[ MAX_EVENTS ];
+    while( true )
+    {
+        int number = epoll_wait( epollfd, events, MAX_EVENTS, -1 );
+        for( int i = 0; i < number; ++i )
+        {
+            client* clt = ( client* )events[i].data.ptr;
+            if( !clt )
+            {
+                int connfd = 0;
+                while( ( connfd = accept4( listenfd, NULL, NULL, SOCK_NONBLOCK ) ) >= 0 )
+                {
+                    int nodelay = 1;
+                    setsockopt( connfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof( nodelay ) );
+                    client* tmp = new client;
+                    tmp->m_fd = connfd;
+                    tmp->m_out_pos = 0;
+                    tmp->m_close = false;
+                    event.data.ptr = tmp;
+                    event.events = EPOLLIN | EPOLLET;
+                    epoll_ctl( epollfd, EPOLL_CTL_ADD, connfd, &event );
+                }
+                continue;
+            }
+            bool ok = true;
+            if( events[i].events & ( EPOLLERR | EPOLLHUP ) )
+            {
+                ok = false;
+            }
+            else if( events[i].events & EPOLLOUT )
+            {
+                ok = flush_out( epollfd, clt );
+                if( ok && clt->m_out.empty() )
+                {
+                    //积压的应答写完了，恢复读。ET模式下重新注册才会通知已经到达的数据
+                    set_events( epollfd, clt, EPOLLIN );
+                    ok = handle_read( epollfd, clt );
+                }
+            }
+            else if( events[i].events & EPOLLIN )
+            {
+                ok = handle_read( epollfd, clt );
+            }
+            if( !ok )
+            {
+                close_client( epollfd, clt );
+            }
+        }
+    }
+    return NULL;
+}
+
+int main( int argc, char* argv[] )
+{
+    int threads = 1;
+    int option;
+    while( ( option = getopt( argc, argv, "a:p:m:t:" ) ) != -1 )
+    {
+        switch( option )
+        {
+            case 'a':
+                snprintf( listen_ip, sizeof( listen_ip ), "%s", optarg );
+                break;
+            case 'p':
+                listen_port = atoi( optarg );
+                break;
+            case 'm':
+                http_mode = ( strcmp( optarg, "http" ) == 0 );
+                break;
+            case 't':
+                threads = atoi( optarg );
+                break;
+            default:
+                printf( "usage: %s -p port [-a ip] [-m echo|http] [-t threads]\n", argv[0] );
+                return 1;
+        }
+    }
+    if( listen_port <= 0 || threads <= 0 )
+    {
+        printf( "usage: %s -p port [-a ip] [-m echo|http] [-t threads]\n", argv[0] );
+        return 1;
+    }
+    signal( SIGPIPE, SIG_IGN );
+    pthread_t tids[ 64 ];
+    if( threads > 64 )
+    {
+        threads = 64;
+    }
+    for( int i = 0; i < threads; ++i )
+    {
+        pthread_create( &tids[i], NULL, worker, NULL );
+    }
+    for( int i = 0; i < threads; ++i )
+    {
+        pthread_join( tids[i], NULL );
+    }
+    return 0;
+}
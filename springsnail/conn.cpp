@@ -1,30 +1,76 @@
 #include <exception>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include "conn.h"
 #include "log.h"
 #include "fdwrapper.h"
 
-conn::conn()
+unsigned long long conn::m_bytes_relayed = 0;
+unsigned long long conn::m_eagain_cnt = 0;
+
+conn::conn( int buf_size )
 {
-    m_srvfd = -1;
-    m_clt_buf = new char[ BUF_SIZE ];
+    m_buf_size = 1;
+    while( m_buf_size < buf_size )
+    {
+        m_buf_size <<= 1;
+    }
+    m_clt_buf = new char[ m_buf_size ];
     if( !m_clt_buf )
     {
         throw std::exception();
     }
-    m_srv_buf = new char[ BUF_SIZE ];
+    m_srv_buf = new char[ m_buf_size ];
     if( !m_srv_buf )
     {
         throw std::exception();
     }
-    reset();
+    m_own_buf = true;
+    init();
+}
+
+conn::conn( char* buf, int buf_size )
+{
+    m_buf_size = buf_size;
+    m_clt_buf = buf;
+    m_srv_buf = buf + buf_size;
+    m_own_buf = false;
+    init();
 }
 
 conn::~conn()
 {
-    delete [] m_clt_buf;
-    delete [] m_srv_buf;
+    close_splice();
+    if( m_own_buf )
+    {
+        delete [] m_clt_buf;
+        delete [] m_srv_buf;
+    }
+}
+
+void conn::init()
+{
+    m_srvfd = -1;
+    m_retry_at = 0;
+    m_backoff = 0;
+    m_connecting = false;
+    m_backend = 0;
+    m_idle_since = 0;
+    m_bound_at = 0;
+    m_connect_start = 0;
+    m_last_active = 0;
+    m_prev = NULL;
+    m_next = NULL;
+    m_splice = false;
+    m_pipe_size = 0;
+    m_clt_pipe[0] = m_clt_pipe[1] = -1;
+    m_srv_pipe[0] = m_srv_pipe[1] = -1;
+    m_clt_pipe_bytes = 0;
+    m_srv_pipe_bytes = 0;
+    reset();
 }
 
 void conn::init_clt( int sockfd, const sockaddr_in& client_addr )
@@ -46,33 +92,92 @@ void conn::reset()
     m_srv_read_idx = 0;
     m_srv_write_idx = 0;
     m_srv_closed = false;
+    m_clt_paused = false;
+    m_srv_paused = false;
+    m_clt_events = 0;
+    m_srv_events = 0;
     m_cltfd = -1;
-    memset( m_clt_buf, '\0', BUF_SIZE );
-    memset( m_srv_buf, '\0', BUF_SIZE );
+    m_session = NULL;
+    m_req_at = 0;
+    m_req.init( true );
+    m_resp.init( false );
+    m_req_idx = 0;
+    m_resp_idx = 0;
+    m_pending_reqs = 0;
+    m_head_mask = 0;
+    m_reusable = true;
+    m_clt_close = false;
+    //缓冲区中的内容只在读写下标之间有效，不需要清零，避免每次释放连接都写一遍两个缓冲区
+
+    //管道中还残留上一个客户的数据时无法清空，只能重新创建
+    if( m_splice && ( m_clt_pipe_bytes != 0 || m_srv_pipe_bytes != 0 ) )
+    {
+        close_splice();
+        init_splice();
+    }
 }
 
-RET_CODE conn::read_clt()
+bool conn::init_splice()
+{
+    if( pipe2( m_clt_pipe, O_NONBLOCK ) < 0 )
+    {
+        LOG( LOG_ERR, "create splice pipe failed, %s", strerror( errno ) );
+        return false;
+    }
+    if( pipe2( m_srv_pipe, O_NONBLOCK ) < 0 )
+    {
+        LOG( LOG_ERR, "create splice pipe failed, %s", strerror( errno ) );
+        close( m_clt_pipe[0] );
+        close( m_clt_pipe[1] );
+        m_clt_pipe[0] = m_clt_pipe[1] = -1;
+        return false;
+    }
+    m_pipe_size = fcntl( m_clt_pipe[1], F_GETPIPE_SZ );
+    if( m_pipe_size <= 0 )
+    {
+        m_pipe_size = 65536;
+    }
+    m_clt_pipe_bytes = 0;
+    m_srv_pipe_bytes = 0;
+    m_splice = true;
+    return true;
+}
+
+void conn::close_splice()
+{
+    if( m_clt_pipe[0] != -1 )
+    {
+        close( m_clt_pipe[0] );
+        close( m_clt_pipe[1] );
+        close( m_srv_pipe[0] );
+        close( m_srv_pipe[1] );
+    }
+    m_clt_pipe[0] = m_clt_pipe[1] = -1;
+    m_srv_pipe[0] = m_srv_pipe[1] = -1;
+    m_clt_pipe_bytes = 0;
+    m_srv_pipe_bytes = 0;
+    m_splice = false;
+}
+
+RET_CODE conn::splice_read( int sockfd, int* pipefd, int& pipe_bytes )
 {
     int bytes_read = 0;
     while( true )
     {
-        if( m_clt_read_idx >= BUF_SIZE )    //如果读入的数据大于BUF_SIZE
+        if( pipe_bytes >= m_pipe_size )
         {
-            log( LOG_ERR, __FILE__, __LINE__, "%s", "the client read buffer is full, let server write" );
             return BUFFER_FULL;
         }
 
-        // 因为存在分包的问题（recv所读入的并非是size的大小）
-        // 因此我们根据recv的返回值进行循环读入，直到读满m_clt_buf或者recv的返回值为0（数据被读完）
-        bytes_read = recv( m_cltfd, m_clt_buf + m_clt_read_idx, BUF_SIZE - m_clt_read_idx, 0 );
+        //把sockfd上流入的数据定向到管道中
+        bytes_read = splice( sockfd, NULL, pipefd[1], NULL, m_pipe_size - pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
         if ( bytes_read == -1 )
         {
-            // 非阻塞情况下： 
-            // EAGAIN表示没有数据可读，请尝试再次调用,而在阻塞情况下，如果被中断，则返回EINTR;
-            // EWOULDBLOCK等同于EAGAIN
+            //sockfd上暂时没有数据，或者管道的页已经用完（管道按页存放数据，字节数不到m_pipe_size也可能写不进去）。
+            //二者无法区分，管道非空时按已满处理，由mgr在管道写空之后重新注册可读事件
             if( errno == EAGAIN || errno == EWOULDBLOCK )
             {
-                break;
+                return ( pipe_bytes > 0 ) ? BUFFER_FULL : NOTHING;
             }
             return IOERR;
         }
@@ -81,93 +186,113 @@ RET_CODE conn::read_clt()
             return CLOSED;
         }
 
-        m_clt_read_idx += bytes_read;
+        pipe_bytes += bytes_read;
     }
-    return ( ( m_clt_read_idx - m_clt_write_idx ) > 0 ) ? OK : NOTHING;
+    return ( pipe_bytes > 0 ) ? OK : NOTHING;
 }
 
-RET_CODE conn::read_srv()
+RET_CODE conn::splice_write( int sockfd, int* pipefd, int& pipe_bytes )
 {
-    int bytes_read = 0;
+    int bytes_write = 0;
     while( true )
     {
-        if( m_srv_read_idx >= BUF_SIZE )
+        if( pipe_bytes <= 0 )
         {
-            log( LOG_ERR, __FILE__, __LINE__, "%s", "the server read buffer is full, let client write" );
-            return BUFFER_FULL;
+            return BUFFER_EMPTY;
         }
 
-        bytes_read = recv( m_srvfd, m_srv_buf + m_srv_read_idx, BUF_SIZE - m_srv_read_idx, 0 );
-        if ( bytes_read == -1 )
+        //把管道的输出定向到sockfd
+        bytes_write = splice( pipefd[0], NULL, sockfd, NULL, pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+        if ( bytes_write == -1 )
         {
             if( errno == EAGAIN || errno == EWOULDBLOCK )
             {
-                break;
+                ++m_eagain_cnt;
+                return TRY_AGAIN;
             }
+            LOG( LOG_ERR, "splice to socket failed, %s", strerror( errno ) );
             return IOERR;
         }
-        else if ( bytes_read == 0 )
+        else if ( bytes_write == 0 )
         {
-            log( LOG_ERR, __FILE__, __LINE__, "%s", "the server should not close the persist connection" );
             return CLOSED;
         }
 
-        m_srv_read_idx += bytes_read;
+        pipe_bytes -= bytes_write;
+        m_bytes_relayed += bytes_write;
     }
-    return ( ( m_srv_read_idx - m_srv_write_idx ) > 0 ) ? OK : NOTHING;
 }
 
-RET_CODE conn::write_srv()
+RET_CODE conn::ring_read( int sockfd, char* buf, unsigned int& read_idx, unsigned int write_idx )
 {
-    int bytes_write = 0;
+    unsigned int mask = m_buf_size - 1;
+    int bytes_read = 0;
     while( true )
     {
-        if( m_clt_read_idx <= m_clt_write_idx )
+        unsigned int space = m_buf_size - ( read_idx - write_idx );
+        if( space == 0 )
         {
-            m_clt_read_idx = 0;
-            m_clt_write_idx = 0;
-            return BUFFER_EMPTY;
+            return BUFFER_FULL;
         }
 
-        bytes_write = send( m_srvfd, m_clt_buf + m_clt_write_idx, m_clt_read_idx - m_clt_write_idx, 0 );
-        if ( bytes_write == -1 )
+        //空闲区域可能跨过缓冲区末尾，分成两段交给readv
+        unsigned int pos = read_idx & mask;
+        unsigned int first = ( space < m_buf_size - pos ) ? space : m_buf_size - pos;
+        struct iovec iv[2];
+        iv[0].iov_base = buf + pos;
+        iv[0].iov_len = first;
+        iv[1].iov_base = buf;
+        iv[1].iov_len = space - first;
+        bytes_read = readv( sockfd, iv, ( space > first ) ? 2 : 1 );
+        if ( bytes_read == -1 )
         {
+            // 非阻塞情况下： 
+            // EAGAIN表示没有数据可读，请尝试再次调用,而在阻塞情况下，如果被中断，则返回EINTR;
+            // EWOULDBLOCK等同于EAGAIN
             if( errno == EAGAIN || errno == EWOULDBLOCK )
             {
-                return TRY_AGAIN;
+                break;
             }
-            log( LOG_ERR, __FILE__, __LINE__, "write server socket failed, %s", strerror( errno ) );
             return IOERR;
         }
-        else if ( bytes_write == 0 )
+        else if ( bytes_read == 0 )
         {
             return CLOSED;
         }
 
-        m_clt_write_idx += bytes_write;
+        read_idx += bytes_read;
     }
+    return ( read_idx != write_idx ) ? OK : NOTHING;
 }
 
-RET_CODE conn::write_clt()
+RET_CODE conn::ring_write( int sockfd, char* buf, unsigned int read_idx, unsigned int& write_idx )
 {
+    unsigned int mask = m_buf_size - 1;
     int bytes_write = 0;
     while( true )
     {
-        if( m_srv_read_idx <= m_srv_write_idx )
+        unsigned int pending = read_idx - write_idx;
+        if( pending == 0 )
         {
-            m_srv_read_idx = 0;
-            m_srv_write_idx = 0;
             return BUFFER_EMPTY;
         }
 
-        bytes_write = send( m_cltfd, m_srv_buf + m_srv_write_idx, m_srv_read_idx - m_srv_write_idx, 0 );
+        unsigned int pos = write_idx & mask;
+        unsigned int first = ( pending < m_buf_size - pos ) ? pending : m_buf_size - pos;
+        struct iovec iv[2];
+        iv[0].iov_base = buf + pos;
+        iv[0].iov_len = first;
+        iv[1].iov_base = buf;
+        iv[1].iov_len = pending - first;
+        bytes_write = writev( sockfd, iv, ( pending > first ) ? 2 : 1 );
         if ( bytes_write == -1 )
         {
             if( errno == EAGAIN || errno == EWOULDBLOCK )
             {
+                ++m_eagain_cnt;
                 return TRY_AGAIN;
             }
-            log( LOG_ERR, __FILE__, __LINE__, "write client socket failed, %s", strerror( errno ) );
+            LOG( LOG_ERR, "write socket %d failed, %s", sockfd, strerror( errno ) );
             return IOERR;
         }
         else if ( bytes_write == 0 )
@@ -175,6 +300,175 @@ RET_CODE conn::write_clt()
             return CLOSED;
         }
 
-        m_srv_write_idx += bytes_write;
+        write_idx += bytes_write;
+        m_bytes_relayed += bytes_write;
     }
 }
+
+RET_CODE conn::read_clt()
+{
+    if( m_splice )
+    {
+        RET_CODE res = splice_read( m_cltfd, m_clt_pipe, m_clt_pipe_bytes );
+        //内核不支持对该socket使用splice时，在管道为空的前提下退回到用户空间缓冲的转发方式
+        if( res != IOERR || errno != EINVAL || m_clt_pipe_bytes != 0 || m_srv_pipe_bytes != 0 )
+        {
+            return res;
+        }
+        LOG( LOG_INFO, "%s", "splice not supported, fall back to buffered relay" );
+        close_splice();
+    }
+
+    RET_CODE res = ring_read( m_cltfd, m_clt_buf, m_clt_read_idx, m_clt_write_idx );
+    if( res == BUFFER_FULL )
+    {
+        LOG( LOG_DEBUG, "%s", "the client read buffer is full, let server write" );
+    }
+    return res;
+}
+
+RET_CODE conn::read_srv()
+{
+    if( m_splice )
+    {
+        RET_CODE res = splice_read( m_srvfd, m_srv_pipe, m_srv_pipe_bytes );
+        //内核不支持对该socket使用splice时，在管道为空的前提下退回到用户空间缓冲的转发方式
+        if( res != IOERR || errno != EINVAL || m_clt_pipe_bytes != 0 || m_srv_pipe_bytes != 0 )
+        {
+            return res;
+        }
+        LOG( LOG_INFO, "%s", "splice not supported, fall back to buffered relay" );
+        close_splice();
+    }
+
+    RET_CODE res = ring_read( m_srvfd, m_srv_buf, m_srv_read_idx, m_srv_write_idx );
+    if( res == BUFFER_FULL )
+    {
+        LOG( LOG_DEBUG, "%s", "the server read buffer is full, let client write" );
+    }
+    else if( res == CLOSED )
+    {
+        LOG( LOG_ERR, "%s", "the server should not close the persist connection" );
+    }
+    return res;
+}
+
+RET_CODE conn::write_srv()
+{
+    if( m_splice )
+    {
+        return splice_write( m_srvfd, m_clt_pipe, m_clt_pipe_bytes );
+    }
+    return ring_write( m_srvfd, m_clt_buf, m_clt_read_idx, m_clt_write_idx );
+}
+
+RET_CODE conn::write_clt()
+{
+    if( m_splice )
+    {
+        return splice_write( m_cltfd, m_srv_pipe, m_srv_pipe_bytes );
+    }
+    return ring_write( m_cltfd, m_srv_buf, m_srv_read_idx, m_srv_write_idx );
+}
+
+int conn::clt_pending() const
+{
+    return m_splice ? m_clt_pipe_bytes : ( int )( m_clt_read_idx - m_clt_write_idx );
+}
+
+int conn::srv_pending() const
+{
+    return m_splice ? m_srv_pipe_bytes : ( int )( m_srv_read_idx - m_srv_write_idx );
+}
+
+int conn::capacity() const
+{
+    return m_splice ? m_pipe_size : m_buf_size;
+}
+
+bool conn::parse_clt()
+{
+    unsigned int mask = m_buf_size - 1;
+    while( m_req_idx != m_clt_read_idx )
+    {
+        //环形缓冲区中的数据可能跨过末尾，分两段送入状态机
+        unsigned int pos = m_req_idx & mask;
+        unsigned int len = m_clt_read_idx - m_req_idx;
+        if( len > m_buf_size - pos )
+        {
+            len = m_buf_size - pos;
+        }
+        http_parser::HTTP_CODE ret;
+        m_req_idx += m_req.parse( m_clt_buf + pos, len, ret );
+        if( ret == http_parser::BAD_REQUEST )
+        {
+            LOG( LOG_ERR, "%s", "bad request from client" );
+            return false;
+        }
+        if( ret == http_parser::GET_REQUEST )
+        {
+            if( m_pending_reqs == MAX_PIPELINE )
+            {
+                LOG( LOG_ERR, "%s", "too many pipelined requests" );
+                return false;
+            }
+            if( m_req.is_head() )
+            {
+                m_head_mask |= 1ULL << m_pending_reqs;
+            }
+            m_clt_close = m_clt_close || !m_req.keep_alive();
+            ++m_pending_reqs;
+            m_req.init( true );
+        }
+    }
+    return true;
+}
+
+bool conn::parse_srv()
+{
+    unsigned int mask = m_buf_size - 1;
+    while( m_resp_idx != m_srv_read_idx )
+    {
+        if( m_pending_reqs == 0 )
+        {
+            LOG( LOG_ERR, "%s", "response from server without request" );
+            return false;
+        }
+        if( m_resp.idle() )
+        {
+            m_resp.init( false, m_head_mask & 1 );
+        }
+        unsigned int pos = m_resp_idx & mask;
+        unsigned int len = m_srv_read_idx - m_resp_idx;
+        if( len > m_buf_size - pos )
+        {
+            len = m_buf_size - pos;
+        }
+        http_parser::HTTP_CODE ret;
+        m_resp_idx += m_resp.parse( m_srv_buf + pos, len, ret );
+        if( ret == http_parser::BAD_REQUEST )
+        {
+            LOG( LOG_ERR, "%s", "bad response from server" );
+            return false;
+        }
+        if( ret == http_parser::GET_REQUEST )
+        {
+            m_reusable = m_reusable && m_resp.keep_alive();
+            --m_pending_reqs;
+            m_head_mask >>= 1;
+            m_resp.init( false );
+        }
+    }
+    //没有长度信息的应答一直转发到服务端关闭连接
+    if( m_resp.until_close() )
+    {
+        m_reusable = false;
+    }
+    return true;
+}
+
+bool conn::http_idle() const
+{
+    return ( m_pending_reqs == 0 ) && m_req.idle() && m_resp.idle()
+           && ( clt_pending() == 0 ) && ( srv_pending() == 0 );
+}
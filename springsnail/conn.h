@@ -3,37 +3,104 @@
 
 #include <arpa/inet.h>
 #include "fdwrapper.h"
+#include "http_parser.h"
+#include "timer_wheel.h"
+
+class session;
 
 // 这个类主要负责连接好之后对客户端和服务端的读写操作，以及返回服务端的状态
 class conn
 {
 public:
-    conn();
+    conn( int buf_size = BUF_SIZE );   //buf_size会被向上取整为2的幂
+    conn( char* buf, int buf_size );    //使用外部的缓冲区（conn_slab中紧跟在conn之后的2*buf_size字节），buf_size必须是2的幂
     ~conn();
     void init_clt( int sockfd, const sockaddr_in& client_addr );    //初始化客户端地址
     void init_srv( int sockfd, const sockaddr_in& server_addr );    //初始化服务器端地址
-    void reset();   //重置读写缓冲
+    void reset();   //重置读写下标（不清空缓冲区的内容）
+    bool init_splice(); //创建零拷贝转发用的管道，成功后读写都通过splice完成
     RET_CODE read_clt();    //从客户端读入的信息写入m_clt_buf
     RET_CODE write_clt();   //把从服务端读入m_srv_buf的内容写入客户端
     RET_CODE read_srv();    //从服务端读入的信息写入m_srv_buf
     RET_CODE write_srv();   //把从客户端读入m_clt_buf的内容写入服务端
+    int clt_pending() const;    //从客户端读入、还没有写给服务端的字节数
+    int srv_pending() const;    //从服务端读入、还没有写给客户端的字节数
+    int capacity() const;       //每个方向最多能积压的字节数（缓冲区或者管道的大小）
+    //L7模式下分析新读入的数据，统计完整的请求和应答，数据有语法错误时返回false
+    bool parse_clt();
+    bool parse_srv();
+    bool http_idle() const;     //L7模式下所有请求都得到了完整的应答，并且没有积压的数据，可以把服务端连接放回连接池
+
+private:
+    void init();    //两个构造函数共同的初始化
+    //splice模式下的读写：数据经由管道在两个socket之间移动，不进入用户空间
+    RET_CODE splice_read( int sockfd, int* pipefd, int& pipe_bytes );
+    RET_CODE splice_write( int sockfd, int* pipefd, int& pipe_bytes );
+    void close_splice();
+    //环形缓冲区的读写：数据跨过缓冲区末尾时用readv/writev一次完成
+    RET_CODE ring_read( int sockfd, char* buf, unsigned int& read_idx, unsigned int write_idx );
+    RET_CODE ring_write( int sockfd, char* buf, unsigned int read_idx, unsigned int& write_idx );
 
 public:
-    static const int BUF_SIZE = 2048;   //缓冲区大小
+    static const int BUF_SIZE = 2048;   //默认的缓冲区大小
+    static unsigned long long m_bytes_relayed;  //本进程累计转发的字节数
+    static unsigned long long m_eagain_cnt;     //本进程累计写socket时遇到EAGAIN的次数
 
+    int m_buf_size;     //环形缓冲区的大小（2的幂）
+    bool m_own_buf;     //缓冲区是否由conn自己分配和释放
+    // 环形缓冲区的下标是累计的字节数，对m_buf_size取模得到在缓冲区中的位置，二者之差是积压的字节数（无符号回绕也成立）
     char* m_clt_buf;    //客户端文件缓冲区
-    int m_clt_read_idx; //客户端读下标
-    int m_clt_write_idx;//客户端写下标
+    unsigned int m_clt_read_idx; //客户端读下标
+    unsigned int m_clt_write_idx;//客户端写下标
     sockaddr_in m_clt_address;  //客户端地址
     int m_cltfd;    //客户端fd
 
     char* m_srv_buf;    //服务端文件缓冲区
-    int m_srv_read_idx; //服务端读下标
-    int m_srv_write_idx;//服务端写下标
+    unsigned int m_srv_read_idx; //服务端读下标
+    unsigned int m_srv_write_idx;//服务端写下标
     sockaddr_in m_srv_address;  //服务端地址
     int m_srvfd;    //服务端fd
 
     bool m_srv_closed;  //标志（用来标志服务端是否关闭）
+    bool m_clt_paused;  //客户端发来的数据积压到了高水位，暂停读客户端，直到写到低水位以下
+    bool m_srv_paused;  //服务端发来的数据积压到了高水位，暂停读服务端
+    int m_clt_events;   //客户端fd当前在epoll中注册的事件，没有变化时不调用epoll_ctl
+    int m_srv_events;   //服务端fd当前在epoll中注册的事件
+
+    bool m_splice;      //是否使用splice转发（由config.xml中logical_host的<splice>决定）
+    int m_pipe_size;    //管道的容量
+    int m_clt_pipe[2];  //客户端到服务端方向的管道
+    int m_clt_pipe_bytes;   //m_clt_pipe中尚未写入服务端的字节数
+    int m_srv_pipe[2];  //服务端到客户端方向的管道
+    int m_srv_pipe_bytes;   //m_srv_pipe中尚未写入客户端的字节数
+
+    long long m_retry_at;   //连接失败后下一次重试的时刻（毫秒）
+    int m_backoff;          //当前的重试退避时间（毫秒），每失败一次翻倍
+    bool m_connecting;      //服务端连接是否正在进行中
+    int m_backend;          //服务端连接所属的逻辑主机在mgr中的序号
+    long long m_idle_since; //放回连接池的时刻（毫秒），用于关闭空闲超时的连接
+    //正在连接时是连接超时的定时器，L4模式下分配给客户后是客户空闲超时和最长存活时间的定时器。
+    //转发数据时只更新m_last_active，定时器到期时才检查是否真的超时，没有超时就按新的时刻重新加入时间轮
+    tw_timer m_timer;
+    long long m_bound_at;   //分配给客户（L7模式下是借给客户）的时刻（微秒）
+    long long m_connect_start;  //发起非阻塞连接的时刻（微秒）
+    long long m_req_at;     //客户发来数据、还没有等到服务端发来数据的时刻（微秒），0表示没有，用于统计首字节时间
+    long long m_last_active;    //最后一次转发数据的时刻（毫秒），取自事件循环每轮缓存的时间
+
+    //以下用于L7模式，一个服务端连接在一个客户的一个（或者流水线上连续的几个）请求期间被借用
+    static const int MAX_PIPELINE = 64; //一个客户最多有多少个请求在等待应答
+    session* m_session;     //借用这个服务端连接的客户
+    http_parser m_req;      //分析客户端发来的请求
+    http_parser m_resp;     //分析服务端发来的应答
+    unsigned int m_req_idx; //m_clt_buf中已经分析到的位置
+    unsigned int m_resp_idx;//m_srv_buf中已经分析到的位置
+    int m_pending_reqs;     //已经完整读到、还没有得到完整应答的请求数
+    unsigned long long m_head_mask; //第i位表示第i个等待应答的请求是HEAD请求
+    bool m_reusable;        //服务端在应答之后保持连接，可以放回连接池
+    bool m_clt_close;       //客户要求在应答之后关闭连接
+
+    conn* m_prev;   //mgr中conn_list链表的前后指针
+    conn* m_next;
 };
 
 #endif
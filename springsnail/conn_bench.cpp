@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "conn.h"
+#include "log.h"
+
+// 连接周转的微基准：比较释放连接时清零缓冲区（原来的conn::reset）和只重置下标（现在的conn::reset）的耗时
+// 编译：make conn_bench
+
+static const int POOL = 1024;           //轮流使用的连接数，使缓冲区总大小超过CPU缓存
+static const int RESETS = 200000;       //只测量reset时的次数
+static const int CHURNS = 100000;       //模拟短连接（转发一个小请求后释放）的次数
+static const int REQUEST_SIZE = 200;    //模拟请求的大小
+
+static long long get_cur_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( long long )ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 原来的reset：重置下标之后把两个缓冲区都清零
+static void old_reset( conn* connection )
+{
+    connection->reset();
+    memset( connection->m_clt_buf, '\0', connection->m_buf_size );
+    memset( connection->m_srv_buf, '\0', connection->m_buf_size );
+}
+
+static double bench_reset( conn** conns, bool clear )
+{
+    long long start = get_cur_ns();
+    for( int i = 0; i < RESETS; ++i )
+    {
+        conn* connection = conns[ i % POOL ];
+        clear ? old_reset( connection ) : connection->reset();
+    }
+    return ( double )( get_cur_ns() - start ) / RESETS;
+}
+
+// 每次取一个连接，客户端发来一个小请求，转发给服务端后释放连接。socket用两对socketpair代替，不计入建立连接的开销
+static double bench_churn( conn** conns, bool clear )
+{
+    int clt[2];
+    int srv[2];
+    socketpair( PF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, clt );
+    socketpair( PF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, srv );
+    char request[ REQUEST_SIZE ];
+    char response[ REQUEST_SIZE ];
+    memset( request, 'a', sizeof( request ) );
+
+    long long start = get_cur_ns();
+    for( int i = 0; i < CHURNS; ++i )
+    {
+        conn* connection = conns[ i % POOL ];
+        connection->m_cltfd = clt[0];
+        connection->m_srvfd = srv[0];
+        send( clt[1], request, sizeof( request ), 0 );
+        connection->read_clt();
+        connection->write_srv();
+        recv( srv[1], response, sizeof( response ), 0 );
+        clear ? old_reset( connection ) : connection->reset();
+    }
+    double ns = ( double )( get_cur_ns() - start ) / CHURNS;
+
+    close( clt[0] );
+    close( clt[1] );
+    close( srv[0] );
+    close( srv[1] );
+    return ns;
+}
+
+int main()
+{
+    set_loglevel( LOG_ERR );
+    int sizes[] = { 2048, 16384, 65536 };
+    printf( "%d conns, %d byte requests\n", POOL, REQUEST_SIZE );
+    for( int s = 0; s < ( int )( sizeof( sizes ) / sizeof( sizes[0] ) ); ++s )
+    {
+        conn** conns = new conn*[ POOL ];
+        for( int i = 0; i < POOL; ++i )
+        {
+            conns[i] = new conn( sizes[s] );
+        }
+        double old_ns = bench_reset( conns, true );
+        double new_ns = bench_reset( conns, false );
+        double old_churn = bench_churn( conns, true );
+        double new_churn = bench_churn( conns, false );
+        printf( "buffer %6d   reset: memset %8.1f ns  indices only %6.1f ns   churn: memset %8.1f ns  indices only %8.1f ns\n",
+                sizes[s], old_ns, new_ns, old_churn, new_churn );
+        for( int i = 0; i < POOL; ++i )
+        {
+            delete conns[i];
+        }
+        delete [] conns;
+    }
+    return 0;
+}
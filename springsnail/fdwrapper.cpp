@@ -4,6 +4,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <string.h>
 
 int setnonblocking( int fd )
 {
@@ -16,6 +18,7 @@ int setnonblocking( int fd )
 void add_read_fd( int epollfd, int fd )
 {
     epoll_event event;
+    event.data.u64 = 0;
     event.data.fd = fd;
     event.events = EPOLLIN | EPOLLET;
     epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &event );
@@ -25,6 +28,7 @@ void add_read_fd( int epollfd, int fd )
 void add_write_fd( int epollfd, int fd )
 {
     epoll_event event;
+    event.data.u64 = 0;
     event.data.fd = fd;
     event.events = EPOLLOUT | EPOLLET;
     epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &event );
@@ -45,9 +49,95 @@ void removefd( int epollfd, int fd )
 void modfd( int epollfd, int fd, int ev )
 {
     epoll_event event;
+    event.data.u64 = 0;
     event.data.fd = fd;
     event.events = ev | EPOLLET;
     epoll_ctl( epollfd, EPOLL_CTL_MOD, fd, &event );
 }
 
+void add_read_ptr( int epollfd, int fd, void* tagged )
+{
+    epoll_event event;
+    event.data.ptr = tagged;
+    event.events = EPOLLIN | EPOLLET;
+    epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &event );
+    setnonblocking( fd );
+}
+
+void add_write_ptr( int epollfd, int fd, void* tagged )
+{
+    epoll_event event;
+    event.data.ptr = tagged;
+    event.events = EPOLLOUT | EPOLLET;
+    epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &event );
+    setnonblocking( fd );
+}
+
+void modptr( int epollfd, int fd, void* tagged, int ev )
+{
+    epoll_event event;
+    event.data.ptr = tagged;
+    event.events = ev | EPOLLET;
+    epoll_ctl( epollfd, EPOLL_CTL_MOD, fd, &event );
+}
+
+int send_fd( int fd, int fd_to_send )
+{
+    int data = 1;
+    struct iovec iov[1];
+    iov[0].iov_base = &data;
+    iov[0].iov_len = sizeof( data );
+
+    union
+    {
+        struct cmsghdr cm;
+        char control[ CMSG_SPACE( sizeof( int ) ) ];
+    } control_un;
+    memset( &control_un, 0, sizeof( control_un ) );
+
+    struct msghdr msg;
+    memset( &msg, 0, sizeof( msg ) );
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control_un.control;
+    msg.msg_controllen = sizeof( control_un.control );
+
+    struct cmsghdr* cmptr = CMSG_FIRSTHDR( &msg );
+    cmptr->cmsg_len = CMSG_LEN( sizeof( int ) );
+    cmptr->cmsg_level = SOL_SOCKET;
+    cmptr->cmsg_type = SCM_RIGHTS;
+    memcpy( CMSG_DATA( cmptr ), &fd_to_send, sizeof( int ) );
+    return sendmsg( fd, &msg, 0 );
+}
+
+int recv_fd( int fd, int* fd_to_read )
+{
+    int data;
+    struct iovec iov[1];
+    iov[0].iov_base = &data;
+    iov[0].iov_len = sizeof( data );
+
+    union
+    {
+        struct cmsghdr cm;
+        char control[ CMSG_SPACE( sizeof( int ) ) ];
+    } control_un;
+
+    struct msghdr msg;
+    memset( &msg, 0, sizeof( msg ) );
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control_un.control;
+    msg.msg_controllen = sizeof( control_un.control );
+
+    *fd_to_read = -1;
+    int ret = recvmsg( fd, &msg, 0 );
+    struct cmsghdr* cmptr = CMSG_FIRSTHDR( &msg );
+    if( ( ret > 0 ) && cmptr && ( cmptr->cmsg_level == SOL_SOCKET ) && ( cmptr->cmsg_type == SCM_RIGHTS ) )
+    {
+        memcpy( fd_to_read, CMSG_DATA( cmptr ), sizeof( int ) );
+    }
+    return ret;
+}
+
 #endif
@@ -10,4 +10,20 @@ void removefd( int epollfd, int fd );
 void closefd( int epollfd, int fd );
 void modfd( int epollfd, int fd, int ev );
 
+// 以下几个函数把带标记的指针（而不是fd）注册到epoll_event.data.ptr中，事件到来时无需再通过fd查找对象。
+// 被注册的对象至少按4字节对齐，因此用指针的最低两位标记这个fd是连接的哪一端，或者是健康检查的socket，
+// 或者是L7模式下的客户端（客户端和服务端连接的对应关系在每个请求之后都可能改变，因此注册的是客户会话）
+enum CONN_SIDE { CLT_SIDE = 0, SRV_SIDE = 1, CHECK_SIDE = 2, SESSION_SIDE = 3 };
+inline void* tag_ptr( void* ptr, int side ) { return ( void* )( ( unsigned long )ptr | side ); }
+inline void* untag_ptr( void* tagged ) { return ( void* )( ( unsigned long )tagged & ~3UL ); }
+inline int ptr_side( void* tagged ) { return ( int )( ( unsigned long )tagged & 3UL ); }
+void add_read_ptr( int epollfd, int fd, void* tagged );
+void add_write_ptr( int epollfd, int fd, void* tagged );
+void modptr( int epollfd, int fd, void* tagged, int ev );
+
+// 通过UNIX域socket传递文件描述符（参见chapter13的passfd），附带4字节的消息
+int send_fd( int fd, int fd_to_send );
+// 接收消息，消息中带有文件描述符时存入*fd_to_read，否则*fd_to_read为-1；返回值同recvmsg
+int recv_fd( int fd, int* fd_to_read );
+
 #endif
@@ -0,0 +1,289 @@
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include "http_parser.h"
+
+void http_parser::init( bool request, bool head )
+{
+    m_request = request;
+    m_head = head;
+    m_state = CHECK_STATE_REQUESTLINE;
+    m_line_len = 0;
+    m_cr = false;
+    m_remain = -1;
+    m_chunked = false;
+    m_keep_alive = true;
+    m_is_head = false;
+    m_status = 0;
+}
+
+/*从状态机，从data[checked]开始读取一行，行的内容（不含"\r\n"）追加到m_line中*/
+http_parser::LINE_STATUS http_parser::parse_line( const char* data, int len, int& checked )
+{
+    for( ; checked < len; ++checked )
+    {
+        char temp = data[ checked ];
+        /*上一个字节是“\r”，这个字节必须是“\n”，否则说明客户发送的HTTP请求存在语法问题*/
+        if( m_cr )
+        {
+            if( temp != '\n' )
+            {
+                return LINE_BAD;
+            }
+            ++checked;
+            m_cr = false;
+            m_line[ ( m_line_len < LINE_SIZE - 1 ) ? m_line_len : LINE_SIZE - 1 ] = '\0';
+            return LINE_OK;
+        }
+        if( temp == '\r' )
+        {
+            m_cr = true;
+            continue;
+        }
+        /*单独的“\n”同样是语法错误*/
+        if( temp == '\n' )
+        {
+            return LINE_BAD;
+        }
+        if( m_line_len < LINE_SIZE - 1 )
+        {
+            m_line[ m_line_len ] = temp;
+        }
+        m_tail[ m_line_len % TAIL_SIZE ] = temp;
+        ++m_line_len;
+    }
+    /*所有内容都分析完毕也没有读到完整的行，还需要继续读取数据*/
+    return LINE_OPEN;
+}
+
+/*分析请求行，只关心方法（是否为HEAD）和版本号（决定默认是否保持连接）*/
+http_parser::HTTP_CODE http_parser::parse_requestline( char* text )
+{
+    char* url = strpbrk( text, " \t" );
+    /*如果请求行中没有空白字符或“\t”字符，则HTTP请求必有问题*/
+    if( !url || m_line_len < TAIL_SIZE )
+    {
+        return BAD_REQUEST;
+    }
+    *url = '\0';
+    m_is_head = ( strcasecmp( text, "HEAD" ) == 0 );
+
+    /*版本号在行的末尾，URL很长时m_line中没有它，因此从m_tail中取出最后TAIL_SIZE个字节*/
+    char version[ TAIL_SIZE + 1 ];
+    for( int i = 0; i < TAIL_SIZE; ++i )
+    {
+        version[i] = m_tail[ ( m_line_len - TAIL_SIZE + i ) % TAIL_SIZE ];
+    }
+    version[ TAIL_SIZE ] = '\0';
+    if( strncasecmp( version, "HTTP/1.", 7 ) != 0 )
+    {
+        return BAD_REQUEST;
+    }
+    m_keep_alive = ( version[7] != '0' );
+    /*请求行处理完毕，状态转移到头部字段的分析*/
+    m_state = CHECK_STATE_HEADER;
+    return NO_REQUEST;
+}
+
+/*分析状态行，形如“HTTP/1.1 200 OK”*/
+http_parser::HTTP_CODE http_parser::parse_statusline( char* text )
+{
+    if( m_line_len < 12 || strncasecmp( text, "HTTP/1.", 7 ) != 0 || text[8] != ' ' )
+    {
+        return BAD_REQUEST;
+    }
+    m_keep_alive = ( text[7] != '0' );
+    m_status = atoi( text + 9 );
+    if( m_status < 100 || m_status > 999 )
+    {
+        return BAD_REQUEST;
+    }
+    m_state = CHECK_STATE_HEADER;
+    return NO_REQUEST;
+}
+
+/*分析头部字段，只处理和消息边界以及连接保持有关的几个*/
+http_parser::HTTP_CODE http_parser::parse_headers( char* text )
+{
+    if( strncasecmp( text, "Content-Length:", 15 ) == 0 )
+    {
+        text += 15;
+        text += strspn( text, " \t" );
+        char* end = NULL;
+        m_remain = strtoll( text, &end, 10 );
+        if( end == text || m_remain < 0 )
+        {
+            return BAD_REQUEST;
+        }
+    }
+    else if( strncasecmp( text, "Transfer-Encoding:", 18 ) == 0 )
+    {
+        m_chunked = ( strcasestr( text + 18, "chunked" ) != NULL );
+    }
+    else if( strncasecmp( text, "Connection:", 11 ) == 0 )
+    {
+        if( strcasestr( text + 11, "close" ) )
+        {
+            m_keep_alive = false;
+        }
+        else if( strcasestr( text + 11, "keep-alive" ) )
+        {
+            m_keep_alive = true;
+        }
+    }
+    return NO_REQUEST;
+}
+
+/*遇到了头部之后的空行，决定消息体的长度*/
+http_parser::HTTP_CODE http_parser::end_headers()
+{
+    if( !m_request )
+    {
+        //1xx是临时应答，之后还有真正的应答；101之后连接不再是HTTP，只能一直转发到关闭
+        if( m_status == 101 )
+        {
+            m_keep_alive = false;
+            m_state = CHECK_STATE_UNTIL_CLOSE;
+            return NO_REQUEST;
+        }
+        if( m_status < 200 )
+        {
+            bool keep_alive = m_keep_alive;
+            init( false, m_head );
+            m_keep_alive = keep_alive;
+            return NO_REQUEST;
+        }
+        if( m_head || m_status == 204 || m_status == 304 )
+        {
+            return GET_REQUEST;
+        }
+    }
+    if( m_chunked )
+    {
+        m_state = CHECK_STATE_CHUNK_SIZE;
+        return NO_REQUEST;
+    }
+    if( m_remain > 0 )
+    {
+        m_state = CHECK_STATE_CONTENT;
+        return NO_REQUEST;
+    }
+    if( m_remain == 0 || m_request )
+    {
+        return GET_REQUEST;
+    }
+    //既没有Content-Length也不是chunked的应答，以服务端关闭连接作为结束
+    m_keep_alive = false;
+    m_state = CHECK_STATE_UNTIL_CLOSE;
+    return NO_REQUEST;
+}
+
+http_parser::HTTP_CODE http_parser::process_line()
+{
+    char* text = m_line;
+    switch( m_state )
+    {
+        case CHECK_STATE_REQUESTLINE:
+        {
+            //消息之间可以有多余的空行
+            if( m_line_len == 0 )
+            {
+                return NO_REQUEST;
+            }
+            return m_request ? parse_requestline( text ) : parse_statusline( text );
+        }
+        case CHECK_STATE_HEADER:
+        {
+            /*遇到一个空行，说明头部结束了*/
+            if( m_line_len == 0 )
+            {
+                return end_headers();
+            }
+            return parse_headers( text );
+        }
+        case CHECK_STATE_CHUNK_SIZE:
+        {
+            //chunk的长度是十六进制数，后面可能跟着以';'开头的扩展
+            char* end = NULL;
+            m_remain = strtoll( text, &end, 16 );
+            if( end == text || m_remain < 0 )
+            {
+                return BAD_REQUEST;
+            }
+            m_state = ( m_remain == 0 ) ? CHECK_STATE_TRAILER : CHECK_STATE_CHUNK_DATA;
+            return NO_REQUEST;
+        }
+        case CHECK_STATE_CHUNK_END:
+        {
+            //chunk的数据之后必须紧跟着"\r\n"
+            if( m_line_len != 0 )
+            {
+                return BAD_REQUEST;
+            }
+            m_state = CHECK_STATE_CHUNK_SIZE;
+            return NO_REQUEST;
+        }
+        case CHECK_STATE_TRAILER:
+        {
+            return ( m_line_len == 0 ) ? GET_REQUEST : NO_REQUEST;
+        }
+        default:
+        {
+            return BAD_REQUEST;
+        }
+    }
+}
+
+int http_parser::parse( const char* data, int len, HTTP_CODE& ret )
+{
+    int checked = 0;
+    ret = NO_REQUEST;
+    while( checked < len )
+    {
+        if( m_state == CHECK_STATE_UNTIL_CLOSE )
+        {
+            return len;
+        }
+        //消息体不需要分析，直接跳过
+        if( m_state == CHECK_STATE_CONTENT || m_state == CHECK_STATE_CHUNK_DATA )
+        {
+            long long n = len - checked;
+            if( n > m_remain )
+            {
+                n = m_remain;
+            }
+            checked += n;
+            m_remain -= n;
+            if( m_remain > 0 )
+            {
+                continue;
+            }
+            if( m_state == CHECK_STATE_CONTENT )
+            {
+                ret = GET_REQUEST;
+                return checked;
+            }
+            m_state = CHECK_STATE_CHUNK_END;
+            continue;
+        }
+
+        LINE_STATUS linestatus = parse_line( data, len, checked );
+        if( linestatus == LINE_OPEN )
+        {
+            break;
+        }
+        if( linestatus == LINE_BAD )
+        {
+            ret = BAD_REQUEST;
+            return checked;
+        }
+        HTTP_CODE retcode = process_line();
+        m_line_len = 0;
+        if( retcode != NO_REQUEST )
+        {
+            ret = retcode;
+            return checked;
+        }
+    }
+    return checked;
+}
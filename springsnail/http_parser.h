@@ -0,0 +1,66 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+// L7模式下用来划分HTTP/1.x消息边界的状态机，沿用chapter8中8.6_1_finite_state_machine.cpp的思路：
+// 从状态机（parse_line）取出完整的行，主状态机依次分析请求行（或状态行）和头部字段。
+// 与那里不同的是，数据在分析之后还要原样转发，因此不在缓冲区中写入'\0'，而是把当前行的开头复制到m_line中
+// （过长的行只保留开头和最后几个字节，足够分析方法、版本号和我们关心的头部字段）；
+// 数据可以分多次、从环形缓冲区的任意位置送入，并且还要跳过消息体（Content-Length或者chunked）
+class http_parser
+{
+public:
+    /*主状态机的状态：分析请求行（或状态行）、头部字段、消息体，以及chunked编码的各个部分*/
+    enum CHECK_STATE
+    {
+        CHECK_STATE_REQUESTLINE = 0,
+        CHECK_STATE_HEADER,
+        CHECK_STATE_CONTENT,
+        CHECK_STATE_CHUNK_SIZE,
+        CHECK_STATE_CHUNK_DATA,
+        CHECK_STATE_CHUNK_END,
+        CHECK_STATE_TRAILER,
+        CHECK_STATE_UNTIL_CLOSE     //应答没有长度信息，直到服务端关闭连接才结束
+    };
+    /*从状态机的状态：读取到一个完整的行、行出错和行数据尚且不完整*/
+    enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+    /*分析的结果：消息不完整、得到了一个完整的消息、消息有语法错误*/
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST };
+
+public:
+    // request为true时分析请求，否则分析应答；head表示这个应答对应的是HEAD请求（没有消息体）
+    void init( bool request, bool head = false );
+    // 分析data中的len个字节，返回消耗的字节数。得到一个完整的消息时停在消息末尾并把ret置为GET_REQUEST，
+    // 之后需要调用init开始下一个消息
+    int parse( const char* data, int len, HTTP_CODE& ret );
+    bool idle() const { return m_state == CHECK_STATE_REQUESTLINE && m_line_len == 0 && !m_cr; }  //还没有收到当前消息的任何数据
+    bool until_close() const { return m_state == CHECK_STATE_UNTIL_CLOSE; }
+    bool is_head() const { return m_is_head; }  //请求的方法是HEAD
+    bool keep_alive() const { return m_keep_alive; }    //消息结束后连接是否保持
+
+private:
+    LINE_STATUS parse_line( const char* data, int len, int& checked );
+    HTTP_CODE process_line();   //主状态机：按当前状态分析m_line中刚读完的一行
+    HTTP_CODE parse_requestline( char* text );
+    HTTP_CODE parse_statusline( char* text );
+    HTTP_CODE parse_headers( char* text );
+    HTTP_CODE end_headers();    //头部结束，根据消息的类型和头部字段决定如何跳过消息体
+
+private:
+    static const int LINE_SIZE = 256;   //每行保留的开头的最大长度
+    static const int TAIL_SIZE = 8;     //每行保留的末尾的长度，恰好是"HTTP/1.1"的长度
+
+    bool m_request;     //分析的是请求还是应答
+    bool m_head;        //应答对应的请求是HEAD请求
+    CHECK_STATE m_state;
+    char m_line[ LINE_SIZE ];   //当前正在读取的行的开头
+    char m_tail[ TAIL_SIZE ];   //当前行最后TAIL_SIZE个字节，按行内偏移对TAIL_SIZE取模存放
+    int m_line_len;     //当前行已经读取的长度（不含"\r\n"）
+    bool m_cr;          //当前行已经读到了'\r'，下一个字节必须是'\n'
+    long long m_remain;     //消息体或者当前chunk中还没有跳过的字节数，-1表示没有Content-Length
+    bool m_chunked;         //Transfer-Encoding: chunked
+    bool m_keep_alive;
+    bool m_is_head;
+    int m_status;           //应答的状态码
+};
+
+#endif
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <arpa/inet.h>
+#include "lb_policy.h"
+
+// 负载均衡策略的微基准：比较各策略在16个子进程下每次决策的耗时，以及模拟连接到达和离开时的均衡程度
+// 编译：make lb_bench
+
+static const int CHILDREN = 16;
+static const int DECISIONS = 2000000;   //测量决策耗时的次数
+static const int ARRIVALS = 200000;     //模拟的连接数
+static const int POOL_SIZE = 64;        //每个子进程的服务端连接数
+static const int CLIENTS = 5000;        //模拟的客户端IP数量
+
+static volatile int sink;   //防止决策结果被编译器优化掉
+
+static long long get_cur_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( long long )ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench( const char* name, const vector< int >& weights )
+{
+    child_stats stats[ CHILDREN ];
+    bool alive[ CHILDREN ];
+    sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    srand( 1 );
+
+    //决策耗时：负载信息固定为随机值，只测量select本身
+    lb_policy* policy = lb_policy::create( name, weights );
+    for( int i = 0; i < CHILDREN; ++i )
+    {
+        memset( &stats[i], 0, sizeof( child_stats ) );
+        stats[i].m_active_conns = rand() % POOL_SIZE;
+        stats[i].m_pool_depth = POOL_SIZE - stats[i].m_active_conns;
+        alive[i] = true;
+    }
+    long long start = get_cur_ns();
+    for( int i = 0; i < DECISIONS; ++i )
+    {
+        addr.sin_addr.s_addr = i * 2654435761U;
+        sink = policy->select( stats, alive, CHILDREN, &addr );
+    }
+    double ns = ( double )( get_cur_ns() - start ) / DECISIONS;
+    delete policy;
+
+    //均衡程度：每个连接到达时按当前负载选择子进程，活动连接超过一定数量后随机结束一个
+    policy = lb_policy::create( name, weights );
+    memset( stats, 0, sizeof( stats ) );
+    int assigned[ CHILDREN ];
+    memset( assigned, 0, sizeof( assigned ) );
+    for( int i = 0; i < CHILDREN; ++i )
+    {
+        stats[i].m_pool_depth = POOL_SIZE;
+    }
+    int active = 0;
+    double max_skew = 0;
+    for( int i = 0; i < ARRIVALS; ++i )
+    {
+        addr.sin_addr.s_addr = htonl( 0x0a000000 + rand() % CLIENTS );
+        int idx = policy->select( stats, alive, CHILDREN, &addr );
+        ++assigned[idx];
+        ++stats[idx].m_active_conns;
+        --stats[idx].m_pool_depth;
+        ++active;
+        if( active > CHILDREN * POOL_SIZE / 2 )
+        {
+            //随机结束一个活动连接，每个子进程被选中的概率与它的活动连接数成正比
+            int victim = 0;
+            for( int r = rand() % active; r >= stats[victim].m_active_conns; ++victim )
+            {
+                r -= stats[victim].m_active_conns;
+            }
+            --stats[victim].m_active_conns;
+            ++stats[victim].m_pool_depth;
+            --active;
+        }
+        if( active < CHILDREN * POOL_SIZE / 2 )
+        {
+            continue;   //达到稳定的活动连接数之后才统计
+        }
+        int most = 0;
+        for( int j = 0; j < CHILDREN; ++j )
+        {
+            most = ( stats[j].m_active_conns > most ) ? stats[j].m_active_conns : most;
+        }
+        double skew = ( double )most * CHILDREN / active;
+        max_skew = ( skew > max_skew ) ? skew : max_skew;
+    }
+    delete policy;
+
+    double mean = ( double )ARRIVALS / CHILDREN;
+    double var = 0;
+    int lo = assigned[0], hi = assigned[0];
+    for( int i = 0; i < CHILDREN; ++i )
+    {
+        var += ( assigned[i] - mean ) * ( assigned[i] - mean );
+        lo = ( assigned[i] < lo ) ? assigned[i] : lo;
+        hi = ( assigned[i] > hi ) ? assigned[i] : hi;
+    }
+    printf( "%-12s %8.1f ns/decision   assigned min %6d max %6d cv %5.3f   peak active max/mean %5.2f\n",
+            name, ns, lo, hi, sqrt( var / CHILDREN ) / mean, max_skew );
+}
+
+int main()
+{
+    vector< int > even( CHILDREN, 1 );
+    vector< int > skewed( CHILDREN, 1 );
+    for( int i = 0; i < CHILDREN / 4; ++i )
+    {
+        skewed[i] = 4;
+    }
+
+    printf( "%d children, equal weights\n", CHILDREN );
+    bench( "least_conn", even );
+    bench( "p2c", even );
+    bench( "wrr", even );
+    bench( "chash", even );
+    printf( "%d children, weights 4:1 for the first quarter (least_conn and p2c ignore weights)\n", CHILDREN );
+    bench( "wrr", skewed );
+    bench( "chash", skewed );
+    return 0;
+}
@@ -0,0 +1,153 @@
+#include <string.h>
+#include <algorithm>
+#include "lb_policy.h"
+
+// a的负载是否比b轻：有空闲服务端连接的优先，其次比较活动连接数，最后比较空闲服务端连接数
+static bool less_loaded( const child_stats& a, const child_stats& b )
+{
+    bool a_free = a.m_pool_depth > 0;
+    bool b_free = b.m_pool_depth > 0;
+    if( a_free != b_free )
+    {
+        return a_free;
+    }
+    if( a.m_active_conns != b.m_active_conns )
+    {
+        return a.m_active_conns < b.m_active_conns;
+    }
+    return a.m_pool_depth > b.m_pool_depth;
+}
+
+lb_policy* lb_policy::create( const char* name, const vector< int >& weights )
+{
+    if( strcmp( name, "least_conn" ) == 0 )
+    {
+        return new least_conn_policy;
+    }
+    else if( strcmp( name, "p2c" ) == 0 )
+    {
+        return new p2c_policy;
+    }
+    else if( strcmp( name, "wrr" ) == 0 )
+    {
+        return new wrr_policy( weights );
+    }
+    else if( strcmp( name, "chash" ) == 0 )
+    {
+        return new chash_policy( weights );
+    }
+    return NULL;
+}
+
+int least_conn_policy::select( const child_stats* stats, const bool* alive, int n, const sockaddr_in* client_addr __attribute__( ( unused ) ) )
+{
+    int idx = -1;
+    for( int i = 0; i < n; ++i )
+    {
+        if( alive[i] && ( ( idx == -1 ) || less_loaded( stats[i], stats[idx] ) ) )
+        {
+            idx = i;
+        }
+    }
+    return idx;
+}
+
+unsigned int p2c_policy::next_rand()
+{
+    m_seed ^= m_seed << 13;
+    m_seed ^= m_seed >> 17;
+    m_seed ^= m_seed << 5;
+    return m_seed;
+}
+
+int p2c_policy::select( const child_stats* stats, const bool* alive, int n, const sockaddr_in* client_addr )
+{
+    //两个候选都已退出时多试几次，再不行就退化为扫描
+    for( int retry = 0; retry < 4; ++retry )
+    {
+        int a = next_rand() % n;
+        int b = next_rand() % n;
+        if( a == b )
+        {
+            b = ( b + 1 ) % n;
+        }
+        if( alive[a] && alive[b] )
+        {
+            return less_loaded( stats[b], stats[a] ) ? b : a;
+        }
+        if( alive[a] || alive[b] )
+        {
+            return alive[a] ? a : b;
+        }
+    }
+    least_conn_policy fallback;
+    return fallback.select( stats, alive, n, client_addr );
+}
+
+wrr_policy::wrr_policy( const vector< int >& weights ) : m_weights( weights ), m_current( weights.size(), 0 )
+{
+    for( size_t i = 0; i < m_weights.size(); ++i )
+    {
+        if( m_weights[i] <= 0 )
+        {
+            m_weights[i] = 1;
+        }
+    }
+}
+
+int wrr_policy::select( const child_stats* stats __attribute__( ( unused ) ), const bool* alive, int n, const sockaddr_in* client_addr __attribute__( ( unused ) ) )
+{
+    int idx = -1;
+    int total = 0;
+    for( int i = 0; ( i < n ) && ( i < ( int )m_weights.size() ); ++i )
+    {
+        if( !alive[i] )
+        {
+            continue;
+        }
+        m_current[i] += m_weights[i];
+        total += m_weights[i];
+        if( ( idx == -1 ) || ( m_current[i] > m_current[idx] ) )
+        {
+            idx = i;
+        }
+    }
+    if( idx != -1 )
+    {
+        m_current[idx] -= total;
+    }
+    return idx;
+}
+
+chash_policy::chash_policy( const vector< int >& weights )
+{
+    for( size_t i = 0; i < weights.size(); ++i )
+    {
+        int nodes = VIRTUAL_NODES * ( ( weights[i] > 0 ) ? weights[i] : 1 );
+        for( int v = 0; v < nodes; ++v )
+        {
+            m_ring.push_back( pair< unsigned int, int >( hash32( ( i << 16 ) ^ v ^ 0x9e3779b9 ), i ) );
+        }
+    }
+    std::sort( m_ring.begin(), m_ring.end() );
+}
+
+int chash_policy::select( const child_stats* stats __attribute__( ( unused ) ), const bool* alive, int n, const sockaddr_in* client_addr )
+{
+    if( m_ring.empty() )
+    {
+        return -1;
+    }
+    unsigned int key = client_addr ? hash32( client_addr->sin_addr.s_addr ) : 0;
+    //找到环上第一个不小于key的节点，沿顺时针方向跳过已退出的子进程
+    size_t pos = std::lower_bound( m_ring.begin(), m_ring.end(), pair< unsigned int, int >( key, -1 ) ) - m_ring.begin();
+    for( size_t i = 0; i < m_ring.size(); ++i )
+    {
+        int idx = m_ring[ ( pos + i ) % m_ring.size() ].second;
+        if( ( idx < n ) && alive[idx] )
+        {
+            return idx;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,84 @@
+#ifndef LB_POLICY_H
+#define LB_POLICY_H
+
+#include <vector>
+#include <utility>
+#include <arpa/inet.h>
+#include "stats.h"
+
+using std::vector;
+using std::pair;
+
+// 32位整数的混合函数（murmur3的finalizer），用于一致性哈希
+inline unsigned int hash32( unsigned int h )
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+// 父进程把新连接分给哪个子进程的负载均衡策略，由config.xml中的"Policy name"一行选择
+class lb_policy
+{
+public:
+    virtual ~lb_policy(){}
+    // 从n个子进程中选出一个，alive[i]为false的子进程不会被选中；没有可选的子进程时返回-1
+    // client_addr只有在need_client_addr()返回true时才有效
+    virtual int select( const child_stats* stats, const bool* alive, int n, const sockaddr_in* client_addr ) = 0;
+    // 是否需要客户端地址。需要时父进程自己accept，再通过SCM_RIGHTS把连接交给选中的子进程
+    virtual bool need_client_addr() const { return false; }
+    // 根据名字创建策略（least_conn、p2c、wrr、chash），weights是每个子进程的权重，名字无效时返回NULL。
+    // 子进程是对等的，main给所有子进程相同的权重，所以父进程中的wrr就是简单轮询；逻辑主机的<weight>只在子进程内部使用
+    static lb_policy* create( const char* name, const vector< int >& weights );
+};
+
+// 最少连接：优先选还有空闲服务端连接的子进程中活动连接最少的，需要扫描所有子进程
+class least_conn_policy : public lb_policy
+{
+public:
+    int select( const child_stats* stats, const bool* alive, int n, const sockaddr_in* client_addr );
+};
+
+// 两次随机选择（power of two choices）：随机取两个子进程，选负载较轻的那个，决策代价与子进程数无关
+class p2c_policy : public lb_policy
+{
+public:
+    p2c_policy() : m_seed( 2463534242U ){}
+    int select( const child_stats* stats, const bool* alive, int n, const sockaddr_in* client_addr );
+
+private:
+    unsigned int next_rand();
+    unsigned int m_seed;    //xorshift随机数状态
+};
+
+// 平滑加权轮询（与nginx相同）：每次给所有子进程的当前值加上各自的权重，选当前值最大的，再减去总权重
+class wrr_policy : public lb_policy
+{
+public:
+    wrr_policy( const vector< int >& weights );
+    int select( const child_stats* stats, const bool* alive, int n, const sockaddr_in* client_addr );
+
+private:
+    vector< int > m_weights;
+    vector< int > m_current;
+};
+
+// 一致性哈希：按客户端IP在哈希环上查找，同一客户端总是落到同一个子进程上，
+// 某个子进程退出时只有原本属于它的客户端会被重新分配。
+// 子进程在逻辑主机之间也按客户端IP哈希（见mgr::set_sticky），两者合起来才是会话保持
+class chash_policy : public lb_policy
+{
+public:
+    chash_policy( const vector< int >& weights );
+    int select( const child_stats* stats, const bool* alive, int n, const sockaddr_in* client_addr );
+    bool need_client_addr() const { return true; }
+
+private:
+    static const int VIRTUAL_NODES = 160;   //每个权重单位在环上的虚拟节点数
+    vector< pair< unsigned int, int > > m_ring; //按哈希值排序的(哈希值, 子进程序号)
+};
+
+#endif
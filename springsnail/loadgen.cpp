@@ -0,0 +1,406 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string>
+#include "stats.h"
+
+using std::string;
+
+// 多线程的负载生成器：每个线程用一个epoll驱动自己的一组长连接，每个连接上同时只有一个请求，
+// 收到完整的应答后才发下一个。-r为0时是闭环测试（尽快发送）；否则是开环测试，每个连接按固定的间隔发送，
+// 延迟从计划发送的时刻算起，发送被耽搁的时间也计入延迟（避免coordinated omission低估尾延迟）。
+// 延迟记录在与统计页面相同的latency_hist中
+// 编译：make loadgen
+// 用法：loadgen -p port [-a ip] [-c conns] [-t threads] [-d seconds] [-w warmup] [-r rate] [-m echo|http] [-s req_size] [-z resp_size]
+
+static const int MAX_THREADS = 64;
+static const int MAX_EVENTS = 1024;
+static const int READ_SIZE = 65536;
+static const int RECONNECT_DELAY = 10000;   //连接失败或者被关闭后重新连接前的等待时间（微秒）
+
+enum CONN_STATE { CONNECTING = 0, IDLE, SENDING, RECEIVING };
+
+static char server_ip[ 64 ] = "127.0.0.1";
+static int server_port = 0;
+static int total_conns = 64;
+static int thread_cnt = 4;
+static int duration = 10;       //测量的时间（秒）
+static int warmup = 1;          //开始测量之前的预热时间（秒）
+static double rate = 0;         //每秒发送的请求总数，0表示闭环测试
+static bool http_mode = false;
+static int req_size = 64;       //echo模式下请求（也是应答）的大小，http模式下请求的大致大小
+static int resp_size = 64;      //http模式下应答正文的大小
+static string request;          //所有连接发送的同一个请求
+
+struct client
+{
+    int m_fd;
+    CONN_STATE m_state;
+    int m_sent;                 //当前请求已经发送的字节数
+    long long m_start;          //当前请求的开始时刻（微秒）：开环测试中是计划发送的时刻
+    long long m_next_send;      //开环测试中下一个请求计划发送的时刻（微秒）
+    string m_header;            //http模式下还没有收完的应答头部
+    long long m_remain;         //还没有收到的应答字节数，-1表示还在接收头部
+};
+
+struct worker
+{
+    pthread_t m_tid;
+    int m_first;                //负责的连接的第一个序号
+    int m_cnt;                  //负责的连接数
+    latency_hist* m_hist;
+    unsigned long long m_requests;  //测量期间完成的请求数
+    unsigned long long m_bytes;     //测量期间收到的应答字节数
+    unsigned long long m_errors;    //连接失败或者被对端关闭的次数
+};
+
+static struct sockaddr_in server_addr;
+static long long start_us = 0;      //预热结束、开始测量的时刻
+static long long stop_us = 0;       //测量结束的时刻
+
+static long long get_cur_us()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( long long )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void set_events( int epollfd, client* clt, int ev, int op = EPOLL_CTL_MOD )
+{
+    epoll_event event;
+    event.data.ptr = clt;
+    event.events = ev;
+    epoll_ctl( epollfd, op, clt->m_fd, &event );
+}
+
+// 发起非阻塞连接，失败时m_fd为-1，稍后重试
+static void open_conn( int epollfd, client* clt )
+{
+    clt->m_fd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+    int nodelay = 1;
+    setsockopt( clt->m_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof( nodelay ) );
+    if( connect( clt->m_fd, ( struct sockaddr* )&server_addr, sizeof( server_addr ) ) < 0 && errno != EINPROGRESS )
+    {
+        close( clt->m_fd );
+        clt->m_fd = -1;
+        return;
+    }
+    clt->m_state = CONNECTING;
+    set_events( epollfd, clt, EPOLLOUT, EPOLL_CTL_ADD );
+}
+
+static void close_conn( int epollfd, client* clt, worker* w )
+{
+    epoll_ctl( epollfd, EPOLL_CTL_DEL, clt->m_fd, NULL );
+    close( clt->m_fd );
+    clt->m_fd = -1;
+    clt->m_next_send = get_cur_us() + RECONNECT_DELAY;
+    ++w->m_errors;
+}
+
+// 发送当前请求的剩余部分，发完之后开始等待应答
+static bool send_request( int epollfd, client* clt )
+{
+    while( clt->m_sent < ( int )request.size() )
+    {
+        ssize_t ret = send( clt->m_fd, request.data() + clt->m_sent, request.size() - clt->m_sent, MSG_NOSIGNAL );
+        if( ret < 0 )
+        {
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+                if( clt->m_state != SENDING )
+                {
+                    clt->m_state = SENDING;
+                    set_events( epollfd, clt, EPOLLOUT );
+                }
+                return true;
+            }
+            return false;
+        }
+        clt->m_sent += ret;
+    }
+    if( clt->m_state != RECEIVING )
+    {
+        clt->m_state = RECEIVING;
+        set_events( epollfd, clt, EPOLLIN );
+    }
+    clt->m_remain = http_mode ? -1 : req_size;
+    clt->m_header.clear();
+    return true;
+}
+
+static bool start_request( int epollfd, client* clt, long long now )
+{
+    clt->m_start = ( rate > 0 ) ? clt->m_next_send : now;
+    clt->m_sent = 0;
+    return send_request( epollfd, clt );
+}
+
+// 处理收到的len字节应答，返回当前请求是否完成
+static bool consume( client* clt, const char* data, int len )
+{
+    if( clt->m_remain < 0 )
+    {
+        //http模式下先收完头部，再按Content-Length接收正文
+        clt->m_header.append( data, len );
+        size_t end = clt->m_header.find( "\r\n\r\n" );
+        if( end == string::npos )
+        {
+            return false;
+        }
+        const char* length = strstr( clt->m_header.c_str(), "Content-Length:" );
+        long long body = length ? atoll( length + 15 ) : 0;
+        clt->m_remain = body - ( long long )( clt->m_header.size() - end - 4 );
+    }
+    else
+    {
+        clt->m_remain -= len;
+    }
+    return clt->m_remain <= 0;
+}
+
+static void* run_worker( void* arg )
+{
+    worker* w = ( worker* )arg;
+    int epollfd = epoll_create( 5 );
+    client* clients = new client[ w->m_cnt ];
+    long long now = get_cur_us();
+    //开环测试时每个连接的发送间隔是conns / rate秒，各个连接的发送时刻错开
+    long long interval = ( rate > 0 ) ? ( long long )( total_conns * 1000000.0 / rate ) : 0;
+    for( int i = 0; i < w->m_cnt; ++i )
+    {
+        clients[i].m_next_send = now + interval * ( w->m_first + i ) / total_conns;
+        open_conn( epollfd, &clients[i] );
+    }
+
+    static __thread char buf[ READ_SIZE ];
+    epoll_event events[ MAX_EVENTS ];
+    while( ( now = get_cur_us() ) < stop_us )
+    {
+        //到了发送时刻的空闲连接发送请求，断开的连接重新连接
+        long long wait = 100000;
+        for( int i = 0; i < w->m_cnt; ++i )
+        {
+            client* clt = &clients[i];
+            if( clt->m_fd < 0 && clt->m_next_send <= now )
+            {
+                open_conn( epollfd, clt );
+                continue;
+            }
+            if( clt->m_fd >= 0 && clt->m_state != IDLE )
+            {
+                continue;
+            }
+            if( clt->m_next_send <= now )
+            {
+                if( !start_request( epollfd, clt, now ) )
+                {
+                    close_conn( epollfd, clt, w );
+                }
+            }
+            else if( clt->m_next_send - now < wait )
+            {
+                wait = clt->m_next_send - now;
+            }
+        }
+
+        int number = epoll_wait( epollfd, events, MAX_EVENTS, ( int )( ( wait + 999 ) / 1000 ) );
+        now = get_cur_us();
+        for( int i = 0; i < number; ++i )
+        {
+            client* clt = ( client* )events[i].data.ptr;
+            if( clt->m_fd < 0 )
+            {
+                continue;
+            }
+            if( events[i].events & ( EPOLLERR | EPOLLHUP ) )
+            {
+                close_conn( epollfd, clt, w );
+                continue;
+            }
+            if( clt->m_state == CONNECTING )
+            {
+                clt->m_state = IDLE;
+                set_events( epollfd, clt, 0 );
+                if( clt->m_next_send < now )
+                {
+                    clt->m_next_send = now;
+                }
+                continue;
+            }
+            if( clt->m_state == SENDING )
+            {
+                if( !send_request( epollfd, clt ) )
+                {
+                    close_conn( epollfd, clt, w );
+                }
+                continue;
+            }
+            //RECEIVING：每个连接上只有一个请求，读到应答结束为止
+            bool done = false;
+            bool ok = true;
+            while( !done )
+            {
+                ssize_t ret = recv( clt->m_fd, buf, sizeof( buf ), 0 );
+                if( ret < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+                {
+                    break;
+                }
+                if( ret <= 0 )
+                {
+                    ok = false;
+                    break;
+                }
+                if( now >= start_us )
+                {
+                    w->m_bytes += ret;
+                }
+                done = consume( clt, buf, ret );
+            }
+            if( done )
+            {
+                if( clt->m_start >= start_us && now < stop_us )
+                {
+                    w->m_hist->record( now - clt->m_start );
+                    ++w->m_requests;
+                }
+                clt->m_state = IDLE;
+                clt->m_next_send = ( rate > 0 ) ? clt->m_next_send + interval : now;
+                if( clt->m_next_send <= now && !start_request( epollfd, clt, now ) )
+                {
+                    ok = false;
+                }
+            }
+            if( !ok )
+            {
+                close_conn( epollfd, clt, w );
+            }
+        }
+    }
+
+    for( int i = 0; i < w->m_cnt; ++i )
+    {
+        if( clients[i].m_fd >= 0 )
+        {
+            close( clients[i].m_fd );
+        }
+    }
+    delete [] clients;
+    close( epollfd );
+    return NULL;
+}
+
+static void usage( const char* prog )
+{
+    printf( "usage: %s -p port [-a ip] [-c conns] [-t threads] [-d seconds] [-w warmup] [-r rate] [-m echo|http] [-s req_size] [-z resp_size]\n", prog );
+}
+
+int main( int argc, char* argv[] )
+{
+    int option;
+    while( ( option = getopt( argc, argv, "a:p:c:t:d:w:r:m:s:z:" ) ) != -1 )
+    {
+        switch( option )
+        {
+            case 'a': snprintf( server_ip, sizeof( server_ip ), "%s", optarg ); break;
+            case 'p': server_port = atoi( optarg ); break;
+            case 'c': total_conns = atoi( optarg ); break;
+            case 't': thread_cnt = atoi( optarg ); break;
+            case 'd': duration = atoi( optarg ); break;
+            case 'w': warmup = atoi( optarg ); break;
+            case 'r': rate = atof( optarg ); break;
+            case 'm': http_mode = ( strcmp( optarg, "http" ) == 0 ); break;
+            case 's': req_size = atoi( optarg ); break;
+            case 'z': resp_size = atoi( optarg ); break;
+            default: usage( argv[0] ); return 1;
+        }
+    }
+    if( server_port <= 0 || total_conns <= 0 || thread_cnt <= 0 || duration <= 0 || req_size <= 0 )
+    {
+        usage( argv[0] );
+        return 1;
+    }
+    if( thread_cnt > MAX_THREADS )
+    {
+        thread_cnt = MAX_THREADS;
+    }
+    if( thread_cnt > total_conns )
+    {
+        thread_cnt = total_conns;
+    }
+    signal( SIGPIPE, SIG_IGN );
+    memset( &server_addr, 0, sizeof( server_addr ) );
+    server_addr.sin_family = AF_INET;
+    inet_pton( AF_INET, server_ip, &server_addr.sin_addr );
+    server_addr.sin_port = htons( server_port );
+
+    if( http_mode )
+    {
+        //用一个填充头部把请求补到大约req_size字节
+        char line[ 128 ];
+        snprintf( line, sizeof( line ), "GET /%d HTTP/1.1\r\nHost: %s\r\n", resp_size, server_ip );
+        request = line;
+        int pad = req_size - ( int )request.size() - 12;
+        if( pad > 0 )
+        {
+            request += "X-Pad: " + string( pad, 'x' ) + "\r\n";
+        }
+        request += "\r\n";
+    }
+    else
+    {
+        request.assign( req_size, 'x' );
+    }
+
+    start_us = get_cur_us() + warmup * 1000000LL;
+    stop_us = start_us + duration * 1000000LL;
+    worker workers[ MAX_THREADS ];
+    for( int i = 0; i < thread_cnt; ++i )
+    {
+        workers[i].m_first = total_conns * i / thread_cnt;
+        workers[i].m_cnt = total_conns * ( i + 1 ) / thread_cnt - workers[i].m_first;
+        workers[i].m_hist = new latency_hist;
+        memset( workers[i].m_hist, 0, sizeof( latency_hist ) );
+        workers[i].m_requests = workers[i].m_bytes = workers[i].m_errors = 0;
+        pthread_create( &workers[i].m_tid, NULL, run_worker, &workers[i] );
+    }
+
+    latency_hist total;
+    memset( &total, 0, sizeof( total ) );
+    unsigned long long requests = 0;
+    unsigned long long bytes = 0;
+    unsigned long long errors = 0;
+    for( int i = 0; i < thread_cnt; ++i )
+    {
+        pthread_join( workers[i].m_tid, NULL );
+        total.merge( *workers[i].m_hist );
+        requests += workers[i].m_requests;
+        bytes += workers[i].m_bytes;
+        errors += workers[i].m_errors;
+        delete workers[i].m_hist;
+    }
+
+    char rate_str[ 32 ] = "max";
+    if( rate > 0 )
+    {
+        snprintf( rate_str, sizeof( rate_str ), "%.0f/s", rate );
+    }
+    printf( "%s:%d %s conns %d threads %d request %d B response %d B rate %s\n", server_ip, server_port,
+            http_mode ? "http" : "echo", total_conns, thread_cnt, ( int )request.size(), http_mode ? resp_size : req_size, rate_str );
+    printf( "requests %llu  %.1f req/s  %.2f MB/s  errors %llu\n", requests, ( double )requests / duration,
+            ( double )bytes / duration / ( 1 << 20 ), errors );
+    printf( "latency us  mean %lld  p50 %lld  p90 %lld  p99 %lld  p999 %lld  max %llu\n",
+            total.m_count ? ( long long )( total.m_sum / total.m_count ) : 0LL, total.percentile( 50 ), total.percentile( 90 ),
+            total.percentile( 99 ), total.percentile( 99.9 ), total.m_max );
+    return 0;
+}
@@ -1,46 +1,328 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "log.h"
 
-static int level = LOG_INFO;
-static int LOG_BUFFER_SIZE = 2048;
+int cur_loglevel = LOG_INFO;
+static const int LOG_BUFFER_SIZE = 2048;
 static const char* loglevels[] =
 {
     "emerge!", "alert!", "critical!", "error!", "warn!", "notice:", "info:", "debug:"
 };
 
+// 环形缓冲区中的一条记录，后面紧跟消息正文（不以'\0'结尾）。
+// 记录按RECORD_ALIGN对齐，缓冲区末尾放不下一条记录时写一条填充记录，从缓冲区开头继续
+struct log_record
+{
+    time_t m_time;          //log_tick缓存的时间
+    const char* m_file;     //__FILE__是字符串常量，只保存指针
+    int m_level;            //-1表示填充记录
+    int m_line;
+    int m_len;              //整条记录（记录头、正文和对齐）占用的字节数
+    int m_text_len;         //正文的长度
+};
+
+static const int RING_SIZE = 1 << 20;           //每个进程的环形缓冲区大小，必须是2的幂
+static const int RECORD_ALIGN = sizeof( log_record );
+static const int BATCH_RECORDS = 256;           //写线程每次writev最多写出的记录数，每条记录占3个iovec
+static const int PREFIX_SIZE = 1280;            //"[ 时间 ] 文件名:行号 级别 "的最大长度
+static const int FLUSH_WAIT_MS = 1000;          //log_flush最多等待的时间
+
+enum WRITER_STATE { WRITER_NONE = 0, WRITER_RUNNING, WRITER_FAILED };
+
+// 单生产者（进程的主线程）单消费者（写线程）的无锁队列：m_head只由生产者修改，m_tail只由消费者修改，
+// 下标都是不回绕的字节计数，与conn中的环形缓冲区相同
+static char ring[ RING_SIZE ] __attribute__( ( aligned( 64 ) ) );
+static unsigned long long ring_head = 0;
+static unsigned long long ring_tail = 0;
+static unsigned long long dropped = 0;          //环形缓冲区满时丢弃的记录数
+static unsigned long long reported_dropped = 0; //已经报告过的丢弃数，只由消费者访问
+static time_t cached_time = 0;
+static WRITER_STATE writer_state = WRITER_NONE;
+static int writer_sleeping = 0;                 //写线程是否（将要）在futex上等待，生产者写入记录后据此决定是否唤醒它
+
 void set_loglevel( int log_level )
 {
-    level = log_level;
+    cur_loglevel = log_level;
 }
 
-void log( int log_level,  const char* file_name, int line_num, const char* format, ... )
+void log_tick()
+{
+    cached_time = time( NULL );
+}
+
+// 格式化记录的前缀。时间只精确到秒，同一秒内的记录复用上一次strftime的结果
+static int format_prefix( char* prefix, const log_record* rec )
 {
-    if ( log_level > level )
+    static time_t last_time = -1;
+    static char stamp[ 64 ];
+    if( rec->m_time != last_time )
     {
-        return;
+        struct tm cur_time;
+        localtime_r( &rec->m_time, &cur_time );
+        strftime( stamp, sizeof( stamp ), "[ %x %X ] ", &cur_time );
+        last_time = rec->m_time;
     }
+    int len = snprintf( prefix, PREFIX_SIZE, "%s%s:%04d %s ", stamp, rec->m_file, rec->m_line, loglevels[ rec->m_level - LOG_EMERG ] );
+    return ( len < PREFIX_SIZE ) ? len : PREFIX_SIZE - 1;
+}
 
-    time_t tmp = time( NULL );
-    struct tm* cur_time = localtime( &tmp );
-    if ( ! cur_time )
+// 写出iov中的全部数据，处理writev只写出一部分的情况
+static void write_all( struct iovec* iov, int cnt )
+{
+    while( cnt > 0 )
     {
-        return;
+        ssize_t ret = writev( STDOUT_FILENO, iov, cnt );
+        if( ret < 0 )
+        {
+            if( errno == EINTR )
+            {
+                continue;
+            }
+            return;
+        }
+        while( cnt > 0 && ( size_t )ret >= iov->iov_len )
+        {
+            ret -= iov->iov_len;
+            ++iov;
+            --cnt;
+        }
+        if( cnt > 0 )
+        {
+            iov->iov_base = ( char* )iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+}
+
+// 消费者：取出最多BATCH_RECORDS条记录，用一次writev写出。正文直接指向环形缓冲区，写完之后才移动m_tail。
+// 环形缓冲区为空时返回false
+static bool drain()
+{
+    static char prefixes[ BATCH_RECORDS + 1 ][ PREFIX_SIZE ];
+    static struct iovec iov[ BATCH_RECORDS * 3 + 1 ];
+    static char newline = '\n';
+    int cnt = 0;
+    int records = 0;
+
+    unsigned long long lost = __atomic_load_n( &dropped, __ATOMIC_RELAXED );
+    if( lost != reported_dropped )
+    {
+        log_record rec;
+        rec.m_time = time( NULL );
+        rec.m_file = __FILE__;
+        rec.m_line = __LINE__;
+        rec.m_level = LOG_WARNING;
+        int len = format_prefix( prefixes[ BATCH_RECORDS ], &rec );
+        len += snprintf( prefixes[ BATCH_RECORDS ] + len, PREFIX_SIZE - len, "%llu log records dropped\n", lost - reported_dropped );
+        iov[ cnt ].iov_base = prefixes[ BATCH_RECORDS ];
+        iov[ cnt++ ].iov_len = ( len < PREFIX_SIZE ) ? len : PREFIX_SIZE - 1;
+        reported_dropped = lost;
+    }
+
+    unsigned long long head = __atomic_load_n( &ring_head, __ATOMIC_ACQUIRE );
+    unsigned long long tail = ring_tail;
+    while( tail != head && records < BATCH_RECORDS )
+    {
+        log_record* rec = ( log_record* )( ring + ( tail & ( RING_SIZE - 1 ) ) );
+        tail += rec->m_len;
+        if( rec->m_level < 0 )
+        {
+            continue;
+        }
+        iov[ cnt ].iov_base = prefixes[ records ];
+        iov[ cnt++ ].iov_len = format_prefix( prefixes[ records ], rec );
+        iov[ cnt ].iov_base = rec + 1;
+        iov[ cnt++ ].iov_len = rec->m_text_len;
+        iov[ cnt ].iov_base = &newline;
+        iov[ cnt++ ].iov_len = 1;
+        ++records;
     }
+    if( cnt == 0 )
+    {
+        __atomic_store_n( &ring_tail, tail, __ATOMIC_RELEASE );
+        return false;
+    }
+    write_all( iov, cnt );
+    __atomic_store_n( &ring_tail, tail, __ATOMIC_RELEASE );
+    return true;
+}
+
+static void futex_wait( int* addr, int val )
+{
+    syscall( SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0 );
+}
 
-    char arg_buffer[ LOG_BUFFER_SIZE ];
-    memset( arg_buffer, '\0', LOG_BUFFER_SIZE );
-    strftime( arg_buffer, LOG_BUFFER_SIZE - 1, "[ %x %X ] ", cur_time );
-    printf( "%s", arg_buffer );
-    printf( "%s:%04d ", file_name, line_num );
-    printf( "%s ", loglevels[ log_level - LOG_EMERG ] );
+static void futex_wake( int* addr )
+{
+    syscall( SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+}
 
+// 环形缓冲区为空时写线程在futex上等待，没有日志的进程里它不会被唤醒。
+// 先声明要等待再检查一次缓冲区，与生产者的"写入记录再检查writer_sleeping"配合（都是顺序一致的操作），
+// 两边至少有一方能看到对方，记录不会被漏掉
+static void* writer_main( void* arg __attribute__( ( unused ) ) )
+{
+    while( true )
+    {
+        if( drain() )
+        {
+            continue;
+        }
+        __atomic_store_n( &writer_sleeping, 1, __ATOMIC_SEQ_CST );
+        if( __atomic_load_n( &ring_head, __ATOMIC_SEQ_CST ) == ring_tail
+            && __atomic_load_n( &dropped, __ATOMIC_RELAXED ) == reported_dropped )
+        {
+            //生产者把writer_sleeping改回0之后再唤醒，此时值已经不是1，futex_wait会立即返回
+            futex_wait( &writer_sleeping, 1 );
+        }
+        __atomic_store_n( &writer_sleeping, 0, __ATOMIC_RELAXED );
+    }
+    return NULL;
+}
+
+// 生产者写入记录（或者丢弃记录）之后调用：写线程正在等待时唤醒它
+static void wake_writer()
+{
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    if( __atomic_load_n( &writer_sleeping, __ATOMIC_RELAXED ) && __atomic_exchange_n( &writer_sleeping, 0, __ATOMIC_SEQ_CST ) )
+    {
+        futex_wake( &writer_sleeping );
+    }
+}
+
+// fork出的子进程中没有写线程，父进程还没写出的记录由父进程的写线程负责，子进程丢弃自己的副本
+static void after_fork()
+{
+    ring_tail = ring_head;
+    reported_dropped = dropped;
+    writer_state = WRITER_NONE;
+    writer_sleeping = 0;
+    cached_time = time( NULL );
+}
+
+// 在每个进程第一次写日志时启动写线程。写线程屏蔽所有信号，信号仍由主线程处理（见processpool的sig_handler）
+static void start_writer()
+{
+    static bool registered = false;
+    if( !registered )
+    {
+        //注册的函数会被子进程继承，只需注册一次
+        atexit( log_flush );
+        pthread_atfork( NULL, NULL, after_fork );
+        registered = true;
+    }
+    if( cached_time == 0 )
+    {
+        cached_time = time( NULL );
+    }
+
+    sigset_t all;
+    sigset_t old;
+    sigfillset( &all );
+    pthread_sigmask( SIG_BLOCK, &all, &old );
+    pthread_t writer;
+    if( pthread_create( &writer, NULL, writer_main, NULL ) == 0 )
+    {
+        pthread_detach( writer );
+        writer_state = WRITER_RUNNING;
+    }
+    else
+    {
+        //创建不了线程时退化为同步写日志
+        writer_state = WRITER_FAILED;
+    }
+    pthread_sigmask( SIG_SETMASK, &old, NULL );
+}
+
+void log( int log_level,  const char* file_name, int line_num, const char* format, ... )
+{
+    if ( log_level > cur_loglevel )
+    {
+        return;
+    }
+    if( writer_state == WRITER_NONE )
+    {
+        start_writer();
+    }
+
+    char text[ LOG_BUFFER_SIZE ];
     va_list arg_list;
     va_start( arg_list, format );
-    memset( arg_buffer, '\0', LOG_BUFFER_SIZE );
-    vsnprintf( arg_buffer, LOG_BUFFER_SIZE - 1, format, arg_list );
-    printf( "%s\n", arg_buffer );
-    fflush( stdout );
+    int len = vsnprintf( text, LOG_BUFFER_SIZE, format, arg_list );
     va_end( arg_list );
+    if( len < 0 )
+    {
+        return;
+    }
+    if( len >= LOG_BUFFER_SIZE )
+    {
+        len = LOG_BUFFER_SIZE - 1;
+    }
+
+    int need = ( sizeof( log_record ) + len + RECORD_ALIGN - 1 ) & ~( RECORD_ALIGN - 1 );
+    unsigned long long head = ring_head;
+    unsigned long long tail = __atomic_load_n( &ring_tail, __ATOMIC_ACQUIRE );
+    int pos = head & ( RING_SIZE - 1 );
+    int pad = ( RING_SIZE - pos < need ) ? RING_SIZE - pos : 0;
+    if( head + pad + need - tail > ( unsigned long long )RING_SIZE )
+    {
+        __atomic_store_n( &dropped, dropped + 1, __ATOMIC_RELAXED );
+        wake_writer();
+        return;
+    }
+    if( pad > 0 )
+    {
+        log_record* filler = ( log_record* )( ring + pos );
+        filler->m_level = -1;
+        filler->m_len = pad;
+        head += pad;
+        pos = 0;
+    }
+    log_record* rec = ( log_record* )( ring + pos );
+    rec->m_time = cached_time;
+    rec->m_file = file_name;
+    rec->m_level = log_level;
+    rec->m_line = line_num;
+    rec->m_len = need;
+    rec->m_text_len = len;
+    memcpy( rec + 1, text, len );
+    __atomic_store_n( &ring_head, head + need, __ATOMIC_RELEASE );
+
+    if( writer_state == WRITER_FAILED )
+    {
+        drain();
+    }
+    else
+    {
+        wake_writer();
+    }
+}
+
+void log_flush()
+{
+    if( writer_state == WRITER_FAILED )
+    {
+        while( drain() )
+        {
+        }
+        return;
+    }
+    if( writer_state != WRITER_RUNNING )
+    {
+        return;
+    }
+    unsigned long long head = ring_head;
+    for( int i = 0; i < FLUSH_WAIT_MS && __atomic_load_n( &ring_tail, __ATOMIC_ACQUIRE ) != head; ++i )
+    {
+        usleep( 1000 );
+    }
 }
@@ -4,7 +4,29 @@
 #include <syslog.h>
 #include <cstdarg>
 
+// 日志是异步的：log()只把记录（时间、级别、位置和格式化后的消息）写入本进程的环形缓冲区，
+// 由本进程的写线程批量取出，格式化前缀后用writev写到标准输出。环形缓冲区满时丢弃记录并计数，调用者从不阻塞
+
+// 编译时的最高日志级别，例如-DLOG_MAX_LEVEL=LOG_INFO会让所有调试日志连同参数的计算一起被编译器去掉
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_DEBUG
+#endif
+
+extern int cur_loglevel;    //运行时的日志级别，由set_loglevel设置
+
+// 先在调用处检查级别，被过滤掉的日志不求值参数，也不调用log()
+#define LOG( log_level, ... ) \
+    do \
+    { \
+        if( ( log_level ) <= LOG_MAX_LEVEL && ( log_level ) <= cur_loglevel ) \
+        { \
+            log( log_level, __FILE__, __LINE__, __VA_ARGS__ ); \
+        } \
+    } while( 0 )
+
 void set_loglevel( int log_level = LOG_DEBUG );
 void log( int log_level, const char* file_name, int line_num, const char* format, ... );
+void log_tick();    //更新日志使用的时间戳缓存，由事件循环每轮调用一次，log()本身不读时钟
+void log_flush();   //等待写线程把已经写入环形缓冲区的日志都写出（进程退出时自动调用）
 
 #endif
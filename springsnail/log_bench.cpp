@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "log.h"
+
+// 日志调用开销的微基准：比较原来的同步log（localtime、printf、fflush）和现在写入环形缓冲区的异步log，
+// 以及被运行时级别过滤掉的调试日志。标准输出被重定向到/dev/null，只测量调用者一侧的耗时
+// 编译：make log_bench
+
+static const int CALLS = 200000;
+
+static long long get_cur_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( long long )ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 原来的log：每次调用都读取时间并同步写出
+static void old_log( int log_level, const char* file_name, int line_num, const char* format, ... )
+{
+    static const char* loglevels[] =
+    {
+        "emerge!", "alert!", "critical!", "error!", "warn!", "notice:", "info:", "debug:"
+    };
+    time_t tmp = time( NULL );
+    struct tm* cur_time = localtime( &tmp );
+    char arg_buffer[ 2048 ];
+    memset( arg_buffer, '\0', sizeof( arg_buffer ) );
+    strftime( arg_buffer, sizeof( arg_buffer ) - 1, "[ %x %X ] ", cur_time );
+    printf( "%s", arg_buffer );
+    printf( "%s:%04d ", file_name, line_num );
+    printf( "%s ", loglevels[ log_level - LOG_EMERG ] );
+    va_list arg_list;
+    va_start( arg_list, format );
+    memset( arg_buffer, '\0', sizeof( arg_buffer ) );
+    vsnprintf( arg_buffer, sizeof( arg_buffer ) - 1, format, arg_list );
+    printf( "%s\n", arg_buffer );
+    fflush( stdout );
+    va_end( arg_list );
+}
+
+int main()
+{
+    int devnull = open( "/dev/null", O_WRONLY );
+    int saved = dup( STDOUT_FILENO );
+    dup2( devnull, STDOUT_FILENO );
+
+    long long start = get_cur_ns();
+    for( int i = 0; i < CALLS; ++i )
+    {
+        old_log( LOG_DEBUG, __FILE__, __LINE__, "%d bytes pending from client", i );
+    }
+    double old_ns = ( double )( get_cur_ns() - start ) / CALLS;
+
+    //环形缓冲区写满时记录会被丢弃，每写一批让写线程取走，只统计调用log的时间
+    set_loglevel( LOG_DEBUG );
+    log_tick();
+    long long elapsed = 0;
+    for( int i = 0; i < CALLS; i += 1000 )
+    {
+        start = get_cur_ns();
+        for( int j = i; j < i + 1000; ++j )
+        {
+            LOG( LOG_DEBUG, "%d bytes pending from client", j );
+        }
+        elapsed += get_cur_ns() - start;
+        log_flush();
+    }
+    double new_ns = ( double )elapsed / CALLS;
+
+    set_loglevel( LOG_INFO );
+    start = get_cur_ns();
+    for( int i = 0; i < CALLS; ++i )
+    {
+        LOG( LOG_DEBUG, "%d bytes pending from client", i );
+    }
+    double filtered_ns = ( double )( get_cur_ns() - start ) / CALLS;
+
+    dup2( saved, STDOUT_FILENO );
+    printf( "%d calls   sync log %8.1f ns   async log %6.1f ns   filtered debug log %5.1f ns\n",
+            CALLS, old_ns, new_ns, filtered_ns );
+    return 0;
+}
@@ -18,6 +18,7 @@
 #include "log.h"
 #include "conn.h"
 #include "mgr.h"
+#include "lb_policy.h"
 #include "processpool.h"
 
 using std::vector;
@@ -26,81 +27,32 @@ static const char* version = "1.0";
 
 // __FILE__:用以指示本行语句所在源文件的文件名
 // __LINE__:用以指示本行语句在源文件中的位置信息
+// LOG宏会自动填入这两个参数
 
-static void usage( const char* prog )
-{
-    log( LOG_INFO, __FILE__, __LINE__,  "usage: %s [-h] [-v] [-f config_file]", prog );
-}
+// 以下配置项只在启动时生效，重新加载配置时被忽略（需要重启）
+static int accept_mode = ACCEPT_DISPATCH;  // 新连接的接收方式，由"ReusePort on|cpu"一行配置
+static char policy_name[ 64 ] = "least_conn";  // 负载均衡策略，由"Policy name"一行配置
+static int accept_batch = 0;   // 子进程每次最多连续accept的连接数，由"AcceptBatch n"一行配置，0表示使用默认值
+static int workers = 0;    // 子进程数量，由"Workers n"一行配置，0表示和逻辑主机数量相同
+static bool http_mode = false; // 是否使用L7模式，由"Mode http"一行配置
+static int clt_idle_timeout = 0;   // 客户连接空闲多久后关闭（毫秒），由"ClientIdleTimeout ms"一行配置，0表示不限制
+static int clt_lifetime = 0;       // 客户连接最长保持多久（毫秒），由"ClientLifetime ms"一行配置，0表示不限制
+static char admin_ip[64];       // 统计页面的监听地址，由"AdminListen ip:port"一行配置，为空表示不开启
+static int admin_port = 0;
+static char cfg_file[1024];     // 配置文件的路径，重新加载配置时再次读取
 
-int main( int argc, char* argv[] )
+// 解析config.xml的内容（会修改buf），host在前面的mgr.h文件中定义。
+// startup为false（重新加载配置）时只解析逻辑主机，只在启动时生效的配置项保持不变
+static bool parse_config( char* buf, vector< host >& balance_srv, vector< host >& logical_srv, bool startup )
 {
-    char cfg_file[1024];
-    memset( cfg_file, '\0', 100 );
-    int option;
-    while ( ( option = getopt( argc, argv, "f:xvh" ) ) != -1 )
-    {
-        switch ( option )
-        {
-            case 'x':
-            {
-                set_loglevel( LOG_DEBUG );
-                break;
-            }
-            case 'v':
-            {
-                log( LOG_INFO, __FILE__, __LINE__, "%s %s", argv[0], version );
-                return 0;
-            }
-            case 'h':
-            {
-                usage( basename( argv[ 0 ] ) );
-                return 0;
-            }
-            case 'f':
-            {
-                memcpy( cfg_file, optarg, strlen( optarg ) );
-                break;
-            }
-            case '?':
-            {
-                log( LOG_ERR, __FILE__, __LINE__, "un-recognized option %c", option );
-                usage( basename( argv[ 0 ] ) );
-                return 1;
-            }
-        }
-    }    
-
-    if( cfg_file[0] == '\0' )
-    {
-        log( LOG_ERR, __FILE__, __LINE__, "%s", "please specifiy the config file" );
-        return 1;
-    }
-    int cfg_fd = open( cfg_file, O_RDONLY );
-    if( !cfg_fd )
-    {
-        log( LOG_ERR, __FILE__, __LINE__, "read config file met error: %s", strerror( errno ) );
-        return 1;
-    }
-    struct stat ret_stat;
-    if( fstat( cfg_fd, &ret_stat ) < 0 )
-    {
-        log( LOG_ERR, __FILE__, __LINE__, "read config file met error: %s", strerror( errno ) );
-        return 1;
-    }
-    // buf用于存储配置文件的信息
-    char* buf = new char [ret_stat.st_size + 1];
-    memset( buf, '\0', ret_stat.st_size + 1 );
-    ssize_t read_sz = read( cfg_fd, buf, ret_stat.st_size );
-    if ( read_sz < 0 )
-    {
-        log( LOG_ERR, __FILE__, __LINE__, "read config file met error: %s", strerror( errno ) );
-        return 1;
-    }
-    // 以下用于解析xml文件，host在前面的mgr.h文件中定义
-    vector< host > balance_srv; // 负载均衡服务器
-    vector< host > logical_srv; // 逻辑服务器
     host tmp_host;
     memset( tmp_host.m_hostname, '\0', 1024 );
+    tmp_host.m_splice = false;
+    tmp_host.m_weight = 1;
+    memset( tmp_host.m_http_check, '\0', sizeof( tmp_host.m_http_check ) );
+    tmp_host.m_max_conns = 0;
+    tmp_host.m_idle_timeout = 60000;
+    tmp_host.m_buf_size = conn::BUF_SIZE;
     char* tmp_hostname;
     char* tmp_port;
     char* tmp_conncnt;
@@ -122,8 +74,8 @@ int main( int argc, char* argv[] )
         {
             if( opentag )
             {
-                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
-                return 1;
+                LOG( LOG_ERR, "%s", "parse config file failed" );
+                return false;
             }
             opentag = true;
         }
@@ -131,11 +83,17 @@ int main( int argc, char* argv[] )
         {
             if( !opentag )
             {
-                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
-                return 1;
+                LOG( LOG_ERR, "%s", "parse config file failed" );
+                return false;
             }
             logical_srv.push_back( tmp_host );
             memset( tmp_host.m_hostname, '\0', 1024 );
+            tmp_host.m_splice = false;
+            tmp_host.m_weight = 1;
+            memset( tmp_host.m_http_check, '\0', sizeof( tmp_host.m_http_check ) );
+            tmp_host.m_max_conns = 0;
+            tmp_host.m_idle_timeout = 60000;
+            tmp_host.m_buf_size = conn::BUF_SIZE;
             opentag = false;    // 读取完毕一个逻辑主机地址后，将标签关闭
         }
         else if( tmp3 = strstr( tmp, "<name>" ) )
@@ -144,8 +102,8 @@ int main( int argc, char* argv[] )
             tmp4 = strstr( tmp_hostname, "</name>" );
             if( !tmp4 )
             {
-                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
-                return 1;
+                LOG( LOG_ERR, "%s", "parse config file failed" );
+                return false;
             }
             *tmp4 = '\0';   // 跳过"</name>"这些字符，提前截断
             memcpy( tmp_host.m_hostname, tmp_hostname, strlen( tmp_hostname ) );
@@ -156,8 +114,8 @@ int main( int argc, char* argv[] )
             tmp4 = strstr( tmp_port, "</port>" );
             if( !tmp4 )
             {
-                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
-                return 1;
+                LOG( LOG_ERR, "%s", "parse config file failed" );
+                return false;
             }
             *tmp4 = '\0';
             tmp_host.m_port = atoi( tmp_port );
@@ -168,20 +126,174 @@ int main( int argc, char* argv[] )
             tmp4 = strstr( tmp_conncnt, "</conns>" );
             if( !tmp4 )
             {
-                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
-                return 1;
+                LOG( LOG_ERR, "%s", "parse config file failed" );
+                return false;
             }
             *tmp4 = '\0';
             tmp_host.m_conncnt = atoi( tmp_conncnt );
         }
+        else if( tmp3 = strstr( tmp, "<max_conns>" ) )
+        {
+            // <max_conns>n</max_conns>表示连接池最多扩充到n个连接，默认不扩充（等于<conns>）
+            char* tmp_max = tmp3 + 11;
+            tmp4 = strstr( tmp_max, "</max_conns>" );
+            if( !tmp4 )
+            {
+                LOG( LOG_ERR, "%s", "parse config file failed" );
+                return false;
+            }
+            *tmp4 = '\0';
+            tmp_host.m_max_conns = atoi( tmp_max );
+        }
+        else if( tmp3 = strstr( tmp, "<idle_timeout>" ) )
+        {
+            // <idle_timeout>ms</idle_timeout>表示超过<conns>的连接空闲多久后关闭
+            char* tmp_idle = tmp3 + 14;
+            tmp4 = strstr( tmp_idle, "</idle_timeout>" );
+            if( !tmp4 )
+            {
+                LOG( LOG_ERR, "%s", "parse config file failed" );
+                return false;
+            }
+            *tmp4 = '\0';
+            tmp_host.m_idle_timeout = atoi( tmp_idle );
+        }
+        else if( tmp3 = strstr( tmp, "<buffer>" ) )
+        {
+            // <buffer>n</buffer>表示每个连接每个方向使用n字节（向上取整为2的幂）的环形缓冲区
+            char* tmp_buf = tmp3 + 8;
+            tmp4 = strstr( tmp_buf, "</buffer>" );
+            if( !tmp4 || atoi( tmp_buf ) <= 0 || atoi( tmp_buf ) > ( 1 << 24 ) )
+            {
+                LOG( LOG_ERR, "%s", "parse config file failed" );
+                return false;
+            }
+            *tmp4 = '\0';
+            tmp_host.m_buf_size = atoi( tmp_buf );
+        }
+        else if( tmp3 = strstr( tmp, "<splice>" ) )
+        {
+            // <splice>on</splice>表示该逻辑主机使用splice零拷贝转发，默认使用用户空间缓冲
+            char* tmp_splice = tmp3 + 8;
+            tmp4 = strstr( tmp_splice, "</splice>" );
+            if( !tmp4 )
+            {
+                LOG( LOG_ERR, "%s", "parse config file failed" );
+                return false;
+            }
+            *tmp4 = '\0';
+            tmp_host.m_splice = ( strcmp( tmp_splice, "on" ) == 0 );
+        }
+        else if( tmp3 = strstr( tmp, "ReusePort" ) )
+        {
+            // ReusePort on：每个子进程用自己的SO_REUSEPORT socket监听；ReusePort cpu：再按CPU分配连接
+            tmp3 += 9;
+            tmp3 += strspn( tmp3, " \t" );
+            if( startup && strncmp( tmp3, "on", 2 ) == 0 )
+            {
+                accept_mode = ACCEPT_REUSEPORT;
+            }
+            else if( startup && strncmp( tmp3, "cpu", 3 ) == 0 )
+            {
+                accept_mode = ACCEPT_REUSEPORT_CPU;
+            }
+        }
+        else if( tmp3 = strstr( tmp, "Mode" ) )
+        {
+            // Mode http：按HTTP请求的边界借用服务端连接（L7模式），默认为tcp
+            tmp3 += 4;
+            tmp3 += strspn( tmp3, " \t" );
+            if( startup && strncmp( tmp3, "http", 4 ) == 0 )
+            {
+                http_mode = true;
+            }
+        }
+        else if( tmp3 = strstr( tmp, "<weight>" ) )
+        {
+            char* tmp_weight = tmp3 + 8;
+            tmp4 = strstr( tmp_weight, "</weight>" );
+            if( !tmp4 )
+            {
+                LOG( LOG_ERR, "%s", "parse config file failed" );
+                return false;
+            }
+            *tmp4 = '\0';
+            tmp_host.m_weight = atoi( tmp_weight );
+        }
+        else if( tmp3 = strstr( tmp, "<http_check>" ) )
+        {
+            // <http_check>/path</http_check>表示用HTTP GET检查该逻辑主机的健康状态，默认只检查TCP连接
+            char* tmp_check = tmp3 + 12;
+            tmp4 = strstr( tmp_check, "</http_check>" );
+            if( !tmp4 || ( tmp4 - tmp_check ) >= ( int )sizeof( tmp_host.m_http_check ) )
+            {
+                LOG( LOG_ERR, "%s", "parse config file failed" );
+                return false;
+            }
+            *tmp4 = '\0';
+            memcpy( tmp_host.m_http_check, tmp_check, strlen( tmp_check ) + 1 );
+        }
+        else if( tmp3 = strstr( tmp, "Workers" ) )
+        {
+            if( startup )
+            {
+                workers = atoi( tmp3 + 7 );
+            }
+        }
+        else if( tmp3 = strstr( tmp, "Policy" ) )
+        {
+            if( startup )
+            {
+                sscanf( tmp3 + 6, "%63s", policy_name );
+            }
+        }
+        else if( tmp3 = strstr( tmp, "AcceptBatch" ) )
+        {
+            if( startup )
+            {
+                accept_batch = atoi( tmp3 + 11 );
+            }
+        }
+        else if( tmp3 = strstr( tmp, "ClientIdleTimeout" ) )
+        {
+            if( startup )
+            {
+                clt_idle_timeout = atoi( tmp3 + 17 );
+            }
+        }
+        else if( tmp3 = strstr( tmp, "ClientLifetime" ) )
+        {
+            if( startup )
+            {
+                clt_lifetime = atoi( tmp3 + 14 );
+            }
+        }
+        else if( tmp3 = strstr( tmp, "AdminListen" ) )
+        {
+            // AdminListen ip:port：在单独的端口上输出统计页面（必须在Listen之前判断）
+            tmp3 += 11;
+            tmp3 += strspn( tmp3, " \t" );
+            tmp4 = strchr( tmp3, ':' );
+            if( !tmp4 || tmp4 - tmp3 >= ( int )sizeof( admin_ip ) )
+            {
+                LOG( LOG_ERR, "%s", "parse config file failed" );
+                return false;
+            }
+            if( startup )
+            {
+                memcpy( admin_ip, tmp3, tmp4 - tmp3 );
+                admin_ip[ tmp4 - tmp3 ] = '\0';
+                admin_port = atoi( tmp4 + 1 );
+            }
+        }
         else if( tmp3 = strstr( tmp, "Listen" ) )
         {
             tmp_hostname = tmp3 + 6;
             tmp4 = strstr( tmp_hostname, ":" );
             if( !tmp4 )
             {
-                log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
-                return 1;
+                LOG( LOG_ERR, "%s", "parse config file failed" );
+                return false;
             }
             *tmp4++ = '\0';
             tmp_host.m_port = atoi( tmp4 ); // 端口号
@@ -195,35 +307,238 @@ int main( int argc, char* argv[] )
 
     if( balance_srv.size() == 0 || logical_srv.size() == 0 )
     {
-        log( LOG_ERR, __FILE__, __LINE__, "%s", "parse config file failed" );
-        return 1;
+        LOG( LOG_ERR, "%s", "parse config file failed" );
+        return false;
     }
-    const char* ip = balance_srv[0].m_hostname;
-    int port = balance_srv[0].m_port;
+    return true;
+}
 
-    int listenfd = socket( PF_INET, SOCK_STREAM, 0 );
-    assert( listenfd >= 0 );
- 
-    int ret = 0;
+// 创建统计页面的监听socket，失败时只记录日志，返回-1。设置SO_REUSEPORT是为了平滑升级时新旧主进程可以同时监听
+static int open_admin( const char* ip, int port )
+{
+    int fd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( fd < 0 )
+    {
+        LOG( LOG_ERR, "create admin socket failed: %s", strerror( errno ) );
+        return -1;
+    }
+    int reuse = 1;
+    setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+    setsockopt( fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof( reuse ) );
     struct sockaddr_in address;
     bzero( &address, sizeof( address ) );
     address.sin_family = AF_INET;
     inet_pton( AF_INET, ip, &address.sin_addr );
     address.sin_port = htons( port );
+    if( bind( fd, ( struct sockaddr* )&address, sizeof( address ) ) < 0 || listen( fd, 5 ) < 0 )
+    {
+        LOG( LOG_ERR, "listen on admin address %s:%d failed: %s", ip, port, strerror( errno ) );
+        close( fd );
+        return -1;
+    }
+    LOG( LOG_INFO, "stats page on %s:%d", ip, port );
+    return fd;
+}
+
+// 读取并解析配置文件，balance_srv是负载均衡服务器，logical_srv是逻辑服务器
+static bool load_config( const char* file, vector< host >& balance_srv, vector< host >& logical_srv, bool startup )
+{
+    int cfg_fd = open( file, O_RDONLY );
+    if( cfg_fd < 0 )
+    {
+        LOG( LOG_ERR, "read config file met error: %s", strerror( errno ) );
+        return false;
+    }
+    struct stat ret_stat;
+    if( fstat( cfg_fd, &ret_stat ) < 0 )
+    {
+        LOG( LOG_ERR, "read config file met error: %s", strerror( errno ) );
+        close( cfg_fd );
+        return false;
+    }
+    // buf用于存储配置文件的信息
+    char* buf = new char [ret_stat.st_size + 1];
+    memset( buf, '\0', ret_stat.st_size + 1 );
+    ssize_t read_sz = read( cfg_fd, buf, ret_stat.st_size );
+    close( cfg_fd );
+    if ( read_sz < 0 )
+    {
+        LOG( LOG_ERR, "read config file met error: %s", strerror( errno ) );
+        delete [] buf;
+        return false;
+    }
+    bool ret = parse_config( buf, balance_srv, logical_srv, startup );
+    delete [] buf;
+    return ret;
+}
 
-    ret = bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) );
-    assert( ret != -1 );
+// 收到SIGHUP时由父进程调用，重新读取配置文件中的逻辑主机，进程池再把结果交给子进程。
+// 监听地址、子进程数量等配置项的变化需要重启才能生效
+static bool reload_config( vector< host >& logical_srv )
+{
+    vector< host > balance_srv;
+    logical_srv.clear();
+    return load_config( cfg_file, balance_srv, logical_srv, false );
+}
 
-    ret = listen( listenfd, 5 );
-    assert( ret != -1 );
+static void usage( const char* prog )
+{
+    LOG( LOG_INFO, "usage: %s [-h] [-v] [-f config_file]", prog );
+}
+
+int main( int argc, char* argv[] )
+{
+    memset( cfg_file, '\0', sizeof( cfg_file ) );
+    int option;
+    while ( ( option = getopt( argc, argv, "f:xvh" ) ) != -1 )
+    {
+        switch ( option )
+        {
+            case 'x':
+            {
+                set_loglevel( LOG_DEBUG );
+                break;
+            }
+            case 'v':
+            {
+                LOG( LOG_INFO, "%s %s", argv[0], version );
+                return 0;
+            }
+            case 'h':
+            {
+                usage( basename( argv[ 0 ] ) );
+                return 0;
+            }
+            case 'f':
+            {
+                memcpy( cfg_file, optarg, strlen( optarg ) );
+                break;
+            }
+            case '?':
+            {
+                LOG( LOG_ERR, "un-recognized option %c", option );
+                usage( basename( argv[ 0 ] ) );
+                return 1;
+            }
+        }
+    }    
+
+    if( cfg_file[0] == '\0' )
+    {
+        LOG( LOG_ERR, "%s", "please specifiy the config file" );
+        return 1;
+    }
+    vector< host > balance_srv; // 负载均衡服务器
+    vector< host > logical_srv; // 逻辑服务器
+    if( !load_config( cfg_file, balance_srv, logical_srv, true ) )
+    {
+        return 1;
+    }
+    mgr::set_http_mode( http_mode );
+    mgr::set_timeouts( clt_idle_timeout > 0 ? clt_idle_timeout : 0, clt_lifetime > 0 ? clt_lifetime : 0 );
+    // 每个子进程都和所有逻辑主机建立连接池，逻辑主机的<weight>只在子进程内部选择逻辑主机时使用，
+    // 不影响父进程把连接分给哪个子进程：子进程之间是对等的，父进程的负载均衡策略使用相同的权重，wrr因此就是简单轮询。
+    // chash策略把同一个客户端固定到同一个子进程上，子进程再按客户端IP选择逻辑主机，客户才总是落到同一个逻辑主机上
+    if( workers <= 0 )
+    {
+        workers = logical_srv.size();
+    }
+    if( workers > 16 )
+    {
+        workers = 16;
+    }
+    vector< int > weights( workers, 1 );
+    lb_policy* policy = lb_policy::create( policy_name, weights );
+    if( !policy )
+    {
+        LOG( LOG_ERR, "unknown balance policy %s", policy_name );
+        return 1;
+    }
+    mgr::set_sticky( strcmp( policy_name, "chash" ) == 0 );
+
+    const char* ip = balance_srv[0].m_hostname;
+    int port = balance_srv[0].m_port;
+
+    // 平滑升级：由旧的主进程（收到SIGUSR2时）启动，监听socket通过UNIX域socket从旧的主进程接收，不再重新绑定
+    // SO_REUSEPORT模式下旧的主进程按reuseport组中的顺序发来所有的监听socket，第一个之外的交给进程池
+    int listenfd = -1;
+    int ready_fd = -1;
+    vector< int > inherited;
+    const char* upgrade = getenv( UPGRADE_ENV );
+    if( upgrade )
+    {
+        ready_fd = atoi( upgrade );
+        unsetenv( UPGRADE_ENV );
+        int fd = -1;
+        while( ( recv_fd( ready_fd, &fd ) > 0 ) && ( fd >= 0 ) )
+        {
+            if( listenfd < 0 )
+            {
+                listenfd = fd;
+            }
+            else
+            {
+                inherited.push_back( fd );
+            }
+        }
+        if( listenfd < 0 )
+        {
+            LOG( LOG_ERR, "%s", "receive listen socket from old master failed" );
+            return 1;
+        }
+        LOG( LOG_INFO, "take over %d listen sockets from old master", 1 + ( int )inherited.size() );
+    }
+    else
+    {
+        listenfd = socket( PF_INET, SOCK_STREAM, 0 );
+        assert( listenfd >= 0 );
+ 
+        int ret = 0;
+        if( accept_mode != ACCEPT_DISPATCH )
+        {
+            int reuse = 1;
+            ret = setsockopt( listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof( reuse ) );
+            assert( ret != -1 );
+        }
+
+        struct sockaddr_in address;
+        bzero( &address, sizeof( address ) );
+        address.sin_family = AF_INET;
+        inet_pton( AF_INET, ip, &address.sin_addr );
+        address.sin_port = htons( port );
+
+        ret = bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) );
+        assert( ret != -1 );
+
+        ret = listen( listenfd, SOMAXCONN );
+        assert( ret != -1 );
+    }
+
+    //统计页面的socket只由父进程使用，在fork之前创建，子进程中由进程池关闭
+    int admin_fd = ( admin_ip[0] != '\0' ) ? open_admin( admin_ip, admin_port ) : -1;
 
     //memset( cfg_host.m_hostname, '\0', 1024 );
     //memcpy( cfg_host.m_hostname, "127.0.0.1", strlen( "127.0.0.1" ) );
     //cfg_host.m_port = 54321;
     //cfg_host.m_conncnt = 5;
-    processpool< conn, host, mgr >* pool = processpool< conn, host, mgr >::create( listenfd, logical_srv.size() );
+    processpool< conn, host, mgr >* pool = processpool< conn, host, mgr >::create( listenfd, workers, accept_mode, inherited );
     if( pool )
     {
+        pool->set_policy( policy );
+        pool->set_reload( reload_config );
+        pool->set_upgrade( argv );
+        if( ready_fd != -1 )
+        {
+            pool->set_ready_fd( ready_fd );
+        }
+        if( accept_batch > 0 )
+        {
+            pool->set_accept_batch( accept_batch );
+        }
+        if( admin_fd != -1 )
+        {
+            pool->set_admin_fd( admin_fd );
+        }
         pool->run( logical_srv );
         delete pool;
     }
@@ -13,14 +13,38 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <math.h>
 
 #include <exception>
 #include "log.h"
 #include "mgr.h"
-
-using std::pair;
+#include "lb_policy.h"
 
 int mgr::m_epollfd = -1;
+bool mgr::m_http_mode = false;
+bool mgr::m_sticky = false;
+int mgr::m_clt_idle_timeout = 0;
+int mgr::m_clt_lifetime = 0;
+
+// 单调时钟的当前时间（毫秒），用于连接超时和重试退避的计算
+static long long get_cur_ms()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( long long )ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// 同上（微秒），用于统计连接时间
+static long long get_cur_us()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( long long )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 与chapter9中的unblock_connect相同：connect返回0或者errno为EINPROGRESS都表示连接已发起，
+// 连接的结果等sockfd可写时再通过SO_ERROR获取，因此这里不会阻塞整个子进程的事件循环
 int mgr::conn2srv( const sockaddr_in& address )
 {
     int sockfd = socket( PF_INET, SOCK_STREAM, 0 );
@@ -28,8 +52,9 @@ int mgr::conn2srv( const sockaddr_in& address )
     {
         return -1;
     }
+    setnonblocking( sockfd );
 
-    if ( connect( sockfd, ( struct sockaddr* )&address, sizeof( address ) ) != 0  )
+    if ( connect( sockfd, ( struct sockaddr* )&address, sizeof( address ) ) != 0 && errno != EINPROGRESS )
     {
         close( sockfd );
         return -1;
@@ -37,277 +62,1283 @@ int mgr::conn2srv( const sockaddr_in& address )
     return sockfd;
 }
 
-mgr::mgr( int epollfd, const host& srv ) : m_logic_srv( srv )
+void conn_list::push_back( conn* connection )
+{
+    connection->m_prev = m_tail;
+    connection->m_next = NULL;
+    if( m_tail )
+    {
+        m_tail->m_next = connection;
+    }
+    else
+    {
+        m_head = connection;
+    }
+    m_tail = connection;
+    ++m_size;
+}
+
+conn* conn_list::pop_front()
+{
+    conn* connection = m_head;
+    if( connection )
+    {
+        remove( connection );
+    }
+    return connection;
+}
+
+void conn_list::remove( conn* connection )
+{
+    if( connection->m_prev )
+    {
+        connection->m_prev->m_next = connection->m_next;
+    }
+    else
+    {
+        m_head = connection->m_next;
+    }
+    if( connection->m_next )
+    {
+        connection->m_next->m_prev = connection->m_prev;
+    }
+    else
+    {
+        m_tail = connection->m_prev;
+    }
+    connection->m_prev = NULL;
+    connection->m_next = NULL;
+    --m_size;
+}
+
+mgr::mgr( int epollfd, const vector< host >& srvs, child_shm* stats ) : m_wheel( get_cur_ms() ), m_now( get_cur_ms() ),
+    m_now_us( get_cur_us() ), m_stats( stats ), m_own_stats( false ), m_used_cnt( 0 ), m_free_sessions( NULL ), m_wait_head( 0 ), m_wait_cnt( 0 ),
+    m_pool_hits( 0 ), m_pool_waits( 0 ), m_wait_timeouts( 0 ), m_wait_ms( 0 )
 {
     m_epollfd = epollfd;
-    int ret = 0;
-    struct sockaddr_in address;
+    //逻辑主机的地址会作为健康检查socket的data.ptr注册到epoll中，因此数组一次分配好，重新加载配置时不移动
+    m_backend_cnt = 0;
+    m_backends = new backend[ MAX_BACKENDS ];
+    m_waiters = new waiter[ MAX_WAITERS ];
+    if( !m_stats )
+    {
+        m_stats = new child_shm;
+        m_own_stats = true;
+    }
+    memset( m_stats, 0, sizeof( child_shm ) );
+
+    for( int idx = 0; idx < ( int )srvs.size(); ++idx )
+    {
+        add_backend( srvs[idx] );
+    }
+    if( m_http_mode )
+    {
+        grow_sessions();
+    }
+}
+
+void mgr::set_host( backend* srv, const host& cfg )
+{
+    srv->m_host = cfg;
+    if( srv->m_host.m_weight <= 0 )
+    {
+        srv->m_host.m_weight = 1;
+    }
+    if( srv->m_host.m_max_conns < srv->m_host.m_conncnt )
+    {
+        srv->m_host.m_max_conns = srv->m_host.m_conncnt;
+    }
+}
+
+void mgr::fill_pool( int idx )
+{
+    backend* srv = &m_backends[idx];
+    while( srv->m_total < srv->m_host.m_conncnt )
+    {
+        conn* tmp = new_conn( idx );
+        if( !tmp )
+        {
+            break;
+        }
+        start_connect( tmp );
+    }
+}
+
+bool mgr::add_backend( const host& cfg )
+{
+    //优先复用已经删除并且连接都已关闭的逻辑主机的位置
+    int idx = 0;
+    while( idx < m_backend_cnt && m_backends[idx].m_slab )
+    {
+        ++idx;
+    }
+    if( idx == MAX_BACKENDS )
+    {
+        LOG( LOG_ERR, "too many logical srvs, ignore %s:%d", cfg.m_hostname, cfg.m_port );
+        return false;
+    }
+    if( idx == m_backend_cnt )
+    {
+        ++m_backend_cnt;
+    }
+
+    backend* srv = &m_backends[idx];
+    *srv = backend();
+    set_host( srv, cfg );
+    srv->m_stats = &m_stats->m_backends[idx];
+    memset( srv->m_stats, 0, sizeof( backend_stats ) );
+    //m_hostname是IPv4地址，远小于m_name的长度；显式截断，留出":端口"的位置
+    snprintf( srv->m_stats->m_name, sizeof( srv->m_stats->m_name ), "%.*s:%d", BACKEND_NAME_HOST_LEN, cfg.m_hostname,
+              ( unsigned short )cfg.m_port );
+    struct sockaddr_in& address = srv->m_address;
     bzero( &address, sizeof( address ) );
     address.sin_family = AF_INET;
-    inet_pton( AF_INET, srv.m_hostname, &address.sin_addr );
-    address.sin_port = htons( srv.m_port );
-    log( LOG_INFO, __FILE__, __LINE__, "logcial srv host info: (%s, %d)", srv.m_hostname, srv.m_port );
+    inet_pton( AF_INET, cfg.m_hostname, &address.sin_addr );
+    address.sin_port = htons( cfg.m_port );
+    //连接池最多扩充到m_max_conns，预先为它们准备好slab的槽位，之后扩充连接池时不再分配内存
+    srv->m_slab = new conn_slab( srv->m_host.m_buf_size, srv->m_host.m_max_conns );
+    LOG( LOG_INFO, "logcial srv host info: (%s, %d), pool size %d-%d, %d bytes per connection",
+         cfg.m_hostname, cfg.m_port, srv->m_host.m_conncnt, srv->m_host.m_max_conns, srv->m_slab->slot_size() );
+    fill_pool( idx );
+    return true;
+}
 
-    for( int i = 0; i < srv.m_conncnt; ++i )
+void mgr::reload( const vector< host >& srvs )
+{
+    //按地址把新配置中的逻辑主机和现有的逻辑主机对应起来
+    vector< bool > kept( srvs.size(), false );
+    for( int i = 0; i < m_backend_cnt; ++i )
+    {
+        backend* srv = &m_backends[i];
+        if( srv->m_draining )
+        {
+            continue;
+        }
+        int j = 0;
+        while( j < ( int )srvs.size() && ( kept[j] || srvs[j].m_port != srv->m_host.m_port
+                                          || strcmp( srvs[j].m_hostname, srv->m_host.m_hostname ) != 0 ) )
+        {
+            ++j;
+        }
+        if( j == ( int )srvs.size() )
+        {
+            drain_backend( srv );
+            continue;
+        }
+        kept[j] = true;
+        //缓冲区大小决定了slab槽位的大小，已有的逻辑主机保持不变
+        int buf_size = srv->m_host.m_buf_size;
+        set_host( srv, srvs[j] );
+        srv->m_host.m_buf_size = buf_size;
+        LOG( LOG_INFO, "logical srv %s:%d reloaded, weight %d, pool size %d-%d", srv->m_host.m_hostname, srv->m_host.m_port,
+             srv->m_host.m_weight, srv->m_host.m_conncnt, srv->m_host.m_max_conns );
+        //最小连接数增加时立即补足，减少时多余的连接由shrink_pools在空闲超时后关闭
+        fill_pool( i );
+    }
+    for( int j = 0; j < ( int )srvs.size(); ++j )
     {
-        sleep( 1 );
-        int sockfd = conn2srv( address );
-        if( sockfd < 0 )
+        if( !kept[j] )
         {
-            log( LOG_ERR, __FILE__, __LINE__, "build connection %d failed", i );
+            add_backend( srvs[j] );
+        }
+    }
+    //权重可能变了，平滑加权轮询重新开始
+    for( int i = 0; i < m_backend_cnt; ++i )
+    {
+        m_backends[i].m_current = 0;
+    }
+}
+
+void mgr::drain_backend( backend* srv )
+{
+    //不再分配客户，也不再检查和重连。空闲连接立即关闭，正在使用的连接等客户用完之后关闭
+    LOG( LOG_INFO, "logical srv %s:%d removed, drain %d connections", srv->m_host.m_hostname, srv->m_host.m_port, srv->m_total );
+    srv->m_draining = true;
+    if( srv->m_check_fd != -1 )
+    {
+        closefd( m_epollfd, srv->m_check_fd );
+        srv->m_check_fd = -1;
+    }
+    if( srv->m_total == 0 )
+    {
+        release_backend( srv );
+        return;
+    }
+    while( !srv->m_conns.empty() )
+    {
+        retire_conn( srv->m_conns.pop_front() );
+    }
+}
+
+void mgr::retire_conn( conn* connection )
+{
+    backend* srv = &m_backends[ connection->m_backend ];
+    if( connection->m_srvfd != -1 )
+    {
+        close( connection->m_srvfd );
+    }
+    srv->m_slab->free( connection );
+    if( --srv->m_total == 0 )
+    {
+        release_backend( srv );
+    }
+}
+
+void mgr::release_backend( backend* srv )
+{
+    LOG( LOG_INFO, "logical srv %s:%d drained", srv->m_host.m_hostname, srv->m_host.m_port );
+    delete srv->m_slab;
+    srv->m_slab = NULL;
+    srv->m_stats->m_name[0] = '\0';  //不再输出它的统计
+}
+
+conn* mgr::new_conn( int idx )
+{
+    backend* srv = &m_backends[idx];
+    conn* tmp = srv->m_slab->alloc();
+    if( !tmp )
+    {
+        LOG( LOG_ERR, "build connection %d failed", srv->m_total );
+        return NULL;
+    }
+    tmp->init_srv( -1, srv->m_address );
+    tmp->m_backend = idx;
+    //L7模式需要在用户空间分析请求和应答，不能使用splice
+    if( srv->m_host.m_splice && !m_http_mode && !tmp->init_splice() )
+    {
+        LOG( LOG_ERR, "connection %d use buffered relay instead of splice", srv->m_total );
+    }
+    ++srv->m_total;
+    return tmp;
+}
+
+void mgr::start_connect( conn* connection )
+{
+    int srvfd = conn2srv( connection->m_srv_address );
+    if( srvfd < 0 )
+    {
+        LOG( LOG_ERR, "connect to server failed: %s", strerror( errno ) );
+        ++m_backends[ connection->m_backend ].m_stats->m_connect_fails;
+        schedule_retry( connection );
+        return;
+    }
+    connection->init_srv( srvfd, connection->m_srv_address );
+    connection->m_connecting = true;
+    connection->m_connect_start = get_cur_us();
+    connection->m_timer.m_data = tag_ptr( connection, SRV_SIDE );
+    m_wheel.add( &connection->m_timer, get_cur_ms() + CONNECT_TIMEOUT );
+    add_write_ptr( m_epollfd, srvfd, tag_ptr( connection, SRV_SIDE ) );
+    m_connecting.push_back( connection );
+}
+
+void mgr::finish_connect( conn* connection )
+{
+    int srvfd = connection->m_srvfd;
+    m_connecting.remove( connection );
+    connection->m_connecting = false;
+    m_wheel.del( &connection->m_timer );
+
+    int error = 0;
+    socklen_t length = sizeof( error );
+    //调用getsockopt来获取并清除srvfd上的错误，错误号不为0表示连接出错
+    if( getsockopt( srvfd, SOL_SOCKET, SO_ERROR, &error, &length ) < 0 || error != 0 )
+    {
+        LOG( LOG_ERR, "connection to server failed: %s", strerror( error ) );
+        ++m_backends[ connection->m_backend ].m_stats->m_connect_fails;
+        closefd( m_epollfd, srvfd );
+        schedule_retry( connection );
+        return;
+    }
+
+    //连接成功，先从内核事件表中删除，等bind_conn时再注册可读事件
+    LOG( LOG_INFO, "build connection %d to server success", srvfd );
+    removefd( m_epollfd, srvfd );
+    connection->m_backoff = 0;
+    backend_stats* stats = m_backends[ connection->m_backend ].m_stats;
+    ++stats->m_connects;
+    stats->m_connect.record( m_now_us - connection->m_connect_start );
+    put_conn( connection );
+}
+
+void mgr::put_conn( conn* connection )
+{
+    if( m_backends[ connection->m_backend ].m_draining )
+    {
+        retire_conn( connection );
+        return;
+    }
+    long long now = get_cur_ms();
+    //有客户在排队时直接交给最早的、可以使用这个连接的客户，否则放回连接池
+    waiter tmp;
+    if( m_wait_cnt > 0 && m_backends[ connection->m_backend ].m_healthy && take_waiter( connection->m_backend, tmp ) )
+    {
+        m_wait_ms += now - tmp.m_since;
+        if( tmp.m_session )
+        {
+            bind_session( connection, tmp.m_session );
         }
         else
         {
-            log( LOG_INFO, __FILE__, __LINE__, "build connection %d to server success", i );
-            conn* tmp = NULL;
-            try
+            bind_conn( connection, tmp.m_cltfd, tmp.m_address );
+        }
+        return;
+    }
+    connection->m_idle_since = now;
+    m_backends[ connection->m_backend ].m_conns.push_back( connection );
+}
+
+void mgr::schedule_retry( conn* connection )
+{
+    if( connection->m_backoff == 0 )
+    {
+        connection->m_backoff = RETRY_BACKOFF_MIN;
+    }
+    connection->m_srvfd = -1;
+    connection->m_retry_at = get_cur_ms() + connection->m_backoff;
+    LOG( LOG_INFO, "retry connection to server in %d ms", connection->m_backoff );
+    connection->m_backoff *= 2;
+    if( connection->m_backoff > RETRY_BACKOFF_MAX )
+    {
+        connection->m_backoff = RETRY_BACKOFF_MAX;
+    }
+    m_freed.push_back( connection );
+}
+
+mgr::~mgr()
+{
+    delete [] m_waiters;
+    for( int i = 0; i < m_backend_cnt; ++i )
+    {
+        delete m_backends[i].m_slab;
+    }
+    delete [] m_backends;
+    for( int i = 0; i < ( int )m_session_chunks.size(); ++i )
+    {
+        delete [] m_session_chunks[i];
+    }
+    if( m_own_stats )
+    {
+        delete m_stats;
+    }
+}
+
+int mgr::get_used_conn_cnt()
+{
+    return m_used_cnt;
+}
+
+void mgr::get_stats( child_stats& stats )
+{
+    stats.m_active_conns = m_used_cnt;
+    stats.m_pool_depth = 0;
+    for( int i = 0; i < m_backend_cnt; ++i )
+    {
+        if( m_backends[i].m_healthy )
+        {
+            stats.m_pool_depth += m_backends[i].m_conns.size();
+        }
+    }
+    stats.m_bytes_relayed = conn::m_bytes_relayed;
+    stats.m_eagain_cnt = conn::m_eagain_cnt;
+    stats.m_waiting_clts = m_wait_cnt;
+    stats.m_pool_hits = m_pool_hits;
+    stats.m_pool_waits = m_pool_waits;
+    stats.m_wait_timeouts = m_wait_timeouts;
+    stats.m_wait_ms = m_wait_ms;
+}
+
+bool mgr::add_client( int cltfd, const sockaddr_in& client_addr )
+{
+    //L7模式下客户先不占用服务端连接，等发来请求时再分配
+    if( m_http_mode )
+    {
+        return new_session( cltfd, client_addr ) != NULL;
+    }
+
+    conn* tmp = pick_conn( client_addr );
+    if( tmp )
+    {
+        ++m_pool_hits;
+        bind_conn( tmp, cltfd, client_addr );
+        return true;
+    }
+    return enqueue_waiter( cltfd, client_addr, NULL );
+}
+
+bool mgr::enqueue_waiter( int cltfd, const sockaddr_in& client_addr, session* sess )
+{
+    //所有逻辑主机都被摘除时等待也没有意义
+    bool healthy = false;
+    for( int i = 0; i < m_backend_cnt; ++i )
+    {
+        healthy = healthy || ( m_backends[i].m_healthy && !m_backends[i].m_draining );
+    }
+    if( !healthy || m_wait_cnt == MAX_WAITERS )
+    {
+        LOG( LOG_ERR, "%s", "not enough srv connections to server" );
+        ++m_wait_timeouts;
+        return false;
+    }
+
+    //连接池为空，客户排队等待正在进行（或者新发起）的连接
+    waiter* w = &m_waiters[ ( m_wait_head + m_wait_cnt ) % MAX_WAITERS ];
+    w->m_cltfd = cltfd;
+    w->m_address = client_addr;
+    w->m_since = get_cur_ms();
+    w->m_session = sess;
+    w->m_backend = m_sticky ? sticky_backend( client_addr ) : -1;
+    ++m_wait_cnt;
+    ++m_pool_waits;
+    LOG( LOG_INFO, "client sock %d waits for srv connection, %d waiting", cltfd, m_wait_cnt );
+    grow_pool( w->m_backend );
+    return true;
+}
+
+bool mgr::take_waiter( int idx, waiter& w )
+{
+    for( int i = 0; i < m_wait_cnt; ++i )
+    {
+        waiter* cur = &m_waiters[ ( m_wait_head + i ) % MAX_WAITERS ];
+        //要等的逻辑主机已经被摘除时，任何逻辑主机的连接都可以给它
+        if( cur->m_backend != -1 && cur->m_backend != idx
+            && m_backends[ cur->m_backend ].m_healthy && !m_backends[ cur->m_backend ].m_draining )
+        {
+            continue;
+        }
+        w = *cur;
+        //把它前面的客户依次后移一位，队列仍然按开始等待的时刻排列。只有会话保持时才会跳过队首
+        for( int j = i; j > 0; --j )
+        {
+            m_waiters[ ( m_wait_head + j ) % MAX_WAITERS ] = m_waiters[ ( m_wait_head + j - 1 ) % MAX_WAITERS ];
+        }
+        m_wait_head = ( m_wait_head + 1 ) % MAX_WAITERS;
+        --m_wait_cnt;
+        return true;
+    }
+    return false;
+}
+
+int mgr::sticky_backend( const sockaddr_in& client_addr )
+{
+    //加权的最高随机权重哈希（rendezvous hashing）：每个逻辑主机对客户算出一个分数weight / -ln(u)，u是(客户, 逻辑主机)的哈希值
+    //映射到(0, 1)，选分数最高的。所有子进程用逻辑主机的地址计算，结果一致；某个逻辑主机被摘除时只有原本属于它的客户会换到别的逻辑主机
+    unsigned int key = hash32( client_addr.sin_addr.s_addr );
+    int idx = -1;
+    double best = 0;
+    for( int i = 0; i < m_backend_cnt; ++i )
+    {
+        backend* cur = &m_backends[i];
+        if( !cur->m_healthy || cur->m_draining )
+        {
+            continue;
+        }
+        unsigned int h = hash32( key ^ hash32( cur->m_address.sin_addr.s_addr ^ ( ( unsigned int )cur->m_address.sin_port << 16 ) ) );
+        double score = cur->m_host.m_weight / -log( ( h + 0.5 ) / 4294967296.0 );
+        if( idx == -1 || score > best )
+        {
+            idx = i;
+            best = score;
+        }
+    }
+    return idx;
+}
+
+conn* mgr::pick_conn( const sockaddr_in& client_addr )
+{
+    //会话保持时客户只能使用它对应的逻辑主机的连接，连接池为空就排队等待
+    if( m_sticky )
+    {
+        int idx = sticky_backend( client_addr );
+        return ( idx == -1 ) ? NULL : m_backends[idx].m_conns.pop_front();
+    }
+    //在健康且有空闲连接的逻辑主机之间做平滑加权轮询
+    backend* srv = NULL;
+    int total = 0;
+    for( int i = 0; i < m_backend_cnt; ++i )
+    {
+        backend* cur = &m_backends[i];
+        if( !cur->m_healthy || cur->m_conns.empty() )
+        {
+            continue;
+        }
+        cur->m_current += cur->m_host.m_weight;
+        total += cur->m_host.m_weight;
+        if( !srv || cur->m_current > srv->m_current )
+        {
+            srv = cur;
+        }
+    }
+    if( !srv )
+    {
+        return NULL;
+    }
+    srv->m_current -= total;
+    return srv->m_conns.pop_front();
+}
+
+void mgr::bind_conn( conn* connection, int cltfd, const sockaddr_in& client_addr )
+{
+    int srvfd = connection->m_srvfd;
+    ++m_used_cnt;
+    connection->init_clt( cltfd, client_addr );
+    add_read_ptr( m_epollfd, cltfd, tag_ptr( connection, CLT_SIDE ) );
+    add_read_ptr( m_epollfd, srvfd, tag_ptr( connection, SRV_SIDE ) );
+    connection->m_clt_events = EPOLLIN;
+    connection->m_srv_events = EPOLLIN;
+    connection->m_bound_at = m_now_us;
+    connection->m_last_active = m_now;
+    connection->m_timer.m_data = tag_ptr( connection, CLT_SIDE );
+    arm_client( &connection->m_timer, m_now, m_now );
+    ++m_backends[ connection->m_backend ].m_stats->m_clients;
+    LOG( LOG_INFO, "bind client sock %d with server sock %d", cltfd, srvfd );
+}
+
+void mgr::grow_pool( int want )
+{
+    int idx = -1;
+    if( want != -1 && m_backends[want].m_healthy && !m_backends[want].m_draining )
+    {
+        //会话保持的客户只能等它对应的逻辑主机：等它的每个客户对应一个正在向它进行的连接，已经足够或者达到最大连接数时不再扩充
+        int waiting = 0;
+        int connecting = 0;
+        for( int i = 0; i < m_wait_cnt; ++i )
+        {
+            waiting += ( m_waiters[ ( m_wait_head + i ) % MAX_WAITERS ].m_backend == want );
+        }
+        for( conn* cur = m_connecting.front(); cur; cur = cur->m_next )
+        {
+            connecting += ( cur->m_backend == want );
+        }
+        if( connecting >= waiting || m_backends[want].m_total >= m_backends[want].m_host.m_max_conns )
+        {
+            return;
+        }
+        idx = want;
+    }
+    else
+    {
+        //每个排队的客户对应一个正在进行的连接，已经足够时不再扩充
+        if( m_connecting.size() >= m_wait_cnt )
+        {
+            return;
+        }
+        //在健康且未达到最大连接数的逻辑主机中，选择连接总数与权重之比最小的一个
+        for( int i = 0; i < m_backend_cnt; ++i )
+        {
+            backend* cur = &m_backends[i];
+            if( !cur->m_healthy || cur->m_draining || cur->m_total >= cur->m_host.m_max_conns )
             {
-                tmp = new conn;
+                continue;
             }
-            catch( ... )
+            if( idx == -1 || ( long long )cur->m_total * m_backends[idx].m_host.m_weight
+                             < ( long long )m_backends[idx].m_total * cur->m_host.m_weight )
             {
-                close( sockfd );
-                continue;
+                idx = i;
             }
-            tmp->init_srv( sockfd, address );
-            m_conns.insert( pair< int, conn* >( sockfd, tmp ) );
         }
     }
+    if( idx == -1 )
+    {
+        return;
+    }
+    conn* tmp = new_conn( idx );
+    if( tmp )
+    {
+        LOG( LOG_INFO, "grow pool of %s:%d to %d connections",
+             m_backends[idx].m_host.m_hostname, m_backends[idx].m_host.m_port, m_backends[idx].m_total );
+        start_connect( tmp );
+    }
 }
 
-mgr::~mgr()
+void mgr::expire_waiters( long long now )
 {
+    while( m_wait_cnt > 0 && m_waiters[ m_wait_head ].m_since + WAIT_TIMEOUT <= now )
+    {
+        waiter* tmp = &m_waiters[ m_wait_head ];
+        LOG( LOG_ERR, "client sock %d wait for srv connection timeout", tmp->m_cltfd );
+        if( tmp->m_session )
+        {
+            close_session( tmp->m_session );
+        }
+        else
+        {
+            close( tmp->m_cltfd );
+        }
+        m_wait_head = ( m_wait_head + 1 ) % MAX_WAITERS;
+        --m_wait_cnt;
+        ++m_wait_timeouts;
+    }
 }
 
-int mgr::get_used_conn_cnt()
+void mgr::arm_client( tw_timer* timer, long long since, long long last_active )
 {
-    return m_used.size();
+    long long deadline = -1;
+    if( m_clt_idle_timeout > 0 )
+    {
+        deadline = last_active + m_clt_idle_timeout;
+    }
+    if( m_clt_lifetime > 0 && ( deadline < 0 || since + m_clt_lifetime < deadline ) )
+    {
+        deadline = since + m_clt_lifetime;
+    }
+    if( deadline >= 0 )
+    {
+        m_wheel.add( timer, deadline );
+    }
 }
 
-conn* mgr::pick_conn( int cltfd  )
+void mgr::expire_timers( long long now )
 {
-    if( m_conns.empty() )
+    tw_timer* timer = NULL;
+    while( ( timer = m_wheel.expire( now ) ) )
     {
-        log( LOG_ERR, __FILE__, __LINE__, "%s", "not enough srv connections to server" );
-        return NULL;
+        //与epoll_event.data.ptr相同，定时器中保存的是带标记的指针：SRV_SIDE是连接超时，CLT_SIDE和SESSION_SIDE是客户超时
+        if( ptr_side( timer->m_data ) == SRV_SIDE )
+        {
+            conn* tmp = ( conn* )untag_ptr( timer->m_data );
+            LOG( LOG_ERR, "connection %d to server timeout", tmp->m_srvfd );
+            ++m_backends[ tmp->m_backend ].m_stats->m_connect_fails;
+            m_connecting.remove( tmp );
+            tmp->m_connecting = false;
+            closefd( m_epollfd, tmp->m_srvfd );
+            schedule_retry( tmp );
+            continue;
+        }
+        expire_client( timer->m_data, now );
     }
+}
 
-    map< int, conn* >::iterator iter =  m_conns.begin();
-    int srvfd = iter->first;
-    conn* tmp = iter->second;
-    if( !tmp )
+void mgr::expire_client( void* tagged, long long now )
+{
+    conn* connection = NULL;
+    session* sess = NULL;
+    long long since = 0;
+    long long last_active = 0;
+    if( ptr_side( tagged ) == SESSION_SIDE )
     {
-        log( LOG_ERR, __FILE__, __LINE__, "%s", "empty server connection object" );
-        return NULL;
+        sess = ( session* )untag_ptr( tagged );
+        connection = sess->m_conn;
+        since = sess->m_since;
+        last_active = ( connection && connection->m_last_active > sess->m_last_active ) ? connection->m_last_active : sess->m_last_active;
+        //排队等待服务端连接的客户由expire_waiters处理，等待结束后再检查
+        if( !connection && sess->m_events == 0 )
+        {
+            m_wheel.add( &sess->m_timer, now + WAIT_TIMEOUT );
+            return;
+        }
+    }
+    else
+    {
+        connection = ( conn* )untag_ptr( tagged );
+        since = connection->m_bound_at / 1000;
+        last_active = connection->m_last_active;
+    }
+
+    //期间有过活动，按新的时刻重新加入时间轮
+    tw_timer* timer = sess ? &sess->m_timer : &connection->m_timer;
+    bool idle = m_clt_idle_timeout > 0 && last_active + m_clt_idle_timeout <= now;
+    bool expired = m_clt_lifetime > 0 && since + m_clt_lifetime <= now;
+    if( !idle && !expired )
+    {
+        arm_client( timer, since, last_active );
+        return;
+    }
+    LOG( LOG_INFO, "client sock %d %s, close it", sess ? sess->m_cltfd : connection->m_cltfd,
+         idle ? "idle timeout" : "exceeds lifetime" );
+    if( connection )
+    {
+        free_conn( connection );
+    }
+    else
+    {
+        close_session( sess );
+    }
+}
+
+void mgr::shrink_pools( long long now )
+{
+    for( int i = 0; i < m_backend_cnt; ++i )
+    {
+        backend* srv = &m_backends[i];
+        conn* tmp = NULL;
+        while( ( srv->m_total > srv->m_host.m_conncnt ) && ( tmp = srv->m_conns.front() )
+               && ( tmp->m_idle_since + srv->m_host.m_idle_timeout <= now ) )
+        {
+            srv->m_conns.remove( tmp );
+            close( tmp->m_srvfd );
+            srv->m_slab->free( tmp );
+            --srv->m_total;
+            LOG( LOG_INFO, "shrink pool of %s:%d to %d connections",
+                 srv->m_host.m_hostname, srv->m_host.m_port, srv->m_total );
+        }
     }
-    m_conns.erase( iter );
-    m_used.insert( pair< int, conn* >( cltfd, tmp ) );
-    m_used.insert( pair< int, conn* >( srvfd, tmp ) );
-    add_read_fd( m_epollfd, cltfd );
-    add_read_fd( m_epollfd, srvfd );
-    log( LOG_INFO, __FILE__, __LINE__, "bind client sock %d with server sock %d", cltfd, srvfd );
-    return tmp;
 }
 
 void mgr::free_conn( conn* connection )
 {
     int cltfd = connection->m_cltfd;
     int srvfd = connection->m_srvfd;
-    closefd( m_epollfd, cltfd );
+    m_backends[ connection->m_backend ].m_stats->m_duration.record( m_now_us - connection->m_bound_at );
+    if( connection->m_session )
+    {
+        close_session( connection->m_session );
+    }
+    else
+    {
+        closefd( m_epollfd, cltfd );
+        --m_used_cnt;
+    }
     closefd( m_epollfd, srvfd );
-    m_used.erase( cltfd );
-    m_used.erase( srvfd );
+    m_wheel.del( &connection->m_timer );
+    connection->reset();
+    connection->m_srvfd = -1;
+    connection->m_retry_at = get_cur_ms();  //同服务端的连接是我们主动关闭的，立即重连
+    m_freed.push_back( connection );
+}
+
+bool mgr::grow_sessions()
+{
+    session* chunk = NULL;
+    try
+    {
+        chunk = new session[ SESSION_CHUNK ];
+        m_session_chunks.push_back( chunk );
+    }
+    catch( ... )
+    {
+        delete [] chunk;
+        LOG( LOG_ERR, "%s", "build session failed" );
+        return false;
+    }
+    for( int i = SESSION_CHUNK - 1; i >= 0; --i )
+    {
+        chunk[i].m_cltfd = -1;
+        chunk[i].m_next = m_free_sessions;
+        m_free_sessions = &chunk[i];
+    }
+    return true;
+}
+
+session* mgr::new_session( int cltfd, const sockaddr_in& client_addr )
+{
+    //空闲链表在L7模式下启动时就准备好了，用完时再成批分配
+    if( !m_free_sessions && !grow_sessions() )
+    {
+        return NULL;
+    }
+    session* sess = m_free_sessions;
+    m_free_sessions = sess->m_next;
+    sess->m_cltfd = cltfd;
+    sess->m_address = client_addr;
+    sess->m_conn = NULL;
+    sess->m_events = EPOLLIN;
+    sess->m_next = NULL;
+    sess->m_since = m_now;
+    sess->m_last_active = m_now;
+    sess->m_timer.m_data = tag_ptr( sess, SESSION_SIDE );
+    arm_client( &sess->m_timer, sess->m_since, sess->m_last_active );
+    ++m_used_cnt;
+    add_read_ptr( m_epollfd, cltfd, tag_ptr( sess, SESSION_SIDE ) );
+    return sess;
+}
+
+void mgr::close_session( session* sess )
+{
+    closefd( m_epollfd, sess->m_cltfd );
+    m_wheel.del( &sess->m_timer );
+    sess->m_cltfd = -1;
+    sess->m_conn = NULL;
+    sess->m_next = m_free_sessions;
+    m_free_sessions = sess;
+    --m_used_cnt;
+}
+
+void mgr::bind_session( conn* connection, session* sess )
+{
+    connection->init_clt( sess->m_cltfd, sess->m_address );
+    connection->m_session = sess;
+    connection->m_last_active = m_now;
+    connection->m_bound_at = m_now_us;
+    ++m_backends[ connection->m_backend ].m_stats->m_clients;
+    sess->m_conn = connection;
+    add_read_ptr( m_epollfd, connection->m_srvfd, tag_ptr( connection, SRV_SIDE ) );
+    connection->m_srv_events = EPOLLIN;
+    connection->m_clt_events = sess->m_events;
+    //排队时客户端不关注任何事件，现在重新关注可读事件，已经到达的请求会再次通知
+    if( connection->m_clt_events != EPOLLIN )
+    {
+        modconn( connection, CLT_SIDE, EPOLLIN );
+        connection->m_clt_events = EPOLLIN;
+    }
+    LOG( LOG_DEBUG, "client sock %d borrows server sock %d", sess->m_cltfd, connection->m_srvfd );
+}
+
+RET_CODE mgr::start_request( session* sess )
+{
+    sess->m_last_active = m_now;
+    conn* tmp = pick_conn( sess->m_address );
+    if( tmp )
+    {
+        ++m_pool_hits;
+        bind_session( tmp, sess );
+        return relay( tmp, CLT_SIDE, READ );
+    }
+    if( !enqueue_waiter( sess->m_cltfd, sess->m_address, sess ) )
+    {
+        close_session( sess );
+        return CLOSED;
+    }
+    //等待期间请求留在内核的接收缓冲区中，不再关注客户端的事件
+    modptr( m_epollfd, sess->m_cltfd, tag_ptr( sess, SESSION_SIDE ), 0 );
+    sess->m_events = 0;
+    return OK;
+}
+
+RET_CODE mgr::release_conn( conn* connection )
+{
+    session* sess = connection->m_session;
+    int srvfd = connection->m_srvfd;
+    bool reusable = connection->m_reusable && !connection->m_srv_closed;
+    bool clt_close = connection->m_clt_close;
+    sess->m_conn = NULL;
+    sess->m_events = connection->m_clt_events;
+    sess->m_last_active = connection->m_last_active;
+    m_backends[ connection->m_backend ].m_stats->m_duration.record( m_now_us - connection->m_bound_at );
+    removefd( m_epollfd, srvfd );
     connection->reset();
-    m_freed.insert( pair< int, conn* >( srvfd, connection ) );
+    LOG( LOG_DEBUG, "client sock %d returns server sock %d", sess->m_cltfd, srvfd );
+    if( reusable )
+    {
+        put_conn( connection );
+    }
+    else
+    {
+        //服务端不保持连接，关闭后立即重连
+        close( srvfd );
+        connection->m_srvfd = -1;
+        connection->m_retry_at = get_cur_ms();
+        m_freed.push_back( connection );
+    }
+
+    if( clt_close )
+    {
+        close_session( sess );
+        return CLOSED;
+    }
+    if( sess->m_events != EPOLLIN )
+    {
+        modptr( m_epollfd, sess->m_cltfd, tag_ptr( sess, SESSION_SIDE ), EPOLLIN );
+        sess->m_events = EPOLLIN;
+    }
+    return OK;
 }
 
 void mgr::recycle_conns()
 {
-    if( m_freed.empty() )
+    long long now = get_cur_ms();
+    expire_timers( now );
+
+    //重试时间已到的连接重新发起连接，start_connect失败时会再次放到m_freed的末尾，其重试时间一定晚于now
+    conn* next = NULL;
+    for( conn* tmp = m_freed.front(); tmp; tmp = next )
+    {
+        next = tmp->m_next;
+        //所属逻辑主机已经从配置中删除，不再重连
+        if( m_backends[ tmp->m_backend ].m_draining )
+        {
+            m_freed.remove( tmp );
+            retire_conn( tmp );
+            continue;
+        }
+        if( ( tmp->m_retry_at > now ) || !m_backends[ tmp->m_backend ].m_healthy )
+        {
+            continue;
+        }
+        m_freed.remove( tmp );
+        start_connect( tmp );
+    }
+
+    expire_waiters( now );
+    shrink_pools( now );
+    check_backends( now );
+}
+
+void mgr::check_backends( long long now )
+{
+    for( int i = 0; i < m_backend_cnt; ++i )
     {
+        backend* srv = &m_backends[i];
+        if( srv->m_draining )
+        {
+            continue;
+        }
+        if( srv->m_check_fd != -1 )
+        {
+            if( srv->m_check_deadline <= now )
+            {
+                LOG( LOG_ERR, "health check of %s:%d timeout", srv->m_host.m_hostname, srv->m_host.m_port );
+                finish_check( srv, false );
+            }
+        }
+        else if( srv->m_next_check <= now )
+        {
+            start_check( srv );
+        }
+    }
+}
+
+void mgr::start_check( backend* srv )
+{
+    int sockfd = conn2srv( srv->m_address );
+    if( sockfd < 0 )
+    {
+        finish_check( srv, false );
         return;
     }
-    for( map< int, conn* >::iterator iter = m_freed.begin(); iter != m_freed.end(); iter++ )
+    srv->m_check_fd = sockfd;
+    srv->m_check_connected = false;
+    srv->m_check_deadline = get_cur_ms() + CHECK_TIMEOUT;
+    add_write_ptr( m_epollfd, sockfd, tag_ptr( srv, CHECK_SIDE ) );
+}
+
+void mgr::process_check( backend* srv )
+{
+    if( srv->m_check_fd == -1 )
     {
-        sleep( 1 );
-        int srvfd = iter->first;
-        conn* tmp = iter->second;
-        srvfd = conn2srv( tmp->m_srv_address );
-        if( srvfd < 0 )
+        return;
+    }
+    if( !srv->m_check_connected )
+    {
+        int error = 0;
+        socklen_t length = sizeof( error );
+        if( getsockopt( srv->m_check_fd, SOL_SOCKET, SO_ERROR, &error, &length ) < 0 || error != 0 )
         {
-            log( LOG_ERR, __FILE__, __LINE__, "%s", "fix connection failed");
+            finish_check( srv, false );
+            return;
         }
-        else
+        //只做TCP检查时连接成功就算健康
+        if( srv->m_host.m_http_check[0] == '\0' )
+        {
+            finish_check( srv, true );
+            return;
+        }
+        char request[ 512 ];
+        int len = snprintf( request, sizeof( request ), "GET %s HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                            srv->m_host.m_http_check, srv->m_host.m_hostname );
+        if( send( srv->m_check_fd, request, len, 0 ) != len )
         {
-            log( LOG_INFO, __FILE__, __LINE__, "%s", "fix connection success" );
-            tmp->init_srv( srvfd, tmp->m_srv_address );
-            m_conns.insert( pair< int, conn* >( srvfd, tmp ) );
+            finish_check( srv, false );
+            return;
         }
+        srv->m_check_connected = true;
+        modptr( m_epollfd, srv->m_check_fd, tag_ptr( srv, CHECK_SIDE ), EPOLLIN );
+        return;
     }
-    m_freed.clear();
+
+    //状态行形如"HTTP/1.1 200 OK"，2xx和3xx视为健康
+    char status[ 16 ];
+    int ret = recv( srv->m_check_fd, status, sizeof( status ), MSG_PEEK );
+    if( ret < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+    {
+        return;
+    }
+    if( ret <= 0 )
+    {
+        //对端在发来完整的状态行之前关闭或者出错，视为检查失败
+        finish_check( srv, false );
+        return;
+    }
+    if( ret < 12 )
+    {
+        //状态行可能分成几个报文段到达，已经到达的部分没有问题时等待后面的数据（MSG_PEEK没有取走数据，
+        //新的数据到达时还会通知），对端一直不发完由检查超时处理
+        if( strncmp( status, "HTTP/1.", ret < 7 ? ret : 7 ) != 0 )
+        {
+            finish_check( srv, false );
+        }
+        return;
+    }
+    finish_check( srv, ( strncmp( status, "HTTP/1.", 7 ) == 0 ) && ( status[9] == '2' || status[9] == '3' ) );
 }
 
-RET_CODE mgr::process( int fd, OP_TYPE type )
+void mgr::finish_check( backend* srv, bool ok )
 {
-    //首先根据fd获取连接类，该类中保存有相对应的客户端和服务端的fd
-    conn* connection = m_used[ fd ];
-    if( !connection )
+    if( srv->m_check_fd != -1 )
     {
-        return NOTHING;
+        closefd( m_epollfd, srv->m_check_fd );
+        srv->m_check_fd = -1;
+    }
+    srv->m_next_check = get_cur_ms() + CHECK_INTERVAL;
+    if( ok )
+    {
+        srv->m_fails = 0;
+        ++srv->m_passes;
     }
-    if( connection->m_cltfd == fd ) //如果是客户端fd
+    else
     {
-        int srvfd = connection->m_srvfd;
-        switch( type )
+        srv->m_passes = 0;
+        ++srv->m_fails;
+    }
+
+    if( srv->m_healthy && srv->m_fails >= CHECK_FALL )
+    {
+        //摘除：空闲连接很可能已经失效，关闭后放入m_freed，在恢复之前不再重连
+        LOG( LOG_ERR, "logical srv %s:%d is down, eject it", srv->m_host.m_hostname, srv->m_host.m_port );
+        srv->m_healthy = false;
+        while( !srv->m_conns.empty() )
         {
-            case READ:  //读操作
-            {
-                RET_CODE res = connection->read_clt();  //则调用conn的read_ckt方法
-                switch( res )
-                {
-                    case OK:
-                    {
-                        log( LOG_DEBUG, __FILE__, __LINE__, "content read from client: %s", connection->m_clt_buf );
-                    }
-                    case BUFFER_FULL:
-                    {
-                        modfd( m_epollfd, srvfd, EPOLLOUT );
-                        break;
-                    }
-                    case IOERR:
-                    case CLOSED:    //客户端关闭连接
-                    {
-                        free_conn( connection );
-                        return CLOSED;
-                    }
-                    default:
-                        break;
-                }
-                if( connection->m_srv_closed )  //服务端关闭连接
-                {
-                    free_conn( connection );
-                    return CLOSED;
-                }
-                break;
-            }
-            case WRITE:
-            {
-                RET_CODE res = connection->write_clt();
-                switch( res )
-                {
-                    case TRY_AGAIN:
-                    {
-                        modfd( m_epollfd, fd, EPOLLOUT );
-                        break;
-                    }
-                    case BUFFER_EMPTY:
-                    {
-                        modfd( m_epollfd, srvfd, EPOLLIN );
-                        modfd( m_epollfd, fd, EPOLLIN );
-                        break;
-                    }
-                    case IOERR:
-                    case CLOSED:
-                    {
-                        free_conn( connection );
-                        return CLOSED;
-                    }
-                    default:
-                        break;
-                }
-                if( connection->m_srv_closed )
-                {
-                    free_conn( connection );
-                    return CLOSED;
-                }
-                break;
-            }
-            default:
-            {
-                log( LOG_ERR, __FILE__, __LINE__, "%s", "other operation not support yet" );
-                break;
-            }
+            conn* tmp = srv->m_conns.pop_front();
+            close( tmp->m_srvfd );
+            tmp->m_srvfd = -1;
+            tmp->m_backoff = 0;
+            m_freed.push_back( tmp );
         }
     }
-    else if( connection->m_srvfd == fd )    //如果是服务端fd
+    else if( !srv->m_healthy && srv->m_passes >= CHECK_RISE )
     {
-        int cltfd = connection->m_cltfd;
-        switch( type )
+        //恢复：暂停重连的连接立即重连
+        LOG( LOG_INFO, "logical srv %s:%d is up again", srv->m_host.m_hostname, srv->m_host.m_port );
+        srv->m_healthy = true;
+        long long now = get_cur_ms();
+        for( conn* tmp = m_freed.front(); tmp; tmp = tmp->m_next )
         {
-            case READ:
+            if( &m_backends[ tmp->m_backend ] == srv )
             {
-                RET_CODE res = connection->read_srv();
-                switch( res )
-                {
-                    case OK:
-                    {
-                        log( LOG_DEBUG, __FILE__, __LINE__, "content read from server: %s", connection->m_srv_buf );
-                    }
-                    case BUFFER_FULL:
-                    {
-                        modfd( m_epollfd, cltfd, EPOLLOUT );
-                        break;
-                    }
-                    case IOERR:
-                    case CLOSED:
-                    {
-                        modfd( m_epollfd, cltfd, EPOLLOUT );
-                        connection->m_srv_closed = true;
-                        break;
-                    }
-                    default:
-                        break;
-                }
-                break;
-            }
-            case WRITE:
-            {
-                RET_CODE res = connection->write_srv();
-                switch( res )
-                {
-                    case TRY_AGAIN:
-                    {
-                        modfd( m_epollfd, fd, EPOLLOUT );
-                        break;
-                    }
-                    case BUFFER_EMPTY:
-                    {
-                        modfd( m_epollfd, cltfd, EPOLLIN );
-                        modfd( m_epollfd, fd, EPOLLIN );
-                        break;
-                    }
-                    case IOERR:
-                    case CLOSED:
-                    {
-                        /*
-                        if( connection->m_srv_write_idx == connection->m_srvread_idx )
-                        {
-                            free_conn( connection );
-                        }
-                        else
-                        {
-                            modfd( m_epollfd, cltfd, EPOLLOUT );
-                        }
-                        */
-                        modfd( m_epollfd, cltfd, EPOLLOUT );
-                        connection->m_srv_closed = true;
-                        break;
-                    }
-                    default:
-                        break;
-                }
-                break;
-            }
-            default:
-            {
-                log( LOG_ERR, __FILE__, __LINE__, "%s", "other operation not support yet" );
-                break;
+                tmp->m_retry_at = now;
+                tmp->m_backoff = 0;
             }
         }
     }
-    else
+}
+
+int mgr::get_wait_time( int max_wait )
+{
+    long long now = get_cur_ms();
+    long long wait = m_wheel.get_wait_time( now, max_wait );
+    for( conn* tmp = m_freed.front(); tmp; tmp = tmp->m_next )
     {
+        if( m_backends[ tmp->m_backend ].m_healthy && ( tmp->m_retry_at - now < wait ) )
+        {
+            wait = tmp->m_retry_at - now;
+        }
+    }
+    if( m_wait_cnt > 0 && m_waiters[ m_wait_head ].m_since + WAIT_TIMEOUT - now < wait )
+    {
+        wait = m_waiters[ m_wait_head ].m_since + WAIT_TIMEOUT - now;
+    }
+    for( int i = 0; i < m_backend_cnt; ++i )
+    {
+        backend* srv = &m_backends[i];
+        if( srv->m_draining )
+        {
+            continue;
+        }
+        long long next = ( srv->m_check_fd != -1 ) ? srv->m_check_deadline : srv->m_next_check;
+        if( next - now < wait )
+        {
+            wait = next - now;
+        }
+        //连接池队首的连接空闲最久，只有它可能最先超时
+        if( srv->m_total > srv->m_host.m_conncnt && !srv->m_conns.empty()
+            && srv->m_conns.front()->m_idle_since + srv->m_host.m_idle_timeout - now < wait )
+        {
+            wait = srv->m_conns.front()->m_idle_since + srv->m_host.m_idle_timeout - now;
+        }
+    }
+    return wait < 0 ? 0 : ( int )wait;
+}
+
+void mgr::modconn( conn* connection, int side, int ev )
+{
+    //L7模式下客户端fd注册的是会话
+    if( side == CLT_SIDE && connection->m_session )
+    {
+        modptr( m_epollfd, connection->m_cltfd, tag_ptr( connection->m_session, SESSION_SIDE ), ev );
+        return;
+    }
+    int fd = ( side == CLT_SIDE ) ? connection->m_cltfd : connection->m_srvfd;
+    modptr( m_epollfd, fd, tag_ptr( connection, side ), ev );
+}
+
+void mgr::update_events( conn* connection, bool clt_full, bool srv_full )
+{
+    //读到缓冲区满（高水位）时暂停读这一端，对端写到低水位（一半）以下时才恢复，避免每读写一次就修改一次注册的事件
+    int low = connection->capacity() / 2;
+    bool clt_resume = false;
+    bool srv_resume = false;
+    if( clt_full )
+    {
+        connection->m_clt_paused = true;
+    }
+    if( connection->m_clt_paused && connection->clt_pending() <= low )
+    {
+        connection->m_clt_paused = false;
+        clt_resume = true;
+    }
+    if( srv_full )
+    {
+        connection->m_srv_paused = true;
+    }
+    if( connection->m_srv_paused && connection->srv_pending() <= low )
+    {
+        connection->m_srv_paused = false;
+        srv_resume = true;
+    }
+
+    //有积压的数据说明上一次写遇到了EAGAIN，需要等待可写事件
+    int clt_ev = ( connection->m_clt_paused ? 0 : ( int )EPOLLIN ) | ( ( connection->srv_pending() > 0 ) ? ( int )EPOLLOUT : 0 );
+    int srv_ev = 0;
+    if( !connection->m_srv_closed )
+    {
+        srv_ev = ( connection->m_srv_paused ? 0 : ( int )EPOLLIN ) | ( ( connection->clt_pending() > 0 ) ? ( int )EPOLLOUT : 0 );
+    }
+    //恢复读时即使事件没有变化也要重新注册：ET模式下socket中滞留的数据只有重新注册才会再次通知
+    if( clt_ev != connection->m_clt_events || clt_resume )
+    {
+        modconn( connection, CLT_SIDE, clt_ev );
+        connection->m_clt_events = clt_ev;
+    }
+    if( srv_ev != connection->m_srv_events || srv_resume )
+    {
+        modconn( connection, SRV_SIDE, srv_ev );
+        connection->m_srv_events = srv_ev;
+    }
+}
+
+RET_CODE mgr::process( void* tagged, OP_TYPE type )
+{
+    //健康检查的socket，data.ptr中保存的是逻辑主机
+    if( ptr_side( tagged ) == CHECK_SIDE )
+    {
+        process_check( ( backend* )untag_ptr( tagged ) );
         return NOTHING;
     }
+    //L7模式下的客户端，data.ptr中保存的是客户会话
+    if( ptr_side( tagged ) == SESSION_SIDE )
+    {
+        session* sess = ( session* )untag_ptr( tagged );
+        if( sess->m_cltfd < 0 )
+        {
+            return NOTHING;
+        }
+        if( sess->m_conn )
+        {
+            return relay( sess->m_conn, CLT_SIDE, type );
+        }
+        return ( type == READ ) ? start_request( sess ) : NOTHING;
+    }
+    //epoll_event.data.ptr中直接保存了连接类和fd所属的一端，该类中保存有相对应的客户端和服务端的fd
+    conn* connection = ( conn* )untag_ptr( tagged );
+    int side = ptr_side( tagged );
+    int fd = ( side == CLT_SIDE ) ? connection->m_cltfd : connection->m_srvfd;
+    //同一批事件中连接可能已经被前面的事件释放，此时它的fd已被置为-1
+    if( fd < 0 )
+    {
+        return NOTHING;
+    }
+    //正在连接的srvfd可写（或出错），说明非阻塞连接有了结果
+    if( connection->m_connecting )
+    {
+        finish_connect( connection );
+        return NOTHING;
+    }
+    //连接池中还没有分配给客户的连接
+    if( connection->m_cltfd < 0 )
+    {
+        return NOTHING;
+    }
+    return relay( connection, side, type );
+}
+
+RET_CODE mgr::relay( conn* connection, int side, OP_TYPE type )
+{
+    //只记录活动的时刻，不修改时间轮
+    connection->m_last_active = m_now;
+    backend_stats* stats = m_backends[ connection->m_backend ].m_stats;
+    bool clt_full = false;
+    bool srv_full = false;
+    if( type == READ && side == CLT_SIDE )
+    {
+        RET_CODE res = connection->read_clt();
+        if( res == IOERR || res == CLOSED )    //客户端关闭连接
+        {
+            free_conn( connection );
+            return CLOSED;
+        }
+        clt_full = ( res == BUFFER_FULL );
+        LOG( LOG_DEBUG, "%d bytes pending from client", connection->clt_pending() );
+        if( connection->m_req_at == 0 && connection->clt_pending() > 0 )
+        {
+            connection->m_req_at = m_now_us;
+        }
+        if( m_http_mode && !connection->parse_clt() )
+        {
+            free_conn( connection );
+            return CLOSED;
+        }
+    }
+    else if( type == READ && side == SRV_SIDE )
+    {
+        RET_CODE res = connection->read_srv();
+        if( res == IOERR || res == CLOSED )    //服务端关闭连接，把已经读到的数据写给客户端之后再释放
+        {
+            connection->m_srv_closed = true;
+        }
+        srv_full = ( res == BUFFER_FULL );
+        LOG( LOG_DEBUG, "%d bytes pending from server", connection->srv_pending() );
+        if( connection->m_req_at != 0 && connection->srv_pending() > 0 )
+        {
+            stats->m_ttfb.record( m_now_us - connection->m_req_at );
+            connection->m_req_at = 0;
+        }
+        if( m_http_mode && !connection->parse_srv() )
+        {
+            free_conn( connection );
+            return CLOSED;
+        }
+    }
+    else if( type != WRITE )
+    {
+        LOG( LOG_ERR, "%s", "other operation not support yet" );
+        return NOTHING;
+    }
+
+    //刚读到的数据立即转发，不必等下一轮epoll_wait；对端正在等待可写事件时（上一次写遇到EAGAIN）只在可写事件中写
+    if( connection->clt_pending() > 0 && !connection->m_srv_closed
+        && ( ( type == WRITE && side == SRV_SIDE ) || !( connection->m_srv_events & EPOLLOUT ) ) )
+    {
+        unsigned long long relayed = conn::m_bytes_relayed;
+        RET_CODE res = connection->write_srv();
+        stats->m_bytes_out += conn::m_bytes_relayed - relayed;
+        if( res == IOERR || res == CLOSED )
+        {
+            connection->m_srv_closed = true;
+        }
+    }
+    if( connection->srv_pending() > 0
+        && ( ( type == WRITE && side == CLT_SIDE ) || !( connection->m_clt_events & EPOLLOUT ) ) )
+    {
+        unsigned long long relayed = conn::m_bytes_relayed;
+        RET_CODE res = connection->write_clt();
+        stats->m_bytes_in += conn::m_bytes_relayed - relayed;
+        if( res == IOERR || res == CLOSED )
+        {
+            free_conn( connection );
+            return CLOSED;
+        }
+    }
+    //L7模式下请求都得到了完整的应答，归还服务端连接，客户保持连接等待下一个请求
+    if( m_http_mode && connection->http_idle() )
+    {
+        return release_conn( connection );
+    }
+    //服务端已经关闭，并且它发来的数据都已经写给了客户端
+    if( connection->m_srv_closed && connection->srv_pending() == 0 )
+    {
+        free_conn( connection );
+        return CLOSED;
+    }
+
+    update_events( connection, clt_full, srv_full );
     return OK;
 }
@@ -1,42 +1,208 @@
 #ifndef SRVMGR_H
 #define SRVMGR_H
 
-#include <map>
+#include <vector>
 #include <arpa/inet.h>
 #include "fdwrapper.h"
 #include "conn.h"
+#include "slab.h"
+#include "stats.h"
 
-using std::map;
+using std::vector;
 
 class host
 {
 public:
     char m_hostname[1024];  //保存ip地址
     int m_port;     //保存端口号
-    int m_conncnt;  //连接数
+    int m_conncnt;  //连接池的最小连接数，启动时预先建立
+    int m_max_conns;    //连接池的最大连接数，客户等待时在m_conncnt和它之间异步扩充
+    int m_idle_timeout; //超过最小连接数的连接空闲多久后关闭（毫秒）
+    bool m_splice;  //是否使用splice零拷贝转发
+    int m_buf_size; //每个连接每个方向的环形缓冲区大小（向上取整为2的幂）
+    int m_weight;   //子进程在各逻辑主机之间分配客户时使用的权重
+    char m_http_check[256]; //HTTP健康检查请求的路径，为空时只检查TCP连接
+};
+
+// 通过conn中的m_prev/m_next串起来的侵入式双向链表，插入和删除都是O(1)且不需要分配内存
+class conn_list
+{
+public:
+    conn_list() : m_head( NULL ), m_tail( NULL ), m_size( 0 ){}
+    void push_back( conn* connection );
+    conn* pop_front();
+    void remove( conn* connection );
+    conn* front() const { return m_head; }
+    bool empty() const { return m_size == 0; }
+    int size() const { return m_size; }
+
+private:
+    conn* m_head;
+    conn* m_tail;
+    int m_size;
+};
+
+// 一个逻辑主机在子进程中的状态：准备好的连接池和健康检查
+class backend
+{
+public:
+    backend() : m_slab( NULL ), m_total( 0 ), m_healthy( true ), m_draining( false ), m_fails( 0 ), m_passes( 0 ), m_current( 0 ),
+        m_check_fd( -1 ), m_check_connected( false ), m_check_deadline( 0 ), m_next_check( 0 ), m_stats( NULL ){}
+
+public:
+    host m_host;        //逻辑主机的配置
+    sockaddr_in m_address;  //逻辑主机的地址
+    conn_list m_conns;  //准备好的连接，队首是空闲最久的
+    conn_slab* m_slab;  //该逻辑主机的conn对象和缓冲区所在的slab
+    int m_total;        //属于该逻辑主机的连接总数（空闲、使用中、正在连接和等待重连的）
+    bool m_healthy;     //是否健康，不健康的逻辑主机被摘除，不再分配客户
+    bool m_draining;    //已经从配置中删除，连接用完后关闭；连接都关闭后m_slab为NULL，位置可以被新的逻辑主机复用
+    int m_fails;        //连续失败的健康检查次数
+    int m_passes;       //连续成功的健康检查次数
+    int m_current;      //平滑加权轮询的当前值
+    int m_check_fd;     //正在进行的健康检查的socket，-1表示没有
+    bool m_check_connected; //探测连接已经建立，正在等待HTTP应答
+    long long m_check_deadline; //本次健康检查的超时时刻（毫秒）
+    long long m_next_check;     //下一次健康检查的时刻（毫秒）
+    backend_stats* m_stats;     //该逻辑主机在共享内存中的统计
+};
+
+// L7模式下的客户会话：客户端连接在整个生命期内注册到epoll中，只在请求期间借用一个服务端连接
+class session
+{
+public:
+    int m_cltfd;        //客户端fd，-1表示会话已经关闭（在空闲链表中）
+    sockaddr_in m_address;  //客户端地址
+    conn* m_conn;       //正在借用的服务端连接，NULL表示客户处于两个请求之间
+    int m_events;       //没有借用服务端连接时客户端fd在epoll中注册的事件
+    session* m_next;    //mgr中空闲会话链表的后继
+    tw_timer m_timer;   //客户空闲超时和最长存活时间的定时器
+    long long m_since;  //客户连接的时刻（毫秒）
+    long long m_last_active;    //最后一次收到请求或者转发数据的时刻（毫秒）
+};
+
+// 没有空闲的服务端连接时排队等待的客户
+class waiter
+{
+public:
+    int m_cltfd;        //客户端fd，等待期间不注册到epoll中（L7模式下仍然注册，但不关注任何事件）
+    sockaddr_in m_address;  //客户端地址
+    long long m_since;  //开始等待的时刻（毫秒）
+    session* m_session; //L7模式下等待的客户会话，L4模式下为NULL
+    int m_backend;      //会话保持时客户要等的逻辑主机，-1表示任何逻辑主机的连接都可以
 };
 
 class mgr
 {
 public:
-    mgr( int epollfd, const host& srv );    //在构造mgr的同时调用conn2srv和服务端建立连接
+    //在构造mgr的同时调用conn2srv向所有逻辑主机发起（非阻塞）连接。stats是本进程在共享内存中的统计区域，为NULL时自己分配
+    mgr( int epollfd, const vector< host >& srvs, child_shm* stats = NULL );
     ~mgr();
-    int conn2srv( const sockaddr_in& address ); //和服务端建立连接同时返回socket描述符
-    conn* pick_conn( int sockfd );  //从连接好的连接中（m_conn中）拿出一个放入任务队列（m_used）中
-    // 释放连接（当连接关闭或者中断后，将其fd从内核事件表删除，并关闭fd），并将同srv进行连接的放入m_freed中
+    //开启L7模式：按HTTP请求的边界借用服务端连接，应答结束后放回连接池。需要在创建进程池之前调用
+    static void set_http_mode( bool on ) { m_http_mode = on; }
+    //开启会话保持：按客户端IP在健康的逻辑主机之间做加权的一致性哈希，同一客户总是使用同一个逻辑主机。需要在创建进程池之前调用
+    static void set_sticky( bool on ) { m_sticky = on; }
+    //客户的空闲超时和最长存活时间（毫秒），0表示不限制。需要在创建进程池之前调用
+    static void set_timeouts( int idle_timeout, int lifetime ) { m_clt_idle_timeout = idle_timeout; m_clt_lifetime = lifetime; }
+    //事件循环每轮开始时缓存当前时间（单调时钟的微秒数），转发数据时用它记录活动时刻和统计延迟
+    void set_now( long long now_us ) { m_now_us = now_us; m_now = now_us / 1000; }
+    int conn2srv( const sockaddr_in& address ); //向服务端发起非阻塞连接，返回正在连接（或已连接）的socket描述符
+    //为新客户分配服务端连接；连接池为空时客户排队等待并异步扩充连接池。返回false表示客户被拒绝，由调用者关闭cltfd。
+    //L7模式下只为客户创建会话，收到请求时才分配服务端连接
+    bool add_client( int cltfd, const sockaddr_in& client_addr );
+    // 释放连接（当连接关闭或者中断后，将其fd从内核事件表删除，并关闭fd），并将同srv进行连接的放入m_freed中。L7模式下同时关闭客户会话
     void free_conn( conn* connection );
-    int get_used_conn_cnt();    //获取当前任务数(被notify_parent_busy_ratio()调用）
-    //从m_freed中回收连接（由于连接已经被关闭，因此还要调用conn2srv()）放到m_conn中
+    //重新加载配置：新增或删除逻辑主机，修改已有逻辑主机的权重、连接池大小和健康检查，已经建立的连接不受影响
+    void reload( const vector< host >& srvs );
+    int get_used_conn_cnt();    //获取当前任务数（正在服务的客户数）
+    void get_stats( child_stats& stats );   //填写发送给父进程的负载信息（被notify_parent_stats()调用）
+    //处理到期的定时器（连接超时、客户空闲超时和超过最长存活时间），把m_freed中重试时间已到的连接重新发起连接（由于连接已经被关闭，因此还要调用conn2srv()），
+    //关闭等待超时的客户和空闲超时的多余连接，并执行到期的健康检查
     void recycle_conns();
-    //通过fd和type来控制对服务端和客户端的读写，是整个负载均衡的核心功能
-    RET_CODE process( int fd, OP_TYPE type );
+    //距离下一次需要调用recycle_conns的时间（毫秒），最多为max_wait，作为epoll_wait的超时值
+    int get_wait_time( int max_wait );
+    //通过epoll_event.data.ptr中带标记的conn指针和type来控制对服务端和客户端的读写，是整个负载均衡的核心功能。
+    //读到的数据立即转发给对端，积压到高水位时暂停读，写到低水位以下时恢复
+    RET_CODE process( void* tagged, OP_TYPE type );
 
 private:
+    bool add_backend( const host& cfg );    //在第一个空闲的位置上加入逻辑主机并预先建立连接
+    void set_host( backend* srv, const host& cfg ); //设置逻辑主机的配置，修正不合理的权重和最大连接数
+    void fill_pool( int idx );  //第idx个逻辑主机的连接不够最小连接数时补足
+    void drain_backend( backend* srv );     //逻辑主机从配置中删除，关闭空闲连接，其余连接用完后再关闭
+    void retire_conn( conn* connection );   //关闭已删除的逻辑主机的一个连接，最后一个连接关闭后释放它的slab
+    void release_backend( backend* srv );   //已删除的逻辑主机的连接都关闭了，释放它的slab
+    conn* new_conn( int idx );  //为第idx个逻辑主机创建一个（尚未连接的）连接
+    //按权重选出一个健康的逻辑主机，从它的连接池中拿出一个连接。会话保持时只从client_addr对应的逻辑主机中拿
+    conn* pick_conn( const sockaddr_in& client_addr );
+    int sticky_backend( const sockaddr_in& client_addr );   //会话保持时客户对应的逻辑主机，没有健康的逻辑主机时返回-1
+    bool take_waiter( int idx, waiter& w );     //取出最早的、可以使用第idx个逻辑主机的连接的排队客户，没有时返回false
+    void bind_conn( conn* connection, int cltfd, const sockaddr_in& client_addr );  //把客户端和服务端fd连同conn的地址注册到epoll中
+    bool enqueue_waiter( int cltfd, const sockaddr_in& client_addr, session* sess );  //客户排队等待服务端连接，队列已满时返回false
+    void put_conn( conn* connection );  //连接可用了：有客户在排队时交给队首的客户，否则放回所属逻辑主机的连接池
+    session* new_session( int cltfd, const sockaddr_in& client_addr );  //L7模式下为新客户创建会话并注册客户端fd
+    bool grow_sessions();   //一次分配SESSION_CHUNK个会话加入空闲链表，失败时返回false
+    void close_session( session* sess );    //关闭客户端fd，把会话放回空闲链表
+    void bind_session( conn* connection, session* sess );  //L7模式下会话借用服务端连接
+    RET_CODE start_request( session* sess );    //L7模式下两个请求之间的客户发来了数据，为它分配服务端连接
+    RET_CODE release_conn( conn* connection );  //L7模式下请求都已应答，归还服务端连接；客户要求关闭时关闭会话并返回CLOSED
+    RET_CODE relay( conn* connection, int side, OP_TYPE type ); //在客户端和服务端之间转发数据
+    //正在进行的连接不够服务排队的客户时，在还没达到最大连接数的逻辑主机上新建一个连接，want不为-1时优先选第want个逻辑主机
+    void grow_pool( int want );
+    void expire_waiters( long long now );   //拒绝等待超时的客户
+    void expire_timers( long long now );    //处理时间轮中到期的定时器
+    void expire_client( void* tagged, long long now );     //客户的定时器到期，检查是否真的空闲超时或者超过了最长存活时间
+    //按客户连接的时刻和最后一次活动的时刻把定时器加入时间轮，不限制超时时不加入
+    void arm_client( tw_timer* timer, long long since, long long last_active );
+    void shrink_pools( long long now );     //关闭空闲超时的多余连接，直到只剩下最小连接数
+    void start_connect( conn* connection );     //为connection发起一次非阻塞连接，并把srvfd的可写事件注册到epoll
+    void finish_connect( conn* connection );    //srvfd可写时通过SO_ERROR判断连接是否成功
+    void schedule_retry( conn* connection );    //连接失败，按指数退避的时间放回m_freed等待重试
+    void modconn( conn* connection, int side, int ev ); //修改连接某一端在epoll中注册的事件
+    //根据两个方向积压的数据计算两端需要的事件（读到满时暂停读），只在事件变化或者需要恢复读时调用epoll_ctl
+    void update_events( conn* connection, bool clt_full, bool srv_full );
+    void check_backends( long long now );   //处理健康检查的超时，并对到期的逻辑主机发起健康检查
+    void start_check( backend* srv );   //向逻辑主机发起一次健康检查（非阻塞连接，可选的HTTP请求）
+    void process_check( backend* srv ); //健康检查的socket上有事件
+    void finish_check( backend* srv, bool ok ); //健康检查结束，根据连续成功或失败的次数摘除或恢复逻辑主机
+
+private:
+    static const int CONNECT_TIMEOUT = 3000;    //单次连接的超时时间（毫秒）
+    static const int RETRY_BACKOFF_MIN = 100;   //连接失败后第一次重试的等待时间（毫秒）
+    static const int RETRY_BACKOFF_MAX = 30000; //重试等待时间的上限（毫秒）
+    static const int CHECK_INTERVAL = 2000;     //健康检查的间隔（毫秒）
+    static const int CHECK_TIMEOUT = 1000;      //单次健康检查的超时时间（毫秒）
+    static const int CHECK_FALL = 2;            //连续失败多少次后摘除逻辑主机
+    static const int CHECK_RISE = 2;            //被摘除的逻辑主机连续成功多少次后恢复
+    static const int MAX_WAITERS = 1024;        //最多同时排队等待服务端连接的客户数
+    static const int WAIT_TIMEOUT = 2000;       //客户排队等待服务端连接的最长时间（毫秒）
+    static const int MAX_BACKENDS = 64;         //最多同时存在的逻辑主机数（包括已删除、还有连接没有关闭的）
+    static const int SESSION_CHUNK = 256;       //L7模式下会话成批分配，接受新客户时不必每次都分配内存
+
     static int m_epollfd;   //内核时间表fd
-    map< int, conn* > m_conns;  //准备好的连接
-    map< int, conn* > m_used;   //要被使用的连接
-    map< int, conn* > m_freed;  //使用后被释放的连接
-    host m_logic_srv;   //保存服务端的信息
+    static bool m_http_mode;    //是否是L7模式
+    static bool m_sticky;       //是否按客户端IP选择逻辑主机（会话保持）
+    static int m_clt_idle_timeout;  //客户的空闲超时（毫秒），0表示不限制
+    static int m_clt_lifetime;      //客户连接的最长存活时间（毫秒），0表示不限制
+    timer_wheel m_wheel;    //连接超时和客户超时的定时器
+    long long m_now;        //事件循环本轮缓存的当前时间（毫秒）
+    long long m_now_us;     //同上（微秒）
+    child_shm* m_stats;     //每个逻辑主机的统计，第i个逻辑主机使用m_backends[i]
+    bool m_own_stats;       //m_stats是否由mgr自己分配
+    int m_used_cnt;     //正在服务的客户数（L4模式下等于正在被客户使用的连接数）
+    session* m_free_sessions;   //已经关闭、可以复用的会话。会话不会被释放，同一批事件中指向它的data.ptr仍然有效
+    vector< session* > m_session_chunks;    //成批分配的会话数组，mgr析构时才释放
+    conn_list m_connecting; //正在进行非阻塞连接的连接（连接超时由时间轮处理）
+    conn_list m_freed;  //使用后被释放或者连接失败、等待重连的连接（所属逻辑主机被摘除时暂停重连）
+    backend* m_backends;    //所有逻辑主机，每个逻辑主机有自己的连接池，长度为MAX_BACKENDS
+    int m_backend_cnt;  //m_backends中用过的位置数
+    waiter* m_waiters;  //排队等待的客户，长度为MAX_WAITERS的环形队列，按开始等待的时刻排列
+    int m_wait_head;    //队首的下标
+    int m_wait_cnt;     //排队的客户数
+    unsigned long long m_pool_hits;     //直接从连接池拿到连接的客户数
+    unsigned long long m_pool_waits;    //需要排队等待的客户数
+    unsigned long long m_wait_timeouts; //等待超时或者队列已满被拒绝的客户数
+    unsigned long long m_wait_ms;       //排队后拿到连接的客户累计等待的时间（毫秒）
 };
 
 #endif
@@ -16,9 +16,15 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <time.h>
+#include <linux/filter.h>
 #include <vector>
 #include "log.h"
 #include "fdwrapper.h"
+#include "stats.h"
+#include "lb_policy.h"
 
 using std::vector;
 
@@ -27,53 +33,150 @@ using std::vector;
 class process
 {
 public:
-    process() : m_pid( -1 ){}
+    process() : m_pid( -1 ), m_listenfd( -1 ), m_started_at( 0 ), m_respawn_at( -1 ), m_backoff( 0 ){}
 
 public:
-    int m_busy_ratio;   //给每台实际处理服务器（业务逻辑服务器）分配一个加权比例
     pid_t m_pid;        //目标子进程的PID
     int m_pipefd[2];    //父进程和子进程通信用的管道,父进程给子进程通知事件，子进程给父进程发送加权比
+    int m_listenfd;     //SO_REUSEPORT模式下该子进程自己的监听socket
+    long long m_started_at; //子进程启动的时刻（毫秒）
+    long long m_respawn_at; //子进程意外退出后计划重新启动的时刻（毫秒），-1表示没有计划
+    int m_backoff;      //子进程启动后很快又退出时，下一次重新启动前等待的时间（毫秒）
+};
+
+// 重新加载配置时父进程把解析好的逻辑主机配置写到这块共享内存中，后面紧跟m_count个H，子进程复制出来使用。
+// 用顺序锁保护：父进程写之前和写完之后各把m_gen加1，子进程读到奇数或者前后两次读到的m_gen不同时重新读取
+struct hosts_shm
+{
+    unsigned int m_gen;
+    int m_count;
+};
+
+// 平滑升级时，新的主进程从这个环境变量中得到与旧的主进程通信的UNIX域socket
+static const char* UPGRADE_ENV = "SPRINGSNAIL_UPGRADE_FD";
+
+// 新连接的接收方式
+enum ACCEPT_MODE
+{
+    ACCEPT_DISPATCH = 0,    //父进程监听，选出最空闲的子进程后通知它accept
+    ACCEPT_REUSEPORT,       //每个子进程有自己的SO_REUSEPORT监听socket，由内核按四元组哈希分配连接
+    ACCEPT_REUSEPORT_CPU    //同上，并通过SO_ATTACH_REUSEPORT_CBPF把连接交给收到它的CPU上绑定的子进程
 };
 
 template< typename C, typename H, typename M >
 class processpool
 {
 private:
-    processpool( int listenfd, int process_number = 8 );
+    processpool( int listenfd, int process_number, int accept_mode, const vector<int>& inherited );
 public:
-    // 该类的对象只能通过下面这个create函数来创建，因为该类的构造函数被声明为private了
-    static processpool< C, H, M >* create( int listenfd, int process_number = 8 )
+    // 该类的对象只能通过下面这个create函数来创建，因为该类的构造函数被声明为private了。
+    // inherited是平滑升级时从旧的主进程接收的其余SO_REUSEPORT监听socket，按它们在reuseport组中的顺序排列
+    static processpool< C, H, M >* create( int listenfd, int process_number = 8, int accept_mode = ACCEPT_DISPATCH,
+                                            const vector<int>& inherited = vector<int>() )
     {
         if( !m_instance )   // 单例模式
         {
-            m_instance = new processpool< C, H, M >( listenfd, process_number );
+            m_instance = new processpool< C, H, M >( listenfd, process_number, accept_mode, inherited );
         }
         return m_instance;
     }
     ~processpool()
     {
         delete [] m_sub_process;
+        delete [] m_child_stats;
+        delete [] m_child_alive;
+        delete m_policy;
+        if( m_shm )
+        {
+            munmap( m_shm, m_process_number * sizeof( child_shm ) );
+        }
+        if( m_hosts_shm )
+        {
+            munmap( m_hosts_shm, sizeof( hosts_shm ) + MAX_RELOAD_HOSTS * sizeof( H ) );
+        }
     }
     // 启动进程池
     void run( const vector<H>& arg );
+    // 设置父进程分配连接的负载均衡策略，processpool负责释放；未设置时使用最少连接策略
+    void set_policy( lb_policy* policy ) { delete m_policy; m_policy = policy; }
+    // 设置子进程每次最多连续accept的连接数
+    void set_accept_batch( int batch ) { m_accept_batch = ( batch > 0 ) ? batch : 1; }
+    // 设置收到SIGHUP时重新读取逻辑主机配置的函数，读取失败时返回false。只在父进程中调用，子进程使用父进程解析好的配置
+    void set_reload( bool ( *reload )( vector<H>& ) ) { m_reload = reload; }
+    // 设置平滑升级时执行的命令行（通常就是main的argv），收到SIGUSR2时用它启动新的主进程
+    void set_upgrade( char** argv ) { m_argv = argv; }
+    // 平滑升级时由新的主进程设置：父进程开始运行后向fd写一个字节，通知旧的主进程退出
+    void set_ready_fd( int fd ) { m_ready_fd = fd; }
+    // 设置输出统计页面的监听socket（非阻塞），由父进程处理，processpool负责关闭
+    void set_admin_fd( int fd ) { m_admin_fd = fd; }
 
 private:
-    void notify_parent_busy_ratio( int pipefd, M* manager );//获取目前连接数量，将其发送给父进程
-    int get_most_free_srv();    //找出最空闲的服务器
+    void notify_parent_stats( int pipefd, M* manager );    //获取目前的负载信息，将其发送给父进程
+    void report_stats( M* manager, int pipefd );    //活动连接数变化（最多每STATS_MIN_INTERVAL一次）或者距上次报告超过STATS_INTERVAL时报告负载信息
+    void record_loop_time( long long us );  //记录事件循环一轮的处理时间
+    int get_loop_p99();     //根据记录的处理时间估算p99（微秒），并开始新的统计周期
+    int select_child( const sockaddr_in* client_addr );  //按负载均衡策略选出处理新连接的子进程
+    void dispatch_conns();  //需要客户端地址的策略下，父进程accept所有新连接并把它们交给选中的子进程
+    bool add_client( M* manager, int connfd, const sockaddr_in& client_address );   //为客户连接分配服务端连接
     void setup_sig_pipe();      //统一事件源
+    void setup_reuseport( const vector<int>& inherited );  //fork之前为每个子进程准备绑定到同一地址的SO_REUSEPORT监听socket
+    int accept_clients( M* manager );   //批量accept客户连接并为它们分配服务端连接，返回accept到的连接数
+    void accept_batch( M* manager, int pipefd );    //执行一批accept，并把accept到的连接数报告给父进程
     void run_parent();
     void run_child( const vector<H>& arg );
+    void respawn_children();    //重新启动到期的意外退出的子进程
+    bool respawn_child( int idx );  //fork一个新的子进程代替第idx个子进程，在新的子进程中返回时m_idx为idx
+    void close_parent_fds( int keep_listenfd ); //fork出的进程关闭只有父进程才用的fd
+    int get_parent_wait_time(); //父进程epoll_wait的超时值，有计划重新启动的子进程时缩短
+    void quit_gracefully();     //父进程不再分配连接、不再重新启动子进程，并通知子进程平滑退出
+    void start_upgrade();       //启动新的主进程并通过UNIX域socket把监听socket交给它
+    void finish_upgrade();      //与新的主进程通信的socket上有数据：新的主进程已经就绪或者启动失败
+    void accept_admin();        //接受统计页面的连接，等它发来请求后再应答
+    bool serve_admin( int sockfd ); //sockfd是统计页面的连接时读取请求、输出统计并关闭连接，返回true
+    bool publish_hosts( const vector<H>& hosts );   //父进程把重新加载的配置写到共享内存中，放不下时返回false
+    bool read_hosts( vector<H>& hosts );    //子进程从共享内存中复制父进程最近一次重新加载的配置
 
 private:
     static const int MAX_PROCESS_NUMBER = 16;   //进程池允许最大进程数量
     static const int USER_PER_PROCESS = 65536;  //每个子进程最多能处理的客户数量
     static const int MAX_EVENT_NUMBER = 10000;  //EPOLL最多能处理的的事件数
+    static const int ACCEPT_BATCH = 64;         //默认每次最多连续accept的连接数
+    static const int STATS_INTERVAL = 1000;     //子进程定期报告负载信息的间隔（毫秒）
+    static const int STATS_MIN_INTERVAL = 50;   //活动连接数变化时，两次报告之间的最短间隔（毫秒）
+    static const int LOOP_HIST_SIZE = 32;       //事件循环处理时间的直方图桶数，第i个桶记录[2^(i-1), 2^i)微秒
+    static const int RESPAWN_BACKOFF_MIN = 100;     //子进程意外退出后重新启动前的等待时间（毫秒）
+    static const int RESPAWN_BACKOFF_MAX = 30000;   //子进程反复崩溃时等待时间的上限（毫秒）
+    static const int MIN_UPTIME = 5000;         //运行不到这么久（毫秒）就退出的子进程视为反复崩溃，等待时间加倍
+    static const int QUIT_TIMEOUT = 60000;      //平滑退出时子进程最多等待已有的连接结束的时间（毫秒）
+    static const int MAX_ADMIN_CLTS = 8;        //同时等待发来请求的统计页面连接数，更多的连接直接关闭
+    static const int ADMIN_PAGE_SIZE = 1 << 17; //统计页面的最大长度
+    static const int MAX_RELOAD_HOSTS = 64;     //重新加载配置时最多的逻辑主机数（与mgr中同时存在的逻辑主机数上限相同）
     int m_process_number;   //进程池中的进程总数
     int m_idx;          //子进程在池中的序号（从0开始）
     int m_epollfd;      //当前进程的epoll内核事件表fd
-    int m_listenfd;     //监听socket
+    int m_listenfd;     //监听socket（SO_REUSEPORT模式下，子进程中为它自己的监听socket）
+    int m_accept_mode;  //新连接的接收方式，见ACCEPT_MODE
+    int m_accept_batch; //每次最多连续accept的连接数
+    bool m_accept_pending;  //上一批accept达到了上限，监听socket上可能还有连接
+    int m_loop_hist[ LOOP_HIST_SIZE ];  //当前统计周期内事件循环处理时间的直方图
+    int m_reported_conns;   //上一次报告给父进程的活动连接数
+    long long m_reported_time;  //上一次报告的时刻（毫秒）
     int m_stop;         //子进程通过m_stop来决定是否停止运行
     process* m_sub_process; //保存所有子进程的描述信息
+    child_stats* m_child_stats; //每个子进程最近一次报告的负载信息，父进程据此选择子进程
+    bool* m_child_alive;    //每个子进程是否还在运行
+    lb_policy* m_policy;    //负载均衡策略
+    bool ( *m_reload )( vector<H>& );   //重新读取逻辑主机配置的函数
+    vector<H> m_hosts;  //父进程中当前的逻辑主机配置，重新启动子进程时使用
+    bool m_quitting;    //正在平滑退出：父进程不再分配连接和重启子进程；子进程不再接受连接，已有的连接结束后退出
+    long long m_quit_deadline;  //子进程平滑退出的最后期限（毫秒）
+    char** m_argv;      //平滑升级时启动新的主进程的命令行
+    int m_upgrade_fd;   //旧的主进程中与新的主进程通信的socket，-1表示没有在升级
+    int m_ready_fd;     //新的主进程中与旧的主进程通信的socket，-1表示不是升级启动的
+    child_shm* m_shm;   //所有子进程的统计，fork之前分配的共享内存，第i个子进程写m_shm[i]
+    hosts_shm* m_hosts_shm; //父进程重新加载的配置，fork之前分配的共享内存，为NULL时不支持重新加载
+    int m_admin_fd;     //统计页面的监听socket，-1表示没有开启
+    int m_admin_clts[ MAX_ADMIN_CLTS ]; //统计页面的连接，-1表示空位
     static processpool< C, H, M >* m_instance;  //进程池静态实例
 };
 template< typename C, typename H, typename M >
@@ -103,18 +206,75 @@ static void addsig( int sig, void( handler )(int), bool restart = true )
     assert( sigaction( sig, &sa, NULL ) != -1 );
 }
 
+// 单调时钟的当前时间（微秒），用于统计事件循环的处理时间
+static long long get_cur_us()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( long long )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 template< typename C, typename H, typename M >
-processpool< C, H, M >::processpool( int listenfd, int process_number ) 
-    : m_listenfd( listenfd ), m_process_number( process_number ), m_idx( -1 ), m_stop( false )
+processpool< C, H, M >::processpool( int listenfd, int process_number, int accept_mode, const vector<int>& inherited ) 
+    : m_process_number( process_number ), m_idx( -1 ), m_listenfd( listenfd ), m_accept_mode( accept_mode ), m_accept_batch( ACCEPT_BATCH ), m_accept_pending( false ),
+      m_reported_conns( -1 ), m_reported_time( 0 ), m_stop( false ), m_policy( NULL ), m_reload( NULL ), m_quitting( false ), m_quit_deadline( 0 ),
+      m_argv( NULL ), m_upgrade_fd( -1 ), m_ready_fd( -1 ), m_shm( NULL ), m_hosts_shm( NULL ), m_admin_fd( -1 )
 {
     assert( ( process_number > 0 ) && ( process_number <= MAX_PROCESS_NUMBER ) );
 
     m_sub_process = new process[ process_number ];
     assert( m_sub_process );
+    m_child_stats = new child_stats[ process_number ];
+    memset( m_child_stats, 0, process_number * sizeof( child_stats ) );
+    m_child_alive = new bool[ process_number ];
+    memset( m_child_alive, 0, process_number * sizeof( bool ) );
+    memset( m_loop_hist, 0, sizeof( m_loop_hist ) );
+    for( int i = 0; i < MAX_ADMIN_CLTS; ++i )
+    {
+        m_admin_clts[i] = -1;
+    }
+    //子进程写、父进程读的统计区域，父进程汇总后在统计页面上输出。分配失败时子进程各自使用私有的内存
+    void* shm = mmap( NULL, process_number * sizeof( child_shm ), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if( shm == MAP_FAILED )
+    {
+        LOG( LOG_ERR, "map stats memory failed: %s", strerror( errno ) );
+    }
+    else
+    {
+        m_shm = ( child_shm* )shm;
+    }
+    //H是可以按字节复制的配置类（见mgr.h中的host）
+    shm = mmap( NULL, sizeof( hosts_shm ) + MAX_RELOAD_HOSTS * sizeof( H ), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if( shm == MAP_FAILED )
+    {
+        LOG( LOG_ERR, "map config memory failed, reload disabled: %s", strerror( errno ) );
+    }
+    else
+    {
+        m_hosts_shm = ( hosts_shm* )shm;
+        m_hosts_shm->m_gen = 0;
+        m_hosts_shm->m_count = 0;
+    }
+
+    if( m_accept_mode != ACCEPT_DISPATCH )
+    {
+        setup_reuseport( inherited );
+    }
+    else
+    {
+        //旧的主进程使用SO_REUSEPORT而新的配置不使用时，多余的监听socket中积压的连接会被重置
+        for( int i = 0; i < ( int )inherited.size(); ++i )
+        {
+            close( inherited[i] );
+        }
+    }
 
+    //子进程在setup_sig_pipe之前收到SIGHUP时不能被默认动作终止
+    addsig( SIGHUP, SIG_IGN );
     for( int i = 0; i < process_number; ++i )
     {
-        int ret = socketpair( PF_UNIX, SOCK_STREAM, 0, m_sub_process[i].m_pipefd );
+        //SOCK_SEQPACKET保留消息边界：子进程的非阻塞send要么发送整条负载信息，要么失败，父进程每次recv正好得到一条
+        int ret = socketpair( PF_UNIX, SOCK_SEQPACKET, 0, m_sub_process[i].m_pipefd );
         assert( ret == 0 );
 
         m_sub_process[i].m_pid = fork();
@@ -122,7 +282,8 @@ processpool< C, H, M >::processpool( int listenfd, int process_number )
         if( m_sub_process[i].m_pid > 0 )
         {
             close( m_sub_process[i].m_pipefd[1] );
-            m_sub_process[i].m_busy_ratio = 0;
+            m_sub_process[i].m_started_at = get_cur_us() / 1000;
+            m_child_alive[i] = true;
             continue;
         }
         else
@@ -132,24 +293,133 @@ processpool< C, H, M >::processpool( int listenfd, int process_number )
             break;
         }
     }
+
+    if( m_accept_mode != ACCEPT_DISPATCH )
+    {
+        //子进程只保留自己的监听socket。父进程不监听，但保留所有的监听socket：
+        //子进程意外退出后，它的socket仍在reuseport组中，积压的连接由重新启动的子进程接着accept
+        for( int i = 0; ( m_idx != -1 ) && ( i < m_process_number ); ++i )
+        {
+            if( ( i != m_idx ) && ( m_sub_process[i].m_listenfd != listenfd ) )
+            {
+                close( m_sub_process[i].m_listenfd );
+            }
+        }
+        if( m_idx != -1 )
+        {
+            m_listenfd = m_sub_process[m_idx].m_listenfd;
+            if( m_listenfd != listenfd )
+            {
+                close( listenfd );
+            }
+        }
+    }
 }
 
 template< typename C, typename H, typename M >
-int processpool< C, H, M >::get_most_free_srv()
+void processpool< C, H, M >::setup_reuseport( const vector<int>& inherited )
 {
-    int ratio = m_sub_process[0].m_busy_ratio;
-    int idx = 0;
-    for( int i = 0; i < m_process_number; ++i )
+    //main中的监听socket已经设置了SO_REUSEPORT并开始监听，它是reuseport组中的第0个socket，留给0号子进程
+    struct sockaddr_in address;
+    socklen_t addrlength = sizeof( address );
+    int ret = getsockname( m_listenfd, ( struct sockaddr* )&address, &addrlength );
+    assert( ret != -1 );
+
+    m_sub_process[0].m_listenfd = m_listenfd;
+    //平滑升级时接着使用旧的主进程的socket，它们积压的连接由新的子进程accept；子进程数减少时多余的socket被关闭，
+    //其中积压的连接会被重置
+    for( int i = 0; i < ( int )inherited.size(); ++i )
+    {
+        if( i + 1 < m_process_number )
+        {
+            m_sub_process[ i + 1 ].m_listenfd = inherited[i];
+        }
+        else
+        {
+            close( inherited[i] );
+        }
+    }
+    for( int i = 1 + inherited.size(); i < m_process_number; ++i )
+    {
+        int listenfd = socket( PF_INET, SOCK_STREAM, 0 );
+        assert( listenfd >= 0 );
+        int reuse = 1;
+        ret = setsockopt( listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof( reuse ) );
+        assert( ret != -1 );
+        ret = bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) );
+        assert( ret != -1 );
+        //socket按listen的顺序加入reuseport组，因此第i个socket在组中的下标也是i。
+        //每个socket有自己的积压队列，内核分给它的连接都在这里排队，所以和main中的监听socket一样用SOMAXCONN
+        ret = listen( listenfd, SOMAXCONN );
+        assert( ret != -1 );
+        m_sub_process[i].m_listenfd = listenfd;
+    }
+
+    if( m_accept_mode == ACCEPT_REUSEPORT_CPU )
     {
-        if( m_sub_process[i].m_busy_ratio < ratio )
+        //BPF程序的返回值是组中socket的下标：A = 当前CPU编号 % 子进程数，子进程i会被绑定到CPU i上
+        struct sock_filter code[] =
         {
-            idx = i;
-            ratio = m_sub_process[i].m_busy_ratio;
+            { BPF_LD | BPF_W | BPF_ABS, 0, 0, ( __u32 )( SKF_AD_OFF + SKF_AD_CPU ) },
+            { BPF_ALU | BPF_MOD | BPF_K, 0, 0, ( __u32 )m_process_number },
+            { BPF_RET | BPF_A, 0, 0, 0 },
+        };
+        struct sock_fprog prog;
+        prog.len = sizeof( code ) / sizeof( code[0] );
+        prog.filter = code;
+        if( setsockopt( m_listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof( prog ) ) < 0 )
+        {
+            LOG( LOG_ERR, "attach reuseport cbpf failed, use hash instead: %s", strerror( errno ) );
         }
     }
+}
+
+template< typename C, typename H, typename M >
+int processpool< C, H, M >::select_child( const sockaddr_in* client_addr )
+{
+    int idx = m_policy->select( m_child_stats, m_child_alive, m_process_number, client_addr );
+    if( idx != -1 )
+    {
+        //在子进程报告新的负载之前，先按这个连接已被接收来估计，避免突发的连接都分给同一个子进程
+        ++m_child_stats[idx].m_active_conns;
+        --m_child_stats[idx].m_pool_depth;
+    }
     return idx;
 }
 
+template< typename C, typename H, typename M >
+void processpool< C, H, M >::dispatch_conns()
+{
+    while( true )
+    {
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof( client_address );
+        int connfd = accept4( m_listenfd, ( struct sockaddr* )&client_address, &client_addrlength, SOCK_NONBLOCK | SOCK_CLOEXEC );
+        if( connfd < 0 )
+        {
+            if( errno == EINTR || errno == ECONNABORTED )
+            {
+                continue;
+            }
+            if( errno != EAGAIN && errno != EWOULDBLOCK )
+            {
+                LOG( LOG_ERR, "errno: %s", strerror( errno ) );
+            }
+            return;
+        }
+        int idx = select_child( &client_address );
+        if( ( idx == -1 ) || ( send_fd( m_sub_process[idx].m_pipefd[0], connfd ) < 0 ) )
+        {
+            LOG( LOG_ERR, "%s", "dispatch connection to child failed" );
+        }
+        else
+        {
+            LOG( LOG_INFO, "send connection to child %d", idx );
+        }
+        close( connfd );
+    }
+}
+
 template< typename C, typename H, typename M >
 void processpool< C, H, M >::setup_sig_pipe()
 {
@@ -165,6 +435,9 @@ void processpool< C, H, M >::setup_sig_pipe()
     addsig( SIGCHLD, sig_handler );
     addsig( SIGTERM, sig_handler );
     addsig( SIGINT, sig_handler );
+    addsig( SIGHUP, sig_handler );
+    addsig( SIGQUIT, sig_handler );
+    addsig( SIGUSR2, sig_handler );
     addsig( SIGPIPE, SIG_IGN );
 }
 
@@ -176,27 +449,176 @@ void processpool< C, H, M >::run( const vector<H>& arg )
         run_child( arg );
         return;
     }
+    m_hosts = arg;
     run_parent();
+    //父进程重新启动子进程时，新的子进程从run_parent返回，使用最新的配置运行
+    if( m_idx != -1 )
+    {
+        m_stop = false;
+        run_child( m_hosts );
+    }
+}
+
+template< typename C, typename H, typename M >
+void processpool< C, H, M >::notify_parent_stats( int pipefd, M* manager )
+{
+    child_stats msg;
+    memset( &msg, 0, sizeof( msg ) );
+    manager->get_stats( msg );
+    msg.m_loop_p99_us = get_loop_p99();
+    //管道是SOCK_SEQPACKET的，消息不会只发出一部分；缓冲区满时这一次报告被丢弃，下一次报告会带上最新的负载
+    send( pipefd, ( char* )&msg, sizeof( msg ), 0 );
+    m_reported_conns = msg.m_active_conns;
+    m_reported_time = get_cur_us() / 1000;
+}
+
+template< typename C, typename H, typename M >
+void processpool< C, H, M >::report_stats( M* manager, int pipefd )
+{
+    long long elapsed = get_cur_us() / 1000 - m_reported_time;
+    if( ( ( manager->get_used_conn_cnt() != m_reported_conns ) && ( elapsed >= STATS_MIN_INTERVAL ) )
+        || ( elapsed >= STATS_INTERVAL ) )
+    {
+        notify_parent_stats( pipefd, manager );
+    }
+}
+
+template< typename C, typename H, typename M >
+void processpool< C, H, M >::record_loop_time( long long us )
+{
+    int bucket = 0;
+    while( ( us > 0 ) && ( bucket < LOOP_HIST_SIZE - 1 ) )
+    {
+        us >>= 1;
+        ++bucket;
+    }
+    ++m_loop_hist[ bucket ];
+}
+
+template< typename C, typename H, typename M >
+int processpool< C, H, M >::get_loop_p99()
+{
+    int total = 0;
+    for( int i = 0; i < LOOP_HIST_SIZE; ++i )
+    {
+        total += m_loop_hist[i];
+    }
+    int p99 = 0;
+    int target = total - total / 100;   //第99百分位的样本所在的位置（向上取整）
+    int count = 0;
+    for( int i = 0; ( i < LOOP_HIST_SIZE ) && ( total > 0 ); ++i )
+    {
+        count += m_loop_hist[i];
+        if( count >= target )
+        {
+            p99 = 1 << i;   //取桶的上界
+            break;
+        }
+    }
+    memset( m_loop_hist, 0, sizeof( m_loop_hist ) );
+    return p99;
+}
+
+template< typename C, typename H, typename M >
+bool processpool< C, H, M >::add_client( M* manager, int connfd, const sockaddr_in& client_address )
+{
+    //获取一个空闲的连接，并将客户端文件描述符connfd上的可读事件加入内核时间表；没有空闲连接时客户在mgr中排队
+    if( !manager->add_client( connfd, client_address ) )
+    {
+        close( connfd );
+        return false;
+    }
+    return true;
+}
+
+template< typename C, typename H, typename M >
+int processpool< C, H, M >::accept_clients( M* manager )
+{
+    //监听socket是非阻塞的，一直accept到EAGAIN或者达到单批上限为止，避免连接滞留在backlog中
+    int accepted = 0;
+    m_accept_pending = false;
+    if( m_listenfd < 0 )
+    {
+        return 0;   //正在平滑退出，已经关闭了监听socket
+    }
+    while( accepted < m_accept_batch )
+    {
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof( client_address );
+        int connfd = accept4( m_listenfd, ( struct sockaddr* )&client_address, &client_addrlength, SOCK_NONBLOCK | SOCK_CLOEXEC );
+        if ( connfd < 0 )
+        {
+            if( errno == EINTR || errno == ECONNABORTED )
+            {
+                continue;
+            }
+            if( errno != EAGAIN && errno != EWOULDBLOCK )
+            {
+                LOG( LOG_ERR, "errno: %s", strerror( errno ) );
+            }
+            return accepted;
+        }
+        ++accepted;
+        add_client( manager, connfd, client_address );
+    }
+    //达到上限时backlog中可能还有连接，ET模式下不会再通知，由run_child在本轮事件处理完之后继续accept
+    m_accept_pending = true;
+    return accepted;
 }
 
 template< typename C, typename H, typename M >
-void processpool< C, H, M >::notify_parent_busy_ratio( int pipefd, M* manager )
+void processpool< C, H, M >::accept_batch( M* manager, int pipefd )
 {
-    int msg = manager->get_used_conn_cnt();
-    send( pipefd, ( char* )&msg, 1, 0 );    
+    int accepted = accept_clients( manager );
+    if( accepted > 0 )
+    {
+        LOG( LOG_DEBUG, "child %d accepted %d connections", m_idx, accepted );
+        report_stats( manager, pipefd );
+    }
 }
 
 template< typename C, typename H, typename M >
 void processpool< C, H, M >::run_child( const vector<H>& arg )
 {
     setup_sig_pipe();   //注册统一事件源，本质是使得信号事件能和其他I/O事件一样被处理
+    if( m_ready_fd != -1 )
+    {
+        close( m_ready_fd );
+        m_ready_fd = -1;
+    }
+    if( m_admin_fd != -1 )
+    {
+        close( m_admin_fd );
+        m_admin_fd = -1;
+    }
 
     int pipefd_read = m_sub_process[m_idx].m_pipefd[ 1 ];
     add_read_fd( m_epollfd, pipefd_read );
 
+    if( m_accept_mode != ACCEPT_DISPATCH )
+    {
+        //子进程直接监听自己的socket，不再经过父进程转发
+        add_read_fd( m_epollfd, m_listenfd );
+    }
+    else
+    {
+        //与父进程共享的监听socket，批量accept时需要非阻塞
+        setnonblocking( m_listenfd );
+    }
+    if( m_accept_mode == ACCEPT_REUSEPORT_CPU )
+    {
+        cpu_set_t mask;
+        CPU_ZERO( &mask );
+        CPU_SET( m_idx % sysconf( _SC_NPROCESSORS_ONLN ), &mask );
+        if( sched_setaffinity( 0, sizeof( mask ), &mask ) < 0 )
+        {
+            LOG( LOG_ERR, "set cpu affinity failed: %s", strerror( errno ) );
+        }
+    }
+
     epoll_event events[ MAX_EVENT_NUMBER ];
 
-    M* manager = new M( m_epollfd, arg[m_idx] );    //此处实例化一个mgr类的对象
+    M* manager = new M( m_epollfd, arg, m_shm ? &m_shm[ m_idx ] : NULL );    //此处实例化一个mgr类的对象
     assert( manager );
 
     int number = 0;
@@ -205,55 +627,71 @@ void processpool< C, H, M >::run_child( const vector<H>& arg )
     while( ! m_stop )
     {
         //监听m_epollfd上是否有事件
-        number = epoll_wait( m_epollfd, events, MAX_EVENT_NUMBER, EPOLL_WAIT_TIME );
+        //有正在进行的连接或等待重连的连接时，缩短超时值以便及时处理连接超时和重试
+        //还有没accept完的连接时不等待
+        number = epoll_wait( m_epollfd, events, MAX_EVENT_NUMBER, m_accept_pending ? 0 : manager->get_wait_time( STATS_INTERVAL ) );
+        log_tick();
+        long long loop_start = get_cur_us();
+        manager->set_now( loop_start );
+        //平滑退出时等所有客户都离开（或者超时）再退出
+        if( m_quitting && ( ( manager->get_used_conn_cnt() == 0 ) || ( loop_start / 1000 >= m_quit_deadline ) ) )
+        {
+            LOG( LOG_INFO, "child %d quit with %d clients left", m_idx, manager->get_used_conn_cnt() );
+            break;
+        }
         if ( ( number < 0 ) && ( errno != EINTR ) ) //错误处理
         {
-            log( LOG_ERR, __FILE__, __LINE__, "%s", "epoll failure" );
+            LOG( LOG_ERR, "%s", "epoll failure" );
             break;
         }
 
-        if( number == 0 )   //在EPOLL_WAIT_TIME指定事件内没有事件到达时返回0
+        if( number <= 0 )   //在超时时间内没有事件到达时返回0
         {
+            if( m_accept_pending )
+            {
+                accept_batch( manager, pipefd_read );
+            }
             manager->recycle_conns();
+            report_stats( manager, pipefd_read );
             continue;
         }
 
         for ( int i = 0; i < number; i++ )
         {
-            int sockfd = events[i].data.fd;
+            //管道和信号管道通过add_read_fd注册，data中只有fd；客户端和服务端socket通过add_read_ptr注册，
+            //data.ptr中是带标记的连接对象地址，二者不会相等，因此可以直接比较data.u64来区分
+            unsigned long long data = events[i].data.u64;
             //是父进程发送的消息（通知有新的客户连接到来）
-            if( ( sockfd == pipefd_read ) && ( events[i].events & EPOLLIN ) )
+            if( ( data == ( unsigned long long )pipefd_read ) && ( events[i].events & EPOLLIN ) )
             {
-                int client = 0;
-                ret = recv( sockfd, ( char* )&client, sizeof( client ), 0 );
-                if( ( ( ret < 0 ) && ( errno != EAGAIN ) ) || ret == 0 )    //recv失败
-                {
-                    continue;
-                }
-                else
+                //ET模式下父进程的多次通知可能合并成一次可读事件，因此一直读到EAGAIN。
+                //普通的通知表示监听socket上有新连接；带有文件描述符的消息是父进程已经accept好的连接
+                bool notified = false;
+                int connfd = -1;
+                while( recv_fd( pipefd_read, &connfd ) > 0 )
                 {
-                    struct sockaddr_in client_address;
-                    socklen_t client_addrlength = sizeof( client_address );
-                    int connfd = accept( m_listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
-                    if ( connfd < 0 )
+                    if( connfd < 0 )
                     {
-                        log( LOG_ERR, __FILE__, __LINE__, "errno: %s", strerror( errno ) );
+                        notified = true;
                         continue;
                     }
-                    //将客户端文件描述符connfd上的可读事件加入内核时间表
-                    add_read_fd( m_epollfd, connfd );
-                    C* conn = manager->pick_conn( connfd ); //获取一个空闲的连接
-                    if( !conn )
-                    {
-                        closefd( m_epollfd, connfd );
-                        continue;
-                    }
-                    conn->init_clt( connfd, client_address );   //初始化客户端信息
-                    notify_parent_busy_ratio( pipefd_read, manager );
+                    struct sockaddr_in client_address;
+                    socklen_t client_addrlength = sizeof( client_address );
+                    getpeername( connfd, ( struct sockaddr* )&client_address, &client_addrlength );
+                    add_client( manager, connfd, client_address );
+                }
+                if( notified )
+                {
+                    accept_batch( manager, pipefd_read );
                 }
             }
+            //SO_REUSEPORT模式下自己的监听socket上有新连接
+            else if( ( data == ( unsigned long long )m_listenfd ) && ( events[i].events & EPOLLIN ) )
+            {
+                accept_batch( manager, pipefd_read );
+            }
             //处理自身进程接收到的信号
-            else if( ( sockfd == sig_pipefd[0] ) && ( events[i].events & EPOLLIN ) )
+            else if( ( data == ( unsigned long long )sig_pipefd[0] ) && ( events[i].events & EPOLLIN ) )
             {
                 int sig;
                 char signals[1024];
@@ -285,6 +723,42 @@ void processpool< C, H, M >::run_child( const vector<H>& arg )
                                 m_stop = true;
                                 break;
                             }
+                            case SIGQUIT:   //平滑退出：关闭监听socket，不再接受新连接，已有的连接继续服务
+                            {
+                                if( m_quitting )
+                                {
+                                    break;
+                                }
+                                m_quitting = true;
+                                m_quit_deadline = get_cur_us() / 1000 + QUIT_TIMEOUT;
+                                if( m_accept_mode != ACCEPT_DISPATCH )
+                                {
+                                    closefd( m_epollfd, m_listenfd );
+                                }
+                                else
+                                {
+                                    close( m_listenfd );
+                                }
+                                m_listenfd = -1;
+                                m_accept_pending = false;
+                                LOG( LOG_INFO, "child %d stops accepting, %d clients left", m_idx, manager->get_used_conn_cnt() );
+                                break;
+                            }
+                            case SIGHUP:    //使用父进程重新加载的配置，在不中断已有连接的情况下增删逻辑主机
+                            {
+                                //配置文件只由父进程读取和检查，所有子进程得到的配置都相同
+                                vector<H> hosts;
+                                if( read_hosts( hosts ) )
+                                {
+                                    manager->reload( hosts );
+                                    notify_parent_stats( pipefd_read, manager );
+                                }
+                                else
+                                {
+                                    LOG( LOG_ERR, "child %d has no reloaded config, keep the old one", m_idx );
+                                }
+                                break;
+                            }
                             default:
                             {
                                 break;
@@ -293,41 +767,34 @@ void processpool< C, H, M >::run_child( const vector<H>& arg )
                     }
                 }
             }
-            else if( events[i].events & EPOLLIN )   //有sockfd上有数据可读
+            //sockfd上有数据可读，或者有事件可写（只有sockfd写缓冲满了或者给某个sockfd注册O_EPOLLOUT才会触发）。
+            //连接的两端可能同时注册了EPOLLIN和EPOLLOUT，因此同一个事件中的读和写都要处理
+            else if( events[i].events & ( EPOLLIN | EPOLLOUT ) )
             {
-                 RET_CODE result = manager->process( sockfd, READ );
-                 switch( result )
+                 RET_CODE result = NOTHING;
+                 if( events[i].events & EPOLLIN )
                  {
-                     case CLOSED:
-                     {
-                         notify_parent_busy_ratio( pipefd_read, manager );
-                         break;
-                     }
-                     default:
-                         break;
+                     result = manager->process( events[i].data.ptr, READ );
                  }
-            }
-            //有事件可写（只有sockfd写缓冲满了或者给某个sockfd注册O_EPOLLOUT才会触发）
-            else if( events[i].events & EPOLLOUT )
-            {
-                 RET_CODE result = manager->process( sockfd, WRITE );
-                 //根据返回的状态进行处理
-                 switch( result )
+                 if( ( result != CLOSED ) && ( events[i].events & EPOLLOUT ) )
                  {
-                     case CLOSED:
-                     {
-                         notify_parent_busy_ratio( pipefd_read, manager );
-                         break;
-                     }
-                     default:
-                         break;
+                     manager->process( events[i].data.ptr, WRITE );
                  }
+                 //连接关闭后活动连接数的变化由本轮末尾的report_stats报告
             }
             else
             {
                 continue;
             }
         }
+        if( m_accept_pending )
+        {
+            accept_batch( manager, pipefd_read );
+        }
+        //连接的超时和重连都是非阻塞的，因此每轮事件处理之后都检查一次
+        manager->recycle_conns();
+        record_loop_time( get_cur_us() - loop_start );
+        report_stats( manager, pipefd_read );
     }
 
     close( pipefd_read );
@@ -344,50 +811,62 @@ void processpool< C, H, M >::run_parent()
         add_read_fd( m_epollfd, m_sub_process[i].m_pipefd[ 0 ] );
     }
 
-    add_read_fd( m_epollfd, m_listenfd );
+    if( !m_policy )
+    {
+        m_policy = new least_conn_policy;
+    }
+
+    //SO_REUSEPORT模式下由子进程各自accept，父进程只负责管理子进程
+    if( m_accept_mode == ACCEPT_DISPATCH )
+    {
+        add_read_fd( m_epollfd, m_listenfd );
+    }
+    if( m_admin_fd != -1 )
+    {
+        add_read_fd( m_epollfd, m_admin_fd );
+    }
+
+    //由旧的主进程启动时，子进程都已经fork出来，可以接替旧的主进程了
+    if( m_ready_fd != -1 )
+    {
+        char ready = 1;
+        send( m_ready_fd, &ready, 1, 0 );
+        close( m_ready_fd );
+        m_ready_fd = -1;
+    }
 
     epoll_event events[ MAX_EVENT_NUMBER ];
-    int sub_process_counter = 0;
     int new_conn = 1;
     int number = 0;
     int ret = -1;
 
     while( ! m_stop )
     {
-        number = epoll_wait( m_epollfd, events, MAX_EVENT_NUMBER, EPOLL_WAIT_TIME );
+        number = epoll_wait( m_epollfd, events, MAX_EVENT_NUMBER, get_parent_wait_time() );
+        log_tick();
         if ( ( number < 0 ) && ( errno != EINTR ) )
         {
-            log( LOG_ERR, __FILE__, __LINE__, "%s", "epoll failure" );
+            LOG( LOG_ERR, "%s", "epoll failure" );
             break;
         }
 
         for ( int i = 0; i < number; i++ )
         {
             int sockfd = events[i].data.fd;
-            if( sockfd == m_listenfd )
+            if( ( m_accept_mode == ACCEPT_DISPATCH ) && ( sockfd == m_listenfd ) && !m_quitting )
             {
-                /*
-                int i =  sub_process_counter;
-                do
+                if( m_policy->need_client_addr() )
                 {
-                    if( m_sub_process[i].m_pid != -1 )
-                    {
-                        break;
-                    }
-                    i = (i+1)%m_process_number;
+                    dispatch_conns();
+                    continue;
                 }
-                while( i != sub_process_counter );
-                
-                if( m_sub_process[i].m_pid == -1 )
+                int idx = select_child( NULL );
+                if( idx == -1 )
                 {
-                    m_stop = true;
-                    break;
+                    continue;
                 }
-                sub_process_counter = (i+1)%m_process_number;
-                */
-                int idx = get_most_free_srv();
                 send( m_sub_process[idx].m_pipefd[0], ( char* )&new_conn, sizeof( new_conn ), 0 );
-                log( LOG_INFO, __FILE__, __LINE__, "send request to child %d", idx );
+                LOG( LOG_INFO, "send request to child %d", idx );
             }
             else if( ( sockfd == sig_pipefd[0] ) && ( events[i].events & EPOLLIN ) )
             {
@@ -412,28 +891,68 @@ void processpool< C, H, M >::run_parent()
                                 {
                                     for( int i = 0; i < m_process_number; ++i )
                                     {
-                                        if( m_sub_process[i].m_pid == pid )
+                                        if( m_sub_process[i].m_pid != pid )
+                                        {
+                                            continue;
+                                        }
+                                        LOG( LOG_INFO, "child %d join", i );
+                                        close( m_sub_process[i].m_pipefd[0] );
+                                        m_sub_process[i].m_pid = -1;
+                                        m_child_alive[i] = false;
+                                        if( m_quitting )
+                                        {
+                                            continue;
+                                        }
+                                        //意外退出的子进程稍后重新启动，启动后很快又退出的子进程等待的时间加倍，避免反复崩溃占满CPU
+                                        process& child = m_sub_process[i];
+                                        long long now = get_cur_us() / 1000;
+                                        if( ( child.m_backoff > 0 ) && ( now - child.m_started_at < MIN_UPTIME ) )
                                         {
-                                            log( LOG_INFO, __FILE__, __LINE__, "child %d join", i );
-                                            close( m_sub_process[i].m_pipefd[0] );
-                                            m_sub_process[i].m_pid = -1;
+                                            child.m_backoff = ( child.m_backoff * 2 < RESPAWN_BACKOFF_MAX ) ? child.m_backoff * 2 : RESPAWN_BACKOFF_MAX;
                                         }
+                                        else
+                                        {
+                                            child.m_backoff = RESPAWN_BACKOFF_MIN;
+                                        }
+                                        child.m_respawn_at = now + child.m_backoff;
+                                        LOG( LOG_ERR, "child %d exited unexpectedly (exit code %d, signal %d), respawn in %d ms", i,
+                                             WIFEXITED( stat ) ? WEXITSTATUS( stat ) : -1, WIFSIGNALED( stat ) ? WTERMSIG( stat ) : 0, child.m_backoff );
                                     }
                                 }
                                 m_stop = true;
                                 for( int i = 0; i < m_process_number; ++i )
                                 {
-                                    if( m_sub_process[i].m_pid != -1 )
+                                    if( ( m_sub_process[i].m_pid != -1 ) || ( m_sub_process[i].m_respawn_at != -1 ) )
                                     {
                                         m_stop = false;
                                     }
                                 }
                                 break;
                             }
+                            case SIGQUIT:
+                            {
+                                quit_gracefully();
+                                break;
+                            }
+                            case SIGUSR2:
+                            {
+                                start_upgrade();
+                                break;
+                            }
                             case SIGTERM:
                             case SIGINT:
                             {
-                                log( LOG_INFO, __FILE__, __LINE__, "%s", "kill all the clild now" );
+                                LOG( LOG_INFO, "%s", "kill all the clild now" );
+                                m_quitting = true;
+                                m_stop = true;
+                                for( int i = 0; i < m_process_number; ++i )
+                                {
+                                    m_sub_process[i].m_respawn_at = -1;
+                                    if( m_sub_process[i].m_pid != -1 )
+                                    {
+                                        m_stop = false;
+                                    }
+                                }
                                 for( int i = 0; i < m_process_number; ++i )
                                 {
                                     int pid = m_sub_process[i].m_pid;
@@ -444,6 +963,27 @@ void processpool< C, H, M >::run_parent()
                                 }
                                 break;
                             }
+                            case SIGHUP:
+                            {
+                                //先在父进程中检查新的配置，有错误时子进程保持原来的配置
+                                vector<H> hosts;
+                                if( !m_reload || !m_reload( hosts ) || !publish_hosts( hosts ) )
+                                {
+                                    LOG( LOG_ERR, "%s", "reload config failed, keep the old one" );
+                                    break;
+                                }
+                                LOG( LOG_INFO, "reload config with %d logical srvs", ( int )hosts.size() );
+                                m_hosts = hosts;
+                                for( int i = 0; i < m_process_number; ++i )
+                                {
+                                    int pid = m_sub_process[i].m_pid;
+                                    if( pid != -1 )
+                                    {
+                                        kill( pid, SIGHUP );
+                                    }
+                                }
+                                break;
+                            }
                             default:
                             {
                                 break;
@@ -452,11 +992,32 @@ void processpool< C, H, M >::run_parent()
                     }
                 }
             }
+            else if( ( sockfd == m_upgrade_fd ) && ( events[i].events & ( EPOLLIN | EPOLLRDHUP | EPOLLHUP ) ) )
+            {
+                finish_upgrade();
+            }
+            else if( ( sockfd == m_admin_fd ) && ( m_admin_fd != -1 ) )
+            {
+                accept_admin();
+            }
+            else if( serve_admin( sockfd ) )
+            {
+                continue;
+            }
             else if( events[i].events & EPOLLIN )
             {
-                int busy_ratio = 0;
-                ret = recv( sockfd, ( char* )&busy_ratio, sizeof( busy_ratio ), 0 );
-                if( ( ( ret < 0 ) && ( errno != EAGAIN ) ) || ret == 0 )
+                //ET模式下一次可能积压了多条负载信息，每次recv得到一条，读到EAGAIN为止，只保留最新的一条
+                child_stats stats, latest;
+                bool got = false;
+                while( ( ret = recv( sockfd, ( char* )&stats, sizeof( stats ), 0 ) ) > 0 )
+                {
+                    if( ret == ( int )sizeof( stats ) )
+                    {
+                        latest = stats;
+                        got = true;
+                    }
+                }
+                if( ! got )
                 {
                     continue;
                 }
@@ -464,13 +1025,24 @@ void processpool< C, H, M >::run_parent()
                 {
                     if( sockfd == m_sub_process[i].m_pipefd[0] )
                     {
-                        m_sub_process[i].m_busy_ratio = busy_ratio;
+                        m_child_stats[i] = latest;
+                        LOG( LOG_DEBUG, "child %d: %d active conns, %d idle srv conns, %llu bytes relayed, %llu eagain, loop p99 %d us",
+                             i, m_child_stats[i].m_active_conns, m_child_stats[i].m_pool_depth,
+                             m_child_stats[i].m_bytes_relayed, m_child_stats[i].m_eagain_cnt, m_child_stats[i].m_loop_p99_us );
+                        LOG( LOG_DEBUG, "child %d: %d waiting clients, %llu pool hits, %llu waits, %llu wait timeouts, %llu ms waited",
+                             i, m_child_stats[i].m_waiting_clts, m_child_stats[i].m_pool_hits, m_child_stats[i].m_pool_waits,
+                             m_child_stats[i].m_wait_timeouts, m_child_stats[i].m_wait_ms );
                         break;
                     }
                 }
                 continue;
             }
         }
+        respawn_children();
+        if( m_idx != -1 )
+        {
+            return; //在重新启动的子进程中，由run接着执行run_child
+        }
     }
 
     for( int i = 0; i < m_process_number; ++i )
@@ -480,4 +1052,376 @@ void processpool< C, H, M >::run_parent()
     close( m_epollfd );
 }
 
+template< typename C, typename H, typename M >
+int processpool< C, H, M >::get_parent_wait_time()
+{
+    long long now = get_cur_us() / 1000;
+    long long wait = EPOLL_WAIT_TIME;
+    for( int i = 0; i < m_process_number; ++i )
+    {
+        if( ( m_sub_process[i].m_respawn_at != -1 ) && ( m_sub_process[i].m_respawn_at - now < wait ) )
+        {
+            wait = m_sub_process[i].m_respawn_at - now;
+        }
+    }
+    return wait < 0 ? 0 : ( int )wait;
+}
+
+template< typename C, typename H, typename M >
+void processpool< C, H, M >::respawn_children()
+{
+    long long now = get_cur_us() / 1000;
+    for( int i = 0; i < m_process_number; ++i )
+    {
+        if( ( m_sub_process[i].m_respawn_at == -1 ) || ( m_sub_process[i].m_respawn_at > now ) )
+        {
+            continue;
+        }
+        if( !respawn_child( i ) )
+        {
+            //fork失败时按同样的退避时间再试
+            m_sub_process[i].m_respawn_at = now + m_sub_process[i].m_backoff;
+            continue;
+        }
+        if( m_idx != -1 )
+        {
+            return;
+        }
+    }
+}
+
+template< typename C, typename H, typename M >
+void processpool< C, H, M >::close_parent_fds( int keep_listenfd )
+{
+    //epoll内核事件表是和父进程共享的，只能直接close，不能用closefd从中删除父进程注册的fd
+    close( m_epollfd );
+    close( sig_pipefd[0] );
+    close( sig_pipefd[1] );
+    if( m_upgrade_fd != -1 )
+    {
+        close( m_upgrade_fd );
+        m_upgrade_fd = -1;
+    }
+    if( m_admin_fd != -1 )
+    {
+        close( m_admin_fd );
+        m_admin_fd = -1;
+    }
+    for( int i = 0; i < MAX_ADMIN_CLTS; ++i )
+    {
+        if( m_admin_clts[i] != -1 )
+        {
+            close( m_admin_clts[i] );
+            m_admin_clts[i] = -1;
+        }
+    }
+    for( int i = 0; i < m_process_number; ++i )
+    {
+        if( m_sub_process[i].m_pid != -1 )
+        {
+            close( m_sub_process[i].m_pipefd[0] );
+        }
+        if( ( m_accept_mode != ACCEPT_DISPATCH ) && ( m_sub_process[i].m_listenfd != keep_listenfd ) )
+        {
+            close( m_sub_process[i].m_listenfd );
+        }
+    }
+}
+
+template< typename C, typename H, typename M >
+bool processpool< C, H, M >::respawn_child( int idx )
+{
+    int pipefd[2];
+    if( socketpair( PF_UNIX, SOCK_SEQPACKET, 0, pipefd ) < 0 )
+    {
+        LOG( LOG_ERR, "respawn child %d failed: %s", idx, strerror( errno ) );
+        return false;
+    }
+    pid_t pid = fork();
+    if( pid < 0 )
+    {
+        LOG( LOG_ERR, "respawn child %d failed: %s", idx, strerror( errno ) );
+        close( pipefd[0] );
+        close( pipefd[1] );
+        return false;
+    }
+    if( pid > 0 )
+    {
+        close( pipefd[1] );
+        process& child = m_sub_process[idx];
+        child.m_pid = pid;
+        child.m_pipefd[0] = pipefd[0];
+        child.m_started_at = get_cur_us() / 1000;
+        child.m_respawn_at = -1;
+        memset( &m_child_stats[idx], 0, sizeof( child_stats ) );
+        m_child_alive[idx] = true;
+        add_read_fd( m_epollfd, pipefd[0] );
+        LOG( LOG_INFO, "respawn child %d with pid %d", idx, pid );
+        return true;
+    }
+
+    //新的子进程：只保留自己的管道和监听socket，其余状态与启动时fork出的子进程相同
+    close( pipefd[0] );
+    int listenfd = ( m_accept_mode != ACCEPT_DISPATCH ) ? m_sub_process[idx].m_listenfd : m_listenfd;
+    //SO_REUSEPORT模式下m_listenfd就是0号子进程的监听socket，不是自己的时已经被close_parent_fds关闭了
+    close_parent_fds( listenfd );
+    m_listenfd = listenfd;
+    m_sub_process[idx].m_pipefd[1] = pipefd[1];
+    m_idx = idx;
+    m_stop = true;  //结束父进程的事件循环
+    return true;
+}
+
+template< typename C, typename H, typename M >
+bool processpool< C, H, M >::publish_hosts( const vector<H>& hosts )
+{
+    if( !m_hosts_shm || hosts.empty() || ( int )hosts.size() > MAX_RELOAD_HOSTS )
+    {
+        LOG( LOG_ERR, "can not pass %d logical srvs to children", ( int )hosts.size() );
+        return false;
+    }
+    //只有父进程写，不需要与其他写者互斥
+    __atomic_store_n( &m_hosts_shm->m_gen, m_hosts_shm->m_gen + 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    m_hosts_shm->m_count = hosts.size();
+    memcpy( ( void* )( m_hosts_shm + 1 ), &hosts[0], hosts.size() * sizeof( H ) );
+    __atomic_store_n( &m_hosts_shm->m_gen, m_hosts_shm->m_gen + 1, __ATOMIC_RELEASE );
+    return true;
+}
+
+template< typename C, typename H, typename M >
+bool processpool< C, H, M >::read_hosts( vector<H>& hosts )
+{
+    if( !m_hosts_shm )
+    {
+        return false;
+    }
+    while( true )
+    {
+        unsigned int gen = __atomic_load_n( &m_hosts_shm->m_gen, __ATOMIC_ACQUIRE );
+        if( gen == 0 )
+        {
+            return false;   //父进程还没有重新加载过配置
+        }
+        if( gen & 1 )
+        {
+            sched_yield();  //父进程正在写
+            continue;
+        }
+        int count = m_hosts_shm->m_count;
+        if( count <= 0 || count > MAX_RELOAD_HOSTS )
+        {
+            continue;
+        }
+        hosts.resize( count );
+        memcpy( ( void* )&hosts[0], m_hosts_shm + 1, count * sizeof( H ) );
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+        if( __atomic_load_n( &m_hosts_shm->m_gen, __ATOMIC_RELAXED ) == gen )
+        {
+            return true;
+        }
+    }
+}
+
+template< typename C, typename H, typename M >
+void processpool< C, H, M >::quit_gracefully()
+{
+    if( m_quitting )
+    {
+        return;
+    }
+    LOG( LOG_INFO, "%s", "quit gracefully, wait for the children to finish their clients" );
+    m_quitting = true;
+    if( m_accept_mode == ACCEPT_DISPATCH )
+    {
+        removefd( m_epollfd, m_listenfd );
+    }
+    m_stop = true;
+    for( int i = 0; i < m_process_number; ++i )
+    {
+        m_sub_process[i].m_respawn_at = -1;
+        if( m_sub_process[i].m_pid != -1 )
+        {
+            kill( m_sub_process[i].m_pid, SIGQUIT );
+            m_stop = false;
+        }
+    }
+}
+
+template< typename C, typename H, typename M >
+void processpool< C, H, M >::start_upgrade()
+{
+    if( !m_argv || ( m_upgrade_fd != -1 ) || m_quitting )
+    {
+        LOG( LOG_ERR, "%s", "can not upgrade now" );
+        return;
+    }
+    int fds[2];
+    if( socketpair( PF_UNIX, SOCK_STREAM, 0, fds ) < 0 )
+    {
+        LOG( LOG_ERR, "upgrade failed: %s", strerror( errno ) );
+        return;
+    }
+    pid_t pid = fork();
+    if( pid < 0 )
+    {
+        LOG( LOG_ERR, "upgrade failed: %s", strerror( errno ) );
+        close( fds[0] );
+        close( fds[1] );
+        return;
+    }
+    if( pid == 0 )
+    {
+        //新的主进程只继承监听socket和fds[1]，通过环境变量告诉它fds[1]的值
+        close( fds[0] );
+        close_parent_fds( m_listenfd );
+        close( m_listenfd );
+        char env[ 16 ];
+        snprintf( env, sizeof( env ), "%d", fds[1] );
+        setenv( UPGRADE_ENV, env, 1 );
+        execv( m_argv[0], m_argv );
+        LOG( LOG_ERR, "exec %s failed: %s", m_argv[0], strerror( errno ) );
+        log_flush();
+        _exit( 1 );
+    }
+
+    //与chapter13中13_9_1_passfd.cpp相同，通过UNIX域socket传递监听socket。SO_REUSEPORT模式下按组中的顺序传递所有子进程的socket，
+    //旧的子进程退出时它们仍然打开着，积压的连接不会被重置。最后发送一条不带文件描述符的消息表示结束
+    close( fds[1] );
+    int count = ( m_accept_mode != ACCEPT_DISPATCH ) ? m_process_number : 1;
+    int end = 0;
+    for( int i = 0; i < count; ++i )
+    {
+        int listenfd = ( m_accept_mode != ACCEPT_DISPATCH ) ? m_sub_process[i].m_listenfd : m_listenfd;
+        if( send_fd( fds[0], listenfd ) < 0 )
+        {
+            LOG( LOG_ERR, "send listen socket to new master failed: %s", strerror( errno ) );
+            close( fds[0] );
+            return;
+        }
+    }
+    if( send( fds[0], &end, sizeof( end ), 0 ) != sizeof( end ) )
+    {
+        LOG( LOG_ERR, "send listen socket to new master failed: %s", strerror( errno ) );
+        close( fds[0] );
+        return;
+    }
+    m_upgrade_fd = fds[0];
+    add_read_fd( m_epollfd, m_upgrade_fd );
+    LOG( LOG_INFO, "start new master %d, wait for it to be ready", pid );
+}
+
+template< typename C, typename H, typename M >
+void processpool< C, H, M >::finish_upgrade()
+{
+    char ready = 0;
+    int ret = recv( m_upgrade_fd, &ready, 1, 0 );
+    if( ( ret < 0 ) && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+    {
+        return;
+    }
+    closefd( m_epollfd, m_upgrade_fd );
+    m_upgrade_fd = -1;
+    if( ret != 1 )
+    {
+        //新的主进程在就绪之前退出了，继续由自己提供服务
+        LOG( LOG_ERR, "%s", "new master exited before it is ready, upgrade aborted" );
+        return;
+    }
+    LOG( LOG_INFO, "%s", "new master is ready" );
+    quit_gracefully();
+}
+
+template< typename C, typename H, typename M >
+void processpool< C, H, M >::accept_admin()
+{
+    while( true )
+    {
+        int connfd = accept4( m_admin_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+        if( connfd < 0 )
+        {
+            if( errno == EINTR )
+            {
+                continue;
+            }
+            return;
+        }
+        int i = 0;
+        while( ( i < MAX_ADMIN_CLTS ) && ( m_admin_clts[i] != -1 ) )
+        {
+            ++i;
+        }
+        if( i == MAX_ADMIN_CLTS )
+        {
+            close( connfd );
+            continue;
+        }
+        m_admin_clts[i] = connfd;
+        add_read_fd( m_epollfd, connfd );
+    }
+}
+
+template< typename C, typename H, typename M >
+bool processpool< C, H, M >::serve_admin( int sockfd )
+{
+    int idx = 0;
+    while( ( idx < MAX_ADMIN_CLTS ) && ( m_admin_clts[idx] != sockfd ) )
+    {
+        ++idx;
+    }
+    if( idx == MAX_ADMIN_CLTS )
+    {
+        return false;
+    }
+    //只看请求的第一个数据包："GET /json"之类路径中含有json的请求输出JSON，其余输出文本；不是HTTP请求时（例如nc）只输出正文
+    char req[ 256 ];
+    int ret = recv( sockfd, req, sizeof( req ) - 1, 0 );
+    if( ( ret < 0 ) && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+    {
+        return true;
+    }
+    m_admin_clts[idx] = -1;
+    if( ret <= 0 )
+    {
+        closefd( m_epollfd, sockfd );
+        return true;
+    }
+    req[ ret ] = '\0';
+    bool http = ( strncmp( req, "GET ", 4 ) == 0 );
+    char* line_end = strpbrk( req, "\r\n" );
+    if( line_end )
+    {
+        *line_end = '\0';
+    }
+    bool json = ( strstr( req, "json" ) != NULL );
+
+    static char page[ ADMIN_PAGE_SIZE ];
+    static const int HEADER_SIZE = 128;
+    pid_t pids[ MAX_PROCESS_NUMBER ];
+    for( int i = 0; i < m_process_number; ++i )
+    {
+        pids[i] = m_sub_process[i].m_pid;
+    }
+    int len = 0;
+    if( m_shm )
+    {
+        len = format_stats( page + HEADER_SIZE, ADMIN_PAGE_SIZE - HEADER_SIZE, json, m_child_stats, m_child_alive, pids, m_shm, m_process_number );
+    }
+    char* start = page + HEADER_SIZE;
+    if( http )
+    {
+        //把HTTP头部写在正文前面预留的位置上，一次send写出
+        char header[ HEADER_SIZE ];
+        int header_len = snprintf( header, sizeof( header ), "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %d\r\n\r\n",
+                                   json ? "application/json" : "text/plain", len );
+        start -= header_len;
+        memcpy( start, header, header_len );
+        len += header_len;
+    }
+    //页面很小，一次写不完（对端接收缓冲区满）时丢弃剩余的部分，父进程不为统计页面等待
+    send( sockfd, start, len, MSG_NOSIGNAL );
+    closefd( m_epollfd, sockfd );
+    return true;
+}
+
 #endif
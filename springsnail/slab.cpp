@@ -0,0 +1,89 @@
+#include <new>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "slab.h"
+#include "log.h"
+
+conn_slab::conn_slab( int buf_size, int capacity ) : m_free( NULL )
+{
+    m_buf_size = 1;
+    while( m_buf_size < buf_size )
+    {
+        m_buf_size <<= 1;
+    }
+    int header = ( sizeof( conn ) + HEADER_ALIGN - 1 ) / HEADER_ALIGN * HEADER_ALIGN;
+    m_slot_size = header + 2 * m_buf_size;
+    if( capacity > 0 )
+    {
+        grow( capacity );
+    }
+}
+
+conn_slab::~conn_slab()
+{
+    for( size_t i = 0; i < m_arenas.size(); ++i )
+    {
+        munmap( m_arenas[i].m_addr, m_arenas[i].m_len );
+    }
+}
+
+bool conn_slab::grow( int slots )
+{
+    size_t len = ( ( size_t )slots * m_slot_size + HUGE_PAGE_SIZE - 1 ) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    //优先使用预留的大页，没有预留时退回到普通页，并多映射一个大页的长度以便按大页对齐后交给透明大页
+    char* addr = ( char* )mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+    if( addr == MAP_FAILED )
+    {
+        char* raw = ( char* )mmap( NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if( raw == MAP_FAILED )
+        {
+            LOG( LOG_ERR, "map conn arena failed: %s", strerror( errno ) );
+            return false;
+        }
+        addr = ( char* )( ( ( unsigned long )raw + HUGE_PAGE_SIZE - 1 ) & ~( ( unsigned long )HUGE_PAGE_SIZE - 1 ) );
+        if( addr != raw )
+        {
+            munmap( raw, addr - raw );
+        }
+        if( addr + len != raw + len + HUGE_PAGE_SIZE )
+        {
+            munmap( addr + len, raw + len + HUGE_PAGE_SIZE - ( addr + len ) );
+        }
+        madvise( addr, len, MADV_HUGEPAGE );
+    }
+    arena tmp;
+    tmp.m_addr = addr;
+    tmp.m_len = len;
+    m_arenas.push_back( tmp );
+
+    //倒序加入空闲链表，使先分配的槽位地址更低
+    int cnt = len / m_slot_size;
+    for( int i = cnt - 1; i >= 0; --i )
+    {
+        void* slot = addr + ( size_t )i * m_slot_size;
+        *( void** )slot = m_free;
+        m_free = slot;
+    }
+    LOG( LOG_INFO, "map conn arena of %lu bytes, %d slots of %d bytes", ( unsigned long )len, cnt, m_slot_size );
+    return true;
+}
+
+conn* conn_slab::alloc()
+{
+    if( !m_free && !grow( 1 ) )
+    {
+        return NULL;
+    }
+    char* slot = ( char* )m_free;
+    m_free = *( void** )slot;
+    char* buf = slot + m_slot_size - 2 * m_buf_size;
+    return new( slot ) conn( buf, m_buf_size );
+}
+
+void conn_slab::free( conn* connection )
+{
+    connection->~conn();
+    *( void** )connection = m_free;
+    m_free = connection;
+}
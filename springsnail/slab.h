@@ -0,0 +1,40 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <vector>
+#include "conn.h"
+
+using std::vector;
+
+// conn对象的slab分配器，每个子进程中每个逻辑主机一个。
+// 每个槽位依次存放conn对象和它的两个环形缓冲区，槽位连续地切分自按大页对齐的arena，
+// 释放的槽位通过空闲链表复用，分配和释放都不调用malloc
+class conn_slab
+{
+public:
+    conn_slab( int buf_size, int capacity );    //按buf_size（向上取整为2的幂）划分槽位，并预先准备capacity个槽位
+    ~conn_slab();
+    conn* alloc();  //在空闲槽位上构造一个conn，空闲槽位用完时再映射一个arena，失败时返回NULL
+    void free( conn* connection );  //析构conn并把槽位放回空闲链表
+    int slot_size() const { return m_slot_size; }
+
+private:
+    bool grow( int slots ); //映射一个至少能放下slots个槽位的arena，并把其中的槽位加入空闲链表
+
+private:
+    static const int HUGE_PAGE_SIZE = 2 * 1024 * 1024;  //arena的大小是大页的整数倍
+    static const int HEADER_ALIGN = 64;     //槽位中conn对象占用的空间按缓存行对齐
+
+    struct arena
+    {
+        char* m_addr;
+        size_t m_len;
+    };
+
+    int m_buf_size;     //每个缓冲区的大小
+    int m_slot_size;    //每个槽位的大小：对齐后的conn对象加上两个缓冲区
+    void* m_free;       //空闲链表，槽位的前8个字节保存下一个空闲槽位
+    vector< arena > m_arenas;   //已经映射的arena，析构时解除映射
+};
+
+#endif
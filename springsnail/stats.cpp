@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <vector>
+#include "stats.h"
+
+using std::vector;
+
+void latency_hist::merge( const latency_hist& other )
+{
+    m_count += other.m_count;
+    m_sum += other.m_sum;
+    if( other.m_max > m_max )
+    {
+        m_max = other.m_max;
+    }
+    for( int i = 0; i < BUCKETS; ++i )
+    {
+        m_buckets[i] += other.m_buckets[i];
+    }
+}
+
+long long latency_hist::upper_bound( int idx )
+{
+    if( idx < SUB )
+    {
+        return idx;
+    }
+    int exp = idx / SUB + SUB_BITS - 1;
+    long long lower = ( long long )( SUB + idx % SUB ) << ( exp - SUB_BITS );
+    return lower + ( 1LL << ( exp - SUB_BITS ) ) - 1;
+}
+
+long long latency_hist::percentile( double p ) const
+{
+    if( m_count == 0 )
+    {
+        return 0;
+    }
+    //第p百分位的样本的序号（向上取整），与processpool中估算事件循环p99的方法相同
+    unsigned long long target = ( unsigned long long )( m_count * p / 100 );
+    if( target < m_count * p / 100 || target == 0 )
+    {
+        ++target;
+    }
+    unsigned long long count = 0;
+    for( int i = 0; i < BUCKETS; ++i )
+    {
+        count += m_buckets[i];
+        if( count >= target )
+        {
+            //桶的上界不超过实际的最大值
+            long long value = upper_bound( i );
+            return ( value < ( long long )m_max ) ? value : ( long long )m_max;
+        }
+    }
+    return m_max;
+}
+
+// 向buf追加格式化的内容，写满之后的内容被截断
+static void append( char* buf, int size, int& len, const char* format, ... )
+{
+    if( len >= size - 1 )
+    {
+        return;
+    }
+    va_list arg_list;
+    va_start( arg_list, format );
+    int ret = vsnprintf( buf + len, size - len, format, arg_list );
+    va_end( arg_list );
+    if( ret > 0 )
+    {
+        len = ( len + ret < size - 1 ) ? len + ret : size - 1;
+    }
+}
+
+static void append_hist( char* buf, int size, int& len, bool json, const char* name, const latency_hist& hist )
+{
+    long long mean = hist.m_count ? ( long long )( hist.m_sum / hist.m_count ) : 0;
+    const char* format = json
+        ? ",\"%s\":{\"count\":%llu,\"mean\":%lld,\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,\"p999\":%lld,\"max\":%llu}"
+        : "  %-12s count %llu mean %lld p50 %lld p90 %lld p99 %lld p999 %lld max %llu\n";
+    append( buf, size, len, format, name, hist.m_count, mean, hist.percentile( 50 ), hist.percentile( 90 ),
+            hist.percentile( 99 ), hist.percentile( 99.9 ), hist.m_max );
+}
+
+int format_stats( char* buf, int size, bool json, const child_stats* stats, const bool* alive, const pid_t* pids,
+                  const child_shm* shm, int n )
+{
+    int len = 0;
+    buf[0] = '\0';
+
+    //各个子进程中同一个逻辑主机的位置可能不同（例如重新启动的子进程），按名字汇总
+    vector< backend_stats > total;
+    for( int i = 0; i < n; ++i )
+    {
+        for( int j = 0; j < STATS_BACKENDS; ++j )
+        {
+            const backend_stats& cur = shm[i].m_backends[j];
+            if( cur.m_name[0] == '\0' )
+            {
+                continue;
+            }
+            int k = 0;
+            while( k < ( int )total.size() && strncmp( total[k].m_name, cur.m_name, sizeof( cur.m_name ) ) != 0 )
+            {
+                ++k;
+            }
+            if( k == ( int )total.size() )
+            {
+                total.push_back( backend_stats() );
+                memset( &total[k], 0, sizeof( backend_stats ) );
+                memcpy( total[k].m_name, cur.m_name, sizeof( cur.m_name ) );
+                total[k].m_name[ sizeof( cur.m_name ) - 1 ] = '\0';
+            }
+            backend_stats& sum = total[k];
+            sum.m_connects += cur.m_connects;
+            sum.m_connect_fails += cur.m_connect_fails;
+            sum.m_clients += cur.m_clients;
+            sum.m_bytes_out += cur.m_bytes_out;
+            sum.m_bytes_in += cur.m_bytes_in;
+            sum.m_connect.merge( cur.m_connect );
+            sum.m_ttfb.merge( cur.m_ttfb );
+            sum.m_duration.merge( cur.m_duration );
+        }
+    }
+
+    append( buf, size, len, json ? "{\"children\":[" : "children %d\n", n );
+    for( int i = 0; i < n; ++i )
+    {
+        const child_stats& cs = stats[i];
+        const char* format = json
+            ? "%s{\"idx\":%d,\"pid\":%d,\"alive\":%s,\"active_conns\":%d,\"pool_depth\":%d,\"waiting_clts\":%d,"
+              "\"bytes_relayed\":%llu,\"eagain\":%llu,\"loop_p99_us\":%d,\"pool_hits\":%llu,\"pool_waits\":%llu,"
+              "\"wait_timeouts\":%llu,\"wait_ms\":%llu}"
+            : "%schild %d pid %d %s active %d pool %d waiting %d bytes %llu eagain %llu loop_p99_us %d"
+              " pool_hits %llu pool_waits %llu wait_timeouts %llu wait_ms %llu\n";
+        append( buf, size, len, format, ( json && i > 0 ) ? "," : "", i, ( int )pids[i],
+                json ? ( alive[i] ? "true" : "false" ) : ( alive[i] ? "alive" : "dead" ),
+                cs.m_active_conns, cs.m_pool_depth, cs.m_waiting_clts, cs.m_bytes_relayed, cs.m_eagain_cnt, cs.m_loop_p99_us,
+                cs.m_pool_hits, cs.m_pool_waits, cs.m_wait_timeouts, cs.m_wait_ms );
+    }
+    append( buf, size, len, "%s", json ? "],\"backends\":[" : "" );
+    for( int k = 0; k < ( int )total.size(); ++k )
+    {
+        const backend_stats& sum = total[k];
+        const char* format = json
+            ? "%s{\"name\":\"%s\",\"connects\":%llu,\"connect_fails\":%llu,\"clients\":%llu,\"bytes_out\":%llu,\"bytes_in\":%llu"
+            : "%sbackend %s connects %llu connect_fails %llu clients %llu bytes_out %llu bytes_in %llu\n";
+        append( buf, size, len, format, ( json && k > 0 ) ? "," : "", sum.m_name, sum.m_connects, sum.m_connect_fails,
+                sum.m_clients, sum.m_bytes_out, sum.m_bytes_in );
+        append_hist( buf, size, len, json, "connect_us", sum.m_connect );
+        append_hist( buf, size, len, json, "ttfb_us", sum.m_ttfb );
+        append_hist( buf, size, len, json, "duration_us", sum.m_duration );
+        append( buf, size, len, "%s", json ? "}" : "" );
+    }
+    append( buf, size, len, "%s", json ? "]}\n" : "" );
+    return len;
+}
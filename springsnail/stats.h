@@ -0,0 +1,102 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <sys/types.h>
+
+// 子进程发送给父进程的负载信息。管道是SOCK_SEQPACKET类型的，每条消息就是一个完整的child_stats，
+// 父进程每次recv恰好收到一条，一直读到EAGAIN，只保留最新的一条
+struct child_stats
+{
+    int m_active_conns;     //正在被客户使用的连接数
+    int m_pool_depth;       //空闲（已连接好、可以分配给新客户）的服务端连接数
+    unsigned long long m_bytes_relayed; //累计转发的字节数（两个方向之和）
+    unsigned long long m_eagain_cnt;    //累计写socket时遇到EAGAIN的次数，反映对端接收缓慢的程度
+    int m_loop_p99_us;      //上一个统计周期内事件循环每轮处理时间的p99（微秒）
+    int m_waiting_clts;     //正在排队等待服务端连接的客户数
+    unsigned long long m_pool_hits;     //累计直接从连接池拿到连接的客户数
+    unsigned long long m_pool_waits;    //累计需要排队等待的客户数
+    unsigned long long m_wait_timeouts; //累计等待超时或者队列已满被拒绝的客户数
+    unsigned long long m_wait_ms;       //排队后拿到连接的客户累计等待的时间（毫秒）
+};
+
+// 仿照HdrHistogram的对数线性直方图：小于SUB的值每个值一个桶，之后每个2的幂区间再等分为SUB个桶，
+// 相对误差不超过1/SUB，记录只需要几次整数运算。值的单位是微秒，超过2^MAX_BITS的值记在最后一个桶中
+class latency_hist
+{
+public:
+    void record( long long us )
+    {
+        if( us < 0 )
+        {
+            us = 0;
+        }
+        ++m_count;
+        m_sum += us;
+        if( ( unsigned long long )us > m_max )
+        {
+            m_max = us;
+        }
+        ++m_buckets[ bucket( us ) ];
+    }
+    void merge( const latency_hist& other );    //累加另一个直方图（父进程汇总各个子进程时使用）
+    long long percentile( double p ) const;     //第p百分位的值（所在桶的上界），没有样本时返回0
+
+public:
+    static const int SUB_BITS = 4;
+    static const int SUB = 1 << SUB_BITS;
+    static const int MAX_BITS = 36;     //约19个小时
+    static const int BUCKETS = ( MAX_BITS - SUB_BITS + 1 ) * SUB;
+
+    unsigned long long m_count;
+    unsigned long long m_sum;
+    unsigned long long m_max;
+    unsigned long long m_buckets[ BUCKETS ];
+
+private:
+    static int bucket( unsigned long long us )
+    {
+        if( us < ( unsigned long long )SUB )
+        {
+            return ( int )us;
+        }
+        if( us >= ( 1ULL << MAX_BITS ) )
+        {
+            return BUCKETS - 1;
+        }
+        int exp = 63 - __builtin_clzll( us );   //最高位，不小于SUB_BITS
+        return ( exp - SUB_BITS + 1 ) * SUB + ( int )( ( us >> ( exp - SUB_BITS ) ) & ( SUB - 1 ) );
+    }
+    static long long upper_bound( int idx );    //第idx个桶中的最大值
+};
+
+static const int BACKEND_NAME_LEN = 64;
+static const int BACKEND_NAME_HOST_LEN = BACKEND_NAME_LEN - 7;  //backend_stats::m_name中地址部分的最大长度，剩下的是":65535"和'\0'
+
+// 子进程在共享内存中维护的每个逻辑主机的统计，由父进程汇总后在管理端口上输出。
+// 子进程只做累加，父进程不加锁地读，读到的值可能是几个计数器之间不完全一致的瞬时状态
+struct backend_stats
+{
+    char m_name[ BACKEND_NAME_LEN ];      //"地址:端口"，为空表示没有使用。地址最多取前BACKEND_NAME_HOST_LEN个字符
+    unsigned long long m_connects;      //成功建立的服务端连接数
+    unsigned long long m_connect_fails; //失败或者超时的连接数
+    unsigned long long m_clients;       //分配（L7模式下是借出）服务端连接的次数
+    unsigned long long m_bytes_out;     //写给服务端的字节数
+    unsigned long long m_bytes_in;      //从服务端读到并写给客户端的字节数
+    latency_hist m_connect;     //非阻塞连接从发起到建立的时间
+    latency_hist m_ttfb;        //客户发来数据之后到服务端发来第一个字节的时间
+    latency_hist m_duration;    //客户占用服务端连接的时间（L4模式下是客户连接的时长，L7模式下是一次借用的时长）
+};
+
+static const int STATS_BACKENDS = 64;   //每个子进程最多统计的逻辑主机数，与mgr中的MAX_BACKENDS相同
+
+// 每个子进程在共享内存中的统计区域，由进程池在fork之前用mmap分配
+struct child_shm
+{
+    backend_stats m_backends[ STATS_BACKENDS ];
+};
+
+// 把n个子进程的负载信息和逻辑主机的统计格式化为文本（json为false）或者JSON，写入buf，返回长度（不超过size - 1）
+int format_stats( char* buf, int size, bool json, const child_stats* stats, const bool* alive, const pid_t* pids,
+                  const child_shm* shm, int n );
+
+#endif
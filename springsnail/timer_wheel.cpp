@@ -0,0 +1,169 @@
+#include <stddef.h>
+#include "timer_wheel.h"
+
+timer_wheel::timer_wheel( long long now_ms ) : m_cur( now_ms / TI )
+{
+    for( int i = 0; i < LEVELS; ++i )
+    {
+        m_counts[ i ] = 0;
+        for( int j = 0; j < SLOTS; ++j )
+        {
+            m_slots[ i ][ j ].m_prev = m_slots[ i ][ j ].m_next = &m_slots[ i ][ j ];
+        }
+    }
+    m_expired.m_prev = m_expired.m_next = &m_expired;
+}
+
+void timer_wheel::link( tw_timer* head, tw_timer* timer )
+{
+    timer->m_prev = head->m_prev;
+    timer->m_next = head;
+    head->m_prev->m_next = timer;
+    head->m_prev = timer;
+}
+
+/*到期时间距离当前滴答不到SLOTS^(i+1)个滴答的定时器放在第i层，槽号是到期滴答数的第i组LEVEL_BITS位。
+  第i层的这个槽会在当前滴答的低i组位都为0、第i组位等于槽号时被cascade，那时到期滴答还没到*/
+void timer_wheel::place( tw_timer* timer )
+{
+    unsigned long long expire = ( timer->m_expire < m_cur ) ? m_cur : timer->m_expire;
+    unsigned long long delta = expire - m_cur;
+    int level = 0;
+    while( level < LEVELS - 1 && delta >= ( 1ULL << ( ( level + 1 ) * LEVEL_BITS ) ) )
+    {
+        ++level;
+    }
+    if( delta >= ( 1ULL << ( LEVELS * LEVEL_BITS ) ) )
+    {
+        //超出时间轮范围的定时器先放在最远的槽中，被cascade时再重新计算位置
+        expire = m_cur + ( 1ULL << ( LEVELS * LEVEL_BITS ) ) - 1;
+    }
+    int slot = ( expire >> ( level * LEVEL_BITS ) ) & ( SLOTS - 1 );
+    timer->m_level = level;
+    link( &m_slots[ level ][ slot ], timer );
+    ++m_counts[ level ];
+}
+
+void timer_wheel::add( tw_timer* timer, long long expire_ms )
+{
+    del( timer );
+    timer->m_expire = ( expire_ms + TI - 1 ) / TI;  //向上取整，定时器不会提前到期
+    place( timer );
+}
+
+void timer_wheel::del( tw_timer* timer )
+{
+    if( !timer->armed() )
+    {
+        return;
+    }
+    timer->m_prev->m_next = timer->m_next;
+    timer->m_next->m_prev = timer->m_prev;
+    timer->m_prev = timer->m_next = NULL;
+    if( timer->m_level >= 0 )
+    {
+        --m_counts[ timer->m_level ];
+    }
+}
+
+void timer_wheel::cascade( int level )
+{
+    tw_timer* head = &m_slots[ level ][ ( m_cur >> ( level * LEVEL_BITS ) ) & ( SLOTS - 1 ) ];
+    while( head->m_next != head )
+    {
+        tw_timer* timer = head->m_next;
+        del( timer );
+        place( timer );
+    }
+}
+
+/*m_cur是下一个要处理的滴答。第0层的槽号回到0时，先把上一层对应的槽分配下来（上一层的槽号也回到0时继续向上），
+  再把第0层当前槽中的定时器都移到到期链表中*/
+void timer_wheel::tick()
+{
+    for( int level = 1; level < LEVELS; ++level )
+    {
+        if( ( m_cur & ( ( 1ULL << ( level * LEVEL_BITS ) ) - 1 ) ) != 0 )
+        {
+            break;
+        }
+        cascade( level );
+    }
+    tw_timer* head = &m_slots[ 0 ][ m_cur & ( SLOTS - 1 ) ];
+    while( head->m_next != head )
+    {
+        tw_timer* timer = head->m_next;
+        del( timer );
+        timer->m_level = -1;
+        link( &m_expired, timer );
+    }
+    ++m_cur;
+}
+
+tw_timer* timer_wheel::expire( long long now_ms )
+{
+    unsigned long long target = now_ms / TI;
+    while( m_cur <= target )
+    {
+        if( size() == 0 )
+        {
+            //时间轮是空的，直接转到目标位置
+            m_cur = target + 1;
+            break;
+        }
+        tick();
+    }
+    if( m_expired.m_next == &m_expired )
+    {
+        return NULL;
+    }
+    tw_timer* timer = m_expired.m_next;
+    del( timer );
+    return timer;
+}
+
+int timer_wheel::get_wait_time( long long now_ms, int max_wait ) const
+{
+    if( m_expired.m_next != &m_expired )
+    {
+        return 0;
+    }
+    long long wait = max_wait;
+    //第0层的定时器：从当前槽开始找第一个不空的槽
+    if( m_counts[ 0 ] > 0 )
+    {
+        for( int i = 0; i < SLOTS; ++i )
+        {
+            const tw_timer* head = &m_slots[ 0 ][ ( m_cur + i ) & ( SLOTS - 1 ) ];
+            if( head->m_next != head )
+            {
+                wait = ( long long )( m_cur + i ) * TI - now_ms;
+                break;
+            }
+        }
+    }
+    //上层的定时器在第0层的槽号回到0时才会被分配下来，最晚要在那时转动时间轮
+    if( size() > m_counts[ 0 ] )
+    {
+        long long boundary = ( long long )( ( m_cur + SLOTS - 1 ) & ~( unsigned long long )( SLOTS - 1 ) ) * TI - now_ms;
+        if( boundary < wait )
+        {
+            wait = boundary;
+        }
+    }
+    if( wait < 0 )
+    {
+        return 0;
+    }
+    return ( wait < max_wait ) ? ( int )wait : max_wait;
+}
+
+int timer_wheel::size() const
+{
+    int cnt = 0;
+    for( int i = 0; i < LEVELS; ++i )
+    {
+        cnt += m_counts[ i ];
+    }
+    return cnt;
+}
@@ -0,0 +1,54 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+
+// 分层时间轮，在chapter11_timer/11.4_1_time_wheel.cpp的基础上做了三点改动：
+// 1. 定时器嵌入在被定时的对象（conn）中，添加和删除都不分配内存，每个槽是带哨兵的双向循环链表，删除时不需要知道槽号；
+// 2. 用LEVELS层、每层SLOTS个槽代替单层时间轮加圈数，第i层的一个槽对应SLOTS^i个滴答，
+//    上层的槽转到时把其中的定时器重新分配到下层（cascade），添加、删除都是O(1)，每个滴答只处理到期的槽；
+// 3. 不使用回调函数，到期的定时器由调用者通过expire()逐个取出处理
+class tw_timer
+{
+public:
+    tw_timer() : m_prev( NULL ), m_next( NULL ), m_expire( 0 ), m_level( -1 ), m_data( NULL ){}
+    bool armed() const { return m_next != NULL; }
+
+public:
+    tw_timer* m_prev;
+    tw_timer* m_next;   //为NULL表示定时器没有在时间轮中
+    unsigned long long m_expire;    //到期的滴答数
+    int m_level;        //所在的层，-1表示已经到期
+    void* m_data;       //定时器所属的对象
+};
+
+class timer_wheel
+{
+public:
+    timer_wheel( long long now_ms );  //now_ms是单调时钟的当前时间（毫秒），之后的时间都使用同一个时钟
+    void add( tw_timer* timer, long long expire_ms ); //在expire_ms时刻（单调时钟的毫秒数）到期，已经在时间轮中时先删除
+    void del( tw_timer* timer );    //定时器不在时间轮中时什么也不做
+    tw_timer* expire( long long now_ms );   //转到now_ms，取出一个到期的定时器，没有时返回NULL
+    int get_wait_time( long long now_ms, int max_wait ) const;  //距离下一次需要转动时间轮的毫秒数，不超过max_wait
+    int size() const;   //还没有到期的定时器数
+
+public:
+    static const int TI = 10;   //滴答的间隔（毫秒）
+
+private:
+    void link( tw_timer* head, tw_timer* timer );
+    void place( tw_timer* timer );  //按到期时间把定时器放到合适的层和槽
+    void cascade( int level );      //把第level层当前的槽中的定时器重新分配到下层
+    void tick();    //转动一个滴答，把第0层当前槽中的定时器移到m_expired中
+
+private:
+    static const int LEVEL_BITS = 6;
+    static const int SLOTS = 1 << LEVEL_BITS;   //每层的槽数
+    static const int LEVELS = 4;    //共SLOTS^LEVELS个滴答，约46小时，更晚的定时器放在最上层的最后一个槽中
+    tw_timer m_slots[ LEVELS ][ SLOTS ];    //每个槽的哨兵
+    int m_counts[ LEVELS ];     //每层的定时器数
+    tw_timer m_expired;     //已经到期、还没有被取走的定时器
+    unsigned long long m_cur;   //下一个要处理的滴答
+};
+
+#endif
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "timer_wheel.h"
+
+// 时间轮的微基准：CONNS个连接各有一个空闲超时的定时器，比较
+// 1. 原来的做法：每轮事件循环遍历所有连接比较超时时刻；
+// 2. 时间轮：每次活动都删除再添加定时器（立即重新计时）；
+// 3. 时间轮：活动时只记录时刻，定时器到期时再按新的时刻重新加入（mgr中的做法）
+// 编译：make wheel_bench
+
+static const int CONNS = 10000;
+static const int LOOPS = 2000;          //事件循环的轮数，每轮经过1毫秒
+static const int EVENTS = 64;           //每轮有活动的连接数
+static const int IDLE_TIMEOUT = 60000;
+
+struct item
+{
+    tw_timer m_timer;
+    long long m_last_active;
+};
+
+static long long get_cur_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( long long )ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main()
+{
+    static item items[ CONNS ];
+    static int active[ LOOPS ][ EVENTS ];
+    srand( 1 );
+    for( int i = 0; i < LOOPS; ++i )
+    {
+        for( int j = 0; j < EVENTS; ++j )
+        {
+            active[i][j] = rand() % CONNS;
+        }
+    }
+    long long base = 1000000;
+    int expired = 0;
+
+    //遍历
+    for( int i = 0; i < CONNS; ++i )
+    {
+        items[i].m_last_active = base;
+    }
+    long long start = get_cur_ns();
+    for( int t = 0; t < LOOPS; ++t )
+    {
+        long long now = base + t;
+        for( int j = 0; j < EVENTS; ++j )
+        {
+            items[ active[t][j] ].m_last_active = now;
+        }
+        for( int i = 0; i < CONNS; ++i )
+        {
+            expired += ( items[i].m_last_active + IDLE_TIMEOUT <= now );
+        }
+    }
+    double scan_ns = ( double )( get_cur_ns() - start ) / LOOPS;
+
+    //每次活动都重新计时
+    {
+        timer_wheel wheel( base );
+        for( int i = 0; i < CONNS; ++i )
+        {
+            items[i].m_timer.m_data = &items[i];
+            wheel.add( &items[i].m_timer, base + IDLE_TIMEOUT );
+        }
+        start = get_cur_ns();
+        for( int t = 0; t < LOOPS; ++t )
+        {
+            long long now = base + t;
+            for( int j = 0; j < EVENTS; ++j )
+            {
+                wheel.add( &items[ active[t][j] ].m_timer, now + IDLE_TIMEOUT );
+            }
+            while( wheel.expire( now ) )
+            {
+                ++expired;
+            }
+        }
+    }
+    double rearm_ns = ( double )( get_cur_ns() - start ) / LOOPS;
+
+    //只记录活动时刻
+    {
+        timer_wheel wheel( base );
+        for( int i = 0; i < CONNS; ++i )
+        {
+            items[i].m_timer = tw_timer();
+            items[i].m_timer.m_data = &items[i];
+            items[i].m_last_active = base;
+            wheel.add( &items[i].m_timer, base + IDLE_TIMEOUT );
+        }
+        start = get_cur_ns();
+        for( int t = 0; t < LOOPS; ++t )
+        {
+            long long now = base + t;
+            for( int j = 0; j < EVENTS; ++j )
+            {
+                items[ active[t][j] ].m_last_active = now;
+            }
+            tw_timer* timer = NULL;
+            while( ( timer = wheel.expire( now ) ) )
+            {
+                item* tmp = ( item* )timer->m_data;
+                if( tmp->m_last_active + IDLE_TIMEOUT > now )
+                {
+                    wheel.add( timer, tmp->m_last_active + IDLE_TIMEOUT );
+                    continue;
+                }
+                ++expired;
+            }
+        }
+    }
+    double lazy_ns = ( double )( get_cur_ns() - start ) / LOOPS;
+
+    printf( "%d conns, %d events per loop   scan %8.1f ns   wheel rearm %6.1f ns   wheel lazy %6.1f ns   per loop (%d expired)\n",
+            CONNS, EVENTS, scan_ns, rearm_ns, lazy_ns, expired );
+    return 0;
+}